@@ -10,7 +10,13 @@ clang++ -std=c++17 -O2 -o ..\runtime\runtime_x64.exe ..\runtime\runtime.cpp || e
 clang++ -std=c++17 -O2 -m32 -o ..\runtime\runtime_x86.exe ..\runtime\runtime.cpp || exit /b 1
 clang++ -std=c++17 -O2 -o tools\embed_runtimes.exe tools\embed_runtimes.cpp || exit /b 1
 tools\embed_runtimes.exe ..\runtime\runtime_x64.exe ..\runtime\runtime_x86.exe src\embedded_runtime_x64.h src\embedded_runtime_x86.h || exit /b 1
-clang++ -std=c++17 -O2 -o scc.exe src\main.cpp || exit /b 1
+clang++ -std=c++17 -O2 -c -o src\scc.o src\scc.cpp || exit /b 1
+clang++ -std=c++17 -O2 -c -o src\emit_cpp.o src\emit_cpp.cpp || exit /b 1
+clang++ -std=c++17 -O2 -c -o src\lanes.o src\lanes.cpp || exit /b 1
+llvm-ar rcs scc.lib src\scc.o src\emit_cpp.o src\lanes.o || exit /b 1
+clang++ -std=c++17 -O2 -o scc.exe src\main.cpp scc.lib || exit /b 1
+clang++ -std=c++17 -O2 -o bench\bench.exe bench\bench.cpp || exit /b 1
+clang++ -std=c++17 -O2 -o bench\vm_core_bench.exe bench\vm_core_bench.cpp scc.lib || exit /b 1
 del /q runtime_x64.exe runtime_x86.exe 2>nul
 cd /d .. || exit /b 1
 clang++ -std=c++17 -O2 -o repl.exe repl\repl.cpp || exit /b 1
@@ -0,0 +1,22 @@
+// Arithmetic-heavy loop with no calls: nearly every instruction is a push or
+// a binary operator. All values stay well inside int range.
+int main() {
+    int hash = 17;
+    int acc = 0;
+    int i = 0;
+    while (i < 2000000) {
+        hash = hash * 31 + i - (i / 1000) * 1000;
+        hash = hash - (hash / 65521) * 65521;
+        acc = acc + (hash * 3 - i / 977) / 5 + (hash + 3) * (hash - 3) / 4096 - hash * 2;
+        if (acc > 1000000) {
+            acc = acc - 999983;
+        }
+        if (acc < 0 - 1000000) {
+            acc = acc + 999983;
+        }
+        i = i + 1;
+    }
+    print(acc);
+    print(hash);
+    return 0;
+}
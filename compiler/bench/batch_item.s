@@ -0,0 +1,24 @@
+// A short script of the kind batch jobs run by the thousand.
+int collatz(int n) {
+    int steps = 0;
+    while (n != 1) {
+        if (n - (n / 2) * 2 == 0) {
+            n = n / 2;
+        } else {
+            n = 3 * n + 1;
+        }
+        steps = steps + 1;
+    }
+    return steps;
+}
+
+int main() {
+    int i = 1;
+    int total = 0;
+    while (i < 500) {
+        total = total + collatz(i);
+        i = i + 1;
+    }
+    print(total);
+    return 0;
+}
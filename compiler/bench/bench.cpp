@@ -0,0 +1,758 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static string getExeDir(char** argv) {
+    filesystem::path p = filesystem::path(argv[0]);
+    if (p.has_parent_path()) return p.parent_path().string();
+    return filesystem::current_path().string();
+}
+
+static string quote(const string& s) {
+    return "\"" + s + "\"";
+}
+
+// Runs a shell command with its output discarded and returns its wall time in ms.
+static double timeCommand(const string& cmd) {
+#ifdef _WIN32
+    string full = "cmd /c \"" + cmd + " > NUL 2>&1\"";
+#else
+    string full = cmd + " > /dev/null 2>&1";
+#endif
+    auto start = chrono::steady_clock::now();
+    int rc = system(full.c_str());
+    auto end = chrono::steady_clock::now();
+    if (rc != 0) throw runtime_error("Command failed: " + cmd);
+    return chrono::duration<double, milli>(end - start).count();
+}
+
+static double bestOf(int repeat, const string& cmd) {
+    double best = timeCommand(cmd);
+    for (int i = 1; i < repeat; ++i) best = min(best, timeCommand(cmd));
+    return best;
+}
+
+static string readText(const string& path) {
+    ifstream in(path, ios::binary);
+    return string((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+}
+
+// Runs a command with stdout and stderr captured to a file; returns the exit status.
+static int runCaptured(const string& cmd, const string& outFile) {
+#ifdef _WIN32
+    string full = "cmd /c \"" + cmd + " > " + quote(outFile) + " 2>&1\"";
+#else
+    string full = cmd + " > " + quote(outFile) + " 2>&1";
+#endif
+    return system(full.c_str());
+}
+
+static void benchScaling(const string& scc, const string& benchDir, int maxThreads, int repeat) {
+    string src = (filesystem::path(benchDir) / "parallel_fib.s").string();
+    cout << "scaling: parallel_fib.s (best of " << repeat << ")\n";
+    cout << "threads    ms    speedup\n";
+    double base = 0;
+    for (int t = 1; t <= maxThreads; ++t) {
+        double ms = bestOf(repeat, quote(scc) + " --run --threads " + to_string(t) + " " + quote(src));
+        if (t == 1) base = ms;
+        cout << setw(7) << t << setw(8) << fixed << setprecision(1) << ms
+             << setw(10) << setprecision(2) << base / ms << "x\n";
+    }
+}
+
+// Compares interpreter variants (--vm) on single-threaded workloads. With
+// perfCounters each variant also runs once with --perf-counters, and its
+// "perf" lines are passed on prefixed with the workload and variant.
+static void benchVM(const string& scc, const string& benchDir, int repeat, bool perfCounters) {
+    const vector<string> workloads = {"hot_loops.s", "arith_loops.s"};
+    const vector<string> variants = {"basic", "quicken", "tos"};
+    string log = (filesystem::temp_directory_path() / "scc_bench_perf.txt").string();
+    cout << "vm: interpreter variants (best of " << repeat << ")\n";
+    for (const auto& w : workloads) {
+        string src = (filesystem::path(benchDir) / w).string();
+        double base = 0;
+        for (const auto& v : variants) {
+            string run = quote(scc) + " --run --threads 1 --vm " + v + " " + quote(src);
+            double ms = bestOf(repeat, run + " 2>&1");
+            if (base == 0) base = ms;
+            cout << setw(14) << w << setw(10) << v << setw(9) << fixed << setprecision(1) << ms << " ms"
+                 << setw(8) << setprecision(2) << base / ms << "x\n";
+            if (!perfCounters) continue;
+            if (runCaptured(run + " --perf-counters", log) != 0) throw runtime_error("Command failed: " + run);
+            istringstream lines(readText(log));
+            for (string line; getline(lines, line);) {
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (line.rfind("perf ", 0) == 0) cout << "perf " << w << " " << v << line.substr(4) << "\n";
+                if (line.rfind("# perf", 0) == 0) cout << line << "\n";
+            }
+        }
+    }
+    if (perfCounters) filesystem::remove(log);
+}
+
+// Records a profile of each workload with --profile-out, then compares a
+// plain run against one compiled with --profile-use.
+static void benchPgo(const string& scc, const string& benchDir, int repeat) {
+    string prof = (filesystem::temp_directory_path() / "scc_bench_prof.dat").string();
+    cout << "pgo: profile-guided layout and inlining (best of " << repeat << ")\n";
+    for (const string w : {"hot_loops.s", "arith_loops.s", "branchy.s"}) {
+        string src = (filesystem::path(benchDir) / w).string();
+        string run = quote(scc) + " --run --threads 1 ";
+        timeCommand(run + "--profile-out " + quote(prof) + " " + quote(src));
+        double base = bestOf(repeat, run + quote(src));
+        double ms = bestOf(repeat, run + "--profile-use " + quote(prof) + " " + quote(src));
+        cout << setw(14) << w << setw(9) << fixed << setprecision(1) << base << " ms" << setw(9) << ms << " ms"
+             << setw(8) << setprecision(2) << base / ms << "x\n";
+    }
+    filesystem::remove(prof);
+}
+
+// Measures what --sample-profile costs on top of a plain run.
+static void benchProfile(const string& scc, const string& benchDir, int repeat) {
+#ifdef _WIN32
+    (void)scc;
+    (void)benchDir;
+    (void)repeat;
+    cout << "profile: skipped (SIGPROF sampling is POSIX only)\n";
+#else
+    string folded = (filesystem::temp_directory_path() / "scc_bench.folded").string();
+    cout << "profile: sampling overhead (best of " << repeat << ")\n";
+    for (const string w : {"hot_loops.s", "parallel_fib.s"}) {
+        string src = (filesystem::path(benchDir) / w).string();
+        string run = quote(scc) + " --run --threads 1 ";
+        double base = bestOf(repeat, run + quote(src));
+        cout << setw(16) << w << setw(8) << "off" << setw(9) << fixed << setprecision(1) << base << " ms\n";
+        for (int hz : {100, 1000}) {
+            double ms = bestOf(repeat, run + "--sample-profile=" + to_string(hz) + " --sample-output " +
+                                           quote(folded) + " " + quote(src));
+            cout << setw(16) << w << setw(8) << hz << setw(9) << ms << " ms" << setw(8) << setprecision(1)
+                 << showpos << (ms / base - 1) * 100 << noshowpos << "%\n";
+        }
+    }
+    filesystem::remove(folded);
+#endif
+}
+
+// Writes a synthetic program of `functions` small functions that call their
+// predecessor, with a stress function every 1000th: 32 nested if/while
+// blocks, 48 levels of parentheses and a 1000-term expression. main calls
+// f<entry>, by default the last one, so it reaches entry + 1 functions.
+// Returns the number of lines written.
+static size_t writeSyntheticProgram(const string& path, int functions, int entry = -1) {
+    ofstream out(path);
+    if (!out) throw runtime_error("Failed to write " + path);
+    size_t lines = 0;
+    for (int i = 0; i < functions; ++i) {
+        out << "int f" << i << "(int a, int b) {\n";
+        out << "    int x = a * 3 + b - " << i % 97 << ";\n";
+        if (i > 0) out << "    if (x > 1000000) {\n        return f" << i - 1 << "(x, b);\n    }\n";
+        out << "    while (x < 0) {\n        x = x + 7;\n    }\n";
+        lines += i > 0 ? 8 : 5;
+        if (i % 1000 == 999) {
+            for (int d = 0; d < 32; ++d) {
+                out << string(4 + d * 4, ' ') << (d % 2 ? "while" : "if") << " (x > " << 1000000 + d << ") {\n";
+            }
+            out << string(132, ' ') << "x = " << string(48, '(') << "x + 1" << string(48, ')') << ";\n";
+            for (int d = 31; d >= 0; --d) out << string(4 + d * 4, ' ') << "}\n";
+            out << "    x = x";
+            for (int t = 0; t < 1000; ++t) out << (t % 3 ? " + " : " - ") << "b * " << t % 10;
+            out << ";\n";
+            lines += 66;
+        }
+        out << "    return x / 2;\n}\n\n";
+        lines += 3;
+    }
+    out << "int main() {\n    f" << (entry < 0 ? functions - 1 : entry) << "(1, 2);\n    return 0;\n}\n";
+    return lines + 4;
+}
+
+// Compile throughput on synthetic programs of growing size; --run executes
+// only a handful of calls, so the time is dominated by the compiler. The
+// last column is the same program with main reaching only 10 functions,
+// whose bodies are the only ones parsed. The largest size also gets a
+// --time-passes breakdown, a 100000-deep parenthesized expression must
+// be rejected by the parser's depth limit, INT_MIN / -1 in a folded call
+// must compile, and many slow constant calls must stay within the total
+// fold budget.
+static void benchCompile(const string& scc, int maxFunctions, int repeat) {
+    string src = (filesystem::temp_directory_path() / "scc_bench_gen.s").string();
+    cout << "compile: synthetic programs (best of " << repeat << ")\n";
+    cout << " functions     lines      MB        ms     lines/s  10 reached\n";
+    int largest = 0;
+    for (int n = 1000; n <= maxFunctions; n *= 10) {
+        size_t lines = writeSyntheticProgram(src, n);
+        double mb = filesystem::file_size(src) / (1024.0 * 1024.0);
+        double ms = bestOf(repeat, quote(scc) + " --run --threads 1 " + quote(src));
+        writeSyntheticProgram(src, n, 9);
+        double some = bestOf(repeat, quote(scc) + " --run --threads 1 " + quote(src));
+        cout << setw(10) << n << setw(10) << lines << setw(8) << fixed << setprecision(1) << mb
+             << setw(10) << ms << setw(12) << setprecision(0) << lines * 1000.0 / ms << setw(9)
+             << setprecision(1) << some << " ms\n";
+        largest = n;
+    }
+    if (largest > 0) {
+        writeSyntheticProgram(src, largest);
+        cout << "--time-passes, " << largest << " functions:\n" << flush;
+        string cmd = quote(scc) + " --run --threads 1 --time-passes " + quote(src);
+#ifdef _WIN32
+        string full = "cmd /c \"" + cmd + " 2>&1 > NUL\"";
+#else
+        string full = cmd + " 2>&1 > /dev/null";
+#endif
+        if (system(full.c_str()) != 0) throw runtime_error("Command failed: " + cmd);
+    }
+
+    {
+        ofstream out(src);
+        out << "int main() {\n    return " << string(100000, '(') << "1" << string(100000, ')') << ";\n}\n";
+    }
+    string cmd = quote(scc) + " --run " + quote(src);
+#ifdef _WIN32
+    string full = "cmd /c \"" + cmd + " 2>&1 | findstr /c:\"Nesting too deep\" > NUL\"";
+#else
+    string full = cmd + " 2>&1 | grep -q 'Nesting too deep'";
+#endif
+    if (system(full.c_str()) != 0) throw runtime_error("Deeply nested input was not rejected cleanly");
+    cout << "depth limit: 100000 nested parentheses rejected\n";
+
+    // INT_MIN / -1 traps on x86 if done natively; folding runs f() while
+    // compiling, even the dead call, so it must wrap there as at run time.
+    {
+        ofstream out(src);
+        out << "int f() {\n    int a = -2147483647 - 1;\n    return a / -1;\n}\n\n"
+               "int main() {\n    if (0) {\n        print(f());\n    }\n    print(f());\n    return 0;\n}\n";
+    }
+    string log = (filesystem::temp_directory_path() / "scc_bench_gen.txt").string();
+    for (const string flags : {"", " --fold-budget 0"}) {
+        string cmd = quote(scc) + " --run" + flags + " " + quote(src);
+        if (runCaptured(cmd, log) != 0 || readText(log).find("-2147483648") != 0) {
+            throw runtime_error("INT_MIN / -1 did not wrap: " + cmd + "\n" + readText(log));
+        }
+    }
+    cout << "INT_MIN / -1: wraps when folded and at run time\n";
+
+    // 100 distinct constant calls, each over the per-call fold budget: the
+    // total budget has to stop folding long before 100 x 10M instructions.
+    {
+        ofstream out(src);
+        out << "int slow(int n) {\n    int i = 0;\n    int s = 0;\n    while (i < 2000000) {\n"
+               "        s = s + i / (n + 3);\n        i = i + 1;\n    }\n    return s;\n}\n\n"
+               "int main() {\n    if (0) {\n";
+        for (int k = 0; k < 100; ++k) out << "        print(slow(" << k << "));\n";
+        out << "    }\n    return 0;\n}\n";
+    }
+    double foldMs = bestOf(repeat, quote(scc) + " --run " + quote(src));
+    cout << "fold budget: 100 slow constant calls compiled and run in " << fixed << setprecision(1) << foldMs
+         << " ms\n";
+    filesystem::remove(log);
+    filesystem::remove(src);
+}
+
+// Startup of compiled executables, which decode a function on its first
+// call: programs of growing size where main reaches 10 functions through a
+// chain of calls, next to ones where it reaches all of them. Only the second
+// column should grow with program size. Executables need the Windows runtime.
+static void benchStartup(const string& scc, int maxFunctions, int repeat) {
+#ifndef _WIN32
+    (void)scc;
+    (void)maxFunctions;
+    (void)repeat;
+    cout << "startup: skipped (compiled executables are Windows only)\n";
+#else
+    filesystem::path tmp = filesystem::temp_directory_path();
+    string src = (tmp / "scc_bench_startup.s").string();
+    string exe = (tmp / "scc_bench_startup.exe").string();
+    string log = (tmp / "scc_bench_startup.txt").string();
+    auto build = [&](int functions, int called) {
+        {
+            ofstream out(src);
+            if (!out) throw runtime_error("Failed to write " + src);
+            for (int i = 0; i < functions; ++i) {
+                out << "int f" << i << "(int d) {\n";
+                if (i > 0) out << "    if (d > 0) {\n        return f" << i - 1 << "(d - 1) + 1;\n    }\n";
+                out << "    return " << i % 97 << ";\n}\n\n";
+            }
+            out << "int main() {\n    print(f" << functions - 1 << "(" << called - 1 << "));\n    return 0;\n}\n";
+        }
+        // Folding would run the chain at compile time.
+        if (runCaptured(quote(scc) + " " + quote(src) + " -o " + quote(exe) + " --fold-budget 0", log) != 0) {
+            throw runtime_error("Failed to build " + exe + ":\n" + readText(log));
+        }
+        return bestOf(repeat, quote(exe));
+    };
+    cout << "startup: compiled executables (best of " << repeat << ")\n";
+    cout << " functions  10 called  all called\n";
+    for (int n = 1000; n <= min(maxFunctions, 100000); n *= 10) {
+        double some = build(n, 10);
+        double all = build(n, n);
+        cout << setw(10) << n << setw(8) << fixed << setprecision(1) << some << " ms" << setw(9) << all << " ms\n";
+    }
+    for (const auto& f : {src, exe, log}) filesystem::remove(f);
+#endif
+}
+
+// Executable size and load time with and without --compress, on the
+// synthetic programs of the compile suite. "first" is the run right after
+// the executable is written, with the file still in the OS cache as far as
+// the OS keeps it; "warm" is the best of the repeats.
+static void benchPayload(const string& scc, int maxFunctions, int repeat) {
+#ifndef _WIN32
+    (void)scc;
+    (void)maxFunctions;
+    (void)repeat;
+    cout << "payload: skipped (compiled executables are Windows only)\n";
+#else
+    filesystem::path tmp = filesystem::temp_directory_path();
+    string src = (tmp / "scc_bench_payload.s").string();
+    string exe = (tmp / "scc_bench_payload.exe").string();
+    string log = (tmp / "scc_bench_payload.txt").string();
+    cout << "payload: compiled executables, raw vs --compress (warm: best of " << repeat << ")\n";
+    cout << setw(10) << "functions" << setw(12) << "payload" << setw(7) << "MB" << setw(10) << "first" << setw(10)
+         << "warm\n";
+    for (int n = 1000; n <= min(maxFunctions, 100000); n *= 10) {
+        writeSyntheticProgram(src, n);
+        for (bool compress : {false, true}) {
+            string cmd = quote(scc) + " " + quote(src) + " -o " + quote(exe) + (compress ? " --compress" : "");
+            if (runCaptured(cmd, log) != 0) throw runtime_error("Failed to build " + exe + ":\n" + readText(log));
+            double mb = filesystem::file_size(exe) / (1024.0 * 1024.0);
+            double first = timeCommand(quote(exe));
+            double warm = bestOf(repeat, quote(exe));
+            cout << setw(10) << n << setw(12) << (compress ? "compressed" : "raw") << setw(7) << fixed
+                 << setprecision(1) << mb << setw(7) << first << " ms" << setw(7) << warm << " ms\n";
+        }
+    }
+    for (const auto& f : {src, exe, log}) filesystem::remove(f);
+#endif
+}
+
+// Runs vm_core_bench, built next to this harness, on hot_loops.s and arith_loops.s.
+static void benchCore(const string& benchDir, int repeat) {
+#ifdef _WIN32
+    string exe = (filesystem::path(benchDir) / "vm_core_bench.exe").string();
+#else
+    string exe = (filesystem::path(benchDir) / "vm_core_bench").string();
+#endif
+    string cmd = quote(exe) + " --repeat " + to_string(repeat);
+    for (const char* w : {"hot_loops.s", "arith_loops.s"}) {
+        cmd += " " + quote((filesystem::path(benchDir) / w).string());
+    }
+#ifdef _WIN32
+    cmd = "cmd /c \"" + cmd + "\"";
+#endif
+    if (system(cmd.c_str()) != 0) throw runtime_error("Command failed: " + cmd);
+}
+
+// Differential test and speedup of --emit-cpp: each workload runs under
+// `scc --run --threads 1` and as a native binary built from the emitted C++
+// with $CXX (default clang++ on Windows, c++ elsewhere); output and exit
+// status must match.
+static void benchEmitCpp(const string& scc, const string& benchDir, int repeat) {
+    const char* env = getenv("CXX");
+#ifdef _WIN32
+    string cxx = env ? env : "clang++";
+    const string exeSuffix = ".exe";
+#else
+    string cxx = env ? env : "c++";
+    const string exeSuffix = "";
+#endif
+    filesystem::path tmp = filesystem::temp_directory_path();
+    string cpp = (tmp / "scc_bench_emit.cpp").string();
+    string exe = (tmp / ("scc_bench_emit" + exeSuffix)).string();
+    string vmOut = (tmp / "scc_bench_vm.txt").string();
+    string nativeOut = (tmp / "scc_bench_native.txt").string();
+
+    cout << "emitcpp: --run vs --emit-cpp built with " << cxx << " -O2 (best of " << repeat << ")\n";
+    for (const string w : {"hot_loops.s", "batch_item.s", "parallel_fib.s"}) {
+        string src = (filesystem::path(benchDir) / w).string();
+        string run = quote(scc) + " --run --threads 1 " + quote(src);
+        int vmStatus = runCaptured(run, vmOut);
+        if (runCaptured(quote(scc) + " " + quote(src) + " --emit-cpp " + quote(cpp), nativeOut) != 0 ||
+            runCaptured(cxx + " -std=c++17 -O2 -o " + quote(exe) + " " + quote(cpp), nativeOut) != 0) {
+            throw runtime_error("Failed to build " + w + " with --emit-cpp:\n" + readText(nativeOut));
+        }
+        int nativeStatus = runCaptured(quote(exe), nativeOut);
+        if (vmStatus != nativeStatus || readText(vmOut) != readText(nativeOut)) {
+            throw runtime_error("Output of " + w + " differs between --run and --emit-cpp");
+        }
+        double vmMs = bestOf(repeat, run);
+        double nativeMs = bestOf(repeat, quote(exe));
+        cout << setw(16) << w << setw(10) << fixed << setprecision(1) << vmMs << " ms vm" << setw(9) << nativeMs
+             << " ms native" << setw(8) << setprecision(1) << vmMs / nativeMs << "x  output matches\n";
+    }
+    for (const auto& f : {cpp, exe, vmOut, nativeOut}) filesystem::remove(f);
+}
+
+// Lane-parallel --map against one call per input: 1M generated argument
+// pairs through score and scoreLoop in score.s with --lanes 1, 8 and 16.
+// Results must match; times are the evaluation alone, as reported by scc.
+// ratio then checks division edge cases.
+static void benchLanes(const string& scc, const string& benchDir, int repeat) {
+    const int kInputs = 1000000;
+    filesystem::path tmp = filesystem::temp_directory_path();
+    string inputs = (tmp / "scc_bench_inputs.txt").string();
+    string outFile = (tmp / "scc_bench_map.txt").string();
+    string errFile = (tmp / "scc_bench_map_err.txt").string();
+    {
+        ofstream out(inputs);
+        if (!out) throw runtime_error("Failed to write " + inputs);
+        uint32_t seed = 12345;
+        for (int i = 0; i < kInputs; ++i) {
+            seed = seed * 1103515245 + 12345;
+            int a = static_cast<int>(seed >> 8) % 30000;
+            seed = seed * 1103515245 + 12345;
+            int b = static_cast<int>(seed >> 8) % 200 - 100;
+            out << a << " " << b << "\n";
+        }
+    }
+    string src = (filesystem::path(benchDir) / "score.s").string();
+    cout << "lanes: --map over " << kInputs << " inputs (best of " << repeat << ")\n";
+    for (const string fn : {"score", "scoreLoop"}) {
+        string expected;
+        double base = 0;
+        for (int lanes : {1, 8, 16}) {
+            string cmd = quote(scc) + " --map " + fn + " " + quote(inputs) + " --lanes " + to_string(lanes) + " " +
+                         quote(src) + " > " + quote(outFile) + " 2> " + quote(errFile);
+#ifdef _WIN32
+            cmd = "cmd /c \"" + cmd + "\"";
+#endif
+            double ms = 0;
+            for (int r = 0; r < repeat; ++r) {
+                if (system(cmd.c_str()) != 0) throw runtime_error("Command failed: " + cmd + "\n" + readText(errFile));
+                string results = readText(outFile);
+                if (lanes == 1 && r == 0) expected = results;
+                else if (results != expected) {
+                    throw runtime_error(fn + " results differ with --lanes " + to_string(lanes));
+                }
+                // "map: N inputs, <lanes>, <ms> ms, ..."
+                string report = readText(errFile);
+                size_t end = report.find(" ms");
+                size_t start = report.rfind(", ", end);
+                if (end == string::npos || start == string::npos) {
+                    throw runtime_error("Unexpected --map report: " + report);
+                }
+                double t = stod(report.substr(start + 2, end - start - 2));
+                if (r == 0 || t < ms) ms = t;
+            }
+            if (lanes == 1) base = ms;
+            cout << setw(12) << fn << setw(4) << lanes << " lanes" << setw(9) << fixed << setprecision(1) << ms
+                 << " ms" << setw(8) << setprecision(2) << base / ms << "x" << (lanes > 1 ? "  results match" : "")
+                 << "\n";
+        }
+    }
+
+    // Lanes divide in floating point, with -1 special-cased; the results
+    // must still be exactly the VM's, INT_MIN / -1 included.
+    {
+        ofstream out(inputs);
+        out << "-2147483648 -1\n-2147483648 1\n2147483647 -1\n-7 2\n7 -2\n-2147483648 -2147483648\n"
+               "1 -2147483648\n2147483647 3\n";
+    }
+    const string expected = "-2147483648\n-2147483648\n-2147483647\n-3\n-3\n1\n0\n715827882\n";
+    for (int lanes : {1, 8, 16}) {
+        string cmd = quote(scc) + " --map ratio " + quote(inputs) + " --lanes " + to_string(lanes) + " " +
+                     quote(src) + " > " + quote(outFile) + " 2> " + quote(errFile);
+#ifdef _WIN32
+        cmd = "cmd /c \"" + cmd + "\"";
+#endif
+        if (system(cmd.c_str()) != 0) throw runtime_error("Command failed: " + cmd + "\n" + readText(errFile));
+        string results = readText(outFile);
+        results.erase(remove(results.begin(), results.end(), '\r'), results.end());
+        if (results != expected) throw runtime_error("ratio results differ with --lanes " + to_string(lanes));
+    }
+    cout << "       ratio  division edge cases match with 1, 8 and 16 lanes\n";
+    for (const auto& f : {inputs, outFile, errFile}) filesystem::remove(f);
+}
+
+// Cost of one call to a native builtin against one call to an equivalent S
+// function: the same 5M-iteration loop runs with no call, with max(i, 7) and
+// with an S-defined smax(i, 7). Per-call cost is the time over the bare loop.
+static void benchNative(const string& scc, int repeat) {
+    const int kCalls = 5000000;
+    string src = (filesystem::temp_directory_path() / "scc_bench_native.s").string();
+    auto timeLoop = [&](const string& body) {
+        {
+            ofstream out(src);
+            if (!out) throw runtime_error("Failed to write " + src);
+            out << "int smax(int a, int b) {\n    if (a > b) {\n        return a;\n    }\n    return b;\n}\n\n"
+                << "int main() {\n    int s = 0;\n    int i = 0;\n    while (i < " << kCalls << ") {\n"
+                << "        s = s + " << body << ";\n        i = i + 1;\n    }\n    print(s);\n    return 0;\n}\n";
+        }
+        return bestOf(repeat, quote(scc) + " --run --threads 1 " + quote(src));
+    };
+    double bare = timeLoop("i");
+    cout << "native: " << kCalls << " calls in a loop (best of " << repeat << ")\n";
+    cout << setw(12) << "no call" << setw(9) << fixed << setprecision(1) << bare << " ms\n";
+    for (const string call : {"max(i, 7)", "smax(i, 7)"}) {
+        double ms = timeLoop(call);
+        cout << setw(12) << call << setw(9) << ms << " ms" << setw(8) << setprecision(1)
+             << max(0.0, ms - bare) * 1e6 / kCalls << " ns/call\n";
+    }
+    filesystem::remove(src);
+}
+
+// Integer input throughput: a program summing every integer read(), run on
+// generated files of small and full-range values. The empty-input run is
+// subtracted, so the rate covers reading and the loop around it.
+static void benchRead(const string& scc, int repeat) {
+    const int kInts = 10000000;
+    filesystem::path tmp = filesystem::temp_directory_path();
+    string src = (tmp / "scc_bench_read.s").string();
+    string input = (tmp / "scc_bench_read.txt").string();
+    {
+        ofstream out(src);
+        if (!out) throw runtime_error("Failed to write " + src);
+        out << "int main() {\n    int s = 0;\n    while (eof() == 0) {\n        s = s + read();\n    }\n"
+            << "    print(s);\n    return 0;\n}\n";
+    }
+    auto run = [&](const string& file) {
+        return bestOf(repeat, quote(scc) + " --run --threads 1 --input " + quote(file) + " " + quote(src));
+    };
+    ofstream(input).close();
+    double empty = run(input);
+    cout << "read: " << kInts << " integers (best of " << repeat << ")\n";
+    cout << "     values      MB        ms      ints/s\n";
+    uint32_t seed = 12345;
+    for (int digits : {3, 10}) {
+        {
+            ofstream out(input, ios::binary);
+            if (!out) throw runtime_error("Failed to write " + input);
+            string buf;
+            for (int i = 0; i < kInts; ++i) {
+                seed = seed * 1103515245u + 12345u;
+                int v = digits == 3 ? int(seed >> 16) % 1000 : int(seed) / 2;
+                buf += to_string(v);
+                buf += i % 10 == 9 ? '\n' : ' ';
+                if (buf.size() > (1 << 16)) {
+                    out << buf;
+                    buf.clear();
+                }
+            }
+            out << buf;
+        }
+        double mb = filesystem::file_size(input) / (1024.0 * 1024.0);
+        double ms = run(input);
+        cout << setw(11) << (digits == 3 ? "0..999" : "full range") << setw(8) << fixed << setprecision(1) << mb
+             << setw(10) << ms << setw(12) << setprecision(0) << kInts * 1000.0 / max(1.0, ms - empty) << "\n";
+    }
+    for (const auto& f : {src, input}) filesystem::remove(f);
+}
+
+// A 128-way selector written as a switch and as the equivalent chain of
+// ifs, called 2M times with keys 0..127 (jump table) and multiples of 1000
+// (binary search). Both versions must print the same sum.
+static void benchSwitch(const string& scc, int repeat) {
+    const int kCases = 128;
+    const int kCalls = 2000000;
+    filesystem::path tmp = filesystem::temp_directory_path();
+    string src = (tmp / "scc_bench_switch.s").string();
+    string log = (tmp / "scc_bench_switch.txt").string();
+    auto run = [&](bool useSwitch, int stride, string& output) {
+        {
+            ofstream out(src);
+            if (!out) throw runtime_error("Failed to write " + src);
+            out << "int sel(int x) {\n";
+            if (useSwitch) out << "    switch (x) {\n";
+            for (int k = 0; k < kCases; ++k) {
+                if (useSwitch) {
+                    out << "        case " << k * stride << ":\n            return " << k * 7 % 13 << ";\n";
+                } else {
+                    out << "    if (x == " << k * stride << ") {\n        return " << k * 7 % 13 << ";\n    }\n";
+                }
+            }
+            if (useSwitch) out << "    }\n";
+            out << "    return -1;\n}\n\n"
+                << "int main() {\n    int s = 0;\n    int i = 0;\n    while (i < " << kCalls << ") {\n"
+                << "        s = s + sel(mod(i * 37, " << kCases + 1 << ") * " << stride << ");\n"
+                << "        i = i + 1;\n    }\n    print(s);\n    return 0;\n}\n";
+        }
+        string cmd = quote(scc) + " --run --threads 1 " + quote(src);
+        if (runCaptured(cmd, log) != 0) throw runtime_error("Command failed: " + cmd + "\n" + readText(log));
+        output = readText(log);
+        return bestOf(repeat, cmd);
+    };
+    cout << "switch: " << kCases << " cases, " << kCalls << " calls (best of " << repeat << ")\n";
+    cout << "   keys    switch  if-chain  speedup\n";
+    for (int stride : {1, 1000}) {
+        string a, b;
+        double table = run(true, stride, a);
+        double chain = run(false, stride, b);
+        if (a != b) throw runtime_error("switch and if-chain outputs differ: " + a + " vs " + b);
+        cout << setw(7) << (stride == 1 ? "dense" : "sparse") << setw(7) << fixed << setprecision(1) << table
+             << " ms" << setw(7) << chain << " ms" << setw(8) << setprecision(2) << chain / table << "x\n";
+    }
+    for (const auto& f : {src, log}) filesystem::remove(f);
+}
+
+// Times one compound condition written three ways, with --entry reporting
+// the median call and the bytecodes each call executes: as nested ifs or
+// arithmetic on 0/1 comparison results, as before && and || existed, and with
+// the logical operators, which compile to fused compare-and-branches.
+static void benchLogic(const string& scc, int repeat) {
+    const int kIterations = 1000000;
+    struct Form {
+        const char* test;
+        const char* form;
+        const char* head; // wraps the hits = hits + 1 statement
+        const char* tail;
+    };
+    const vector<Form> forms = {
+        {"and", "nested", "if (a < 3) { if (b > 1) { ", " } }"},
+        {"and", "arith", "if ((a < 3) * (b > 1)) { ", " }"},
+        {"and", "&&", "if (a < 3 && b > 1) { ", " }"},
+        {"or", "arith", "if ((a == 0) + (b == 0) + (a == b)) { ", " }"},
+        {"or", "||", "if (a == 0 || b == 0 || a == b) { ", " }"},
+    };
+    filesystem::path tmp = filesystem::temp_directory_path();
+    string src = (tmp / "scc_bench_logic.s").string();
+    string log = (tmp / "scc_bench_logic.txt").string();
+    cout << "logic: compound conditions, " << kIterations << " iterations (median of " << repeat << " calls)\n";
+    cout << "  test    form       ms  bytecodes\n";
+    map<string, string> results; // test -> hits, which every form must agree on
+    for (const auto& f : forms) {
+        {
+            ofstream out(src);
+            if (!out) throw runtime_error("Failed to write " + src);
+            out << "int work(int n) {\n    int hits = 0;\n    int i = 0;\n    while (i < n) {\n"
+                << "        int a = i - i / 7 * 7;\n        int b = i - i / 5 * 5;\n"
+                << "        " << f.head << "hits = hits + 1;" << f.tail << "\n"
+                << "        i = i + 1;\n    }\n    return hits;\n}\n";
+        }
+        string cmd = quote(scc) + " --run --entry work --args " + to_string(kIterations) + " --repeat " +
+                     to_string(repeat) + " " + quote(src);
+        if (runCaptured(cmd, log) != 0) throw runtime_error("Command failed: " + cmd + "\n" + readText(log));
+        string text = readText(log);
+        string hits = text.substr(0, text.find_first_of("\r\n"));
+        if (!results.emplace(f.test, hits).second && results[f.test] != hits) {
+            throw runtime_error(string(f.test) + " forms disagree: " + results[f.test] + " vs " + hits);
+        }
+        size_t median = text.find("median ");
+        size_t perCall = text.find(" instructions/call");
+        if (median == string::npos || perCall == string::npos) throw runtime_error("Unexpected output: " + text);
+        size_t countStart = text.rfind(' ', perCall - 1) + 1;
+        double ms = stod(text.substr(median + 7)) / 1000.0;
+        cout << setw(6) << f.test << setw(8) << f.form << setw(9) << fixed << setprecision(1) << ms
+             << setw(11) << text.substr(countStart, perCall - countStart) << "\n";
+    }
+    for (const auto& f : {src, log}) filesystem::remove(f);
+}
+
+static string writeManifest(const string& benchDir, const string& item, int count) {
+    string itemPath = (filesystem::path(benchDir) / item).string();
+    string manifest = (filesystem::temp_directory_path() / "scc_bench_batch.txt").string();
+    ofstream out(manifest);
+    if (!out) throw runtime_error("Failed to write " + manifest);
+    for (int i = 0; i < count; ++i) out << itemPath << "\n";
+    return manifest;
+}
+
+// Runs one manifest of many small programs through --run-batch with 1..N jobs.
+static void benchBatch(const string& scc, const string& benchDir, int maxThreads, int repeat) {
+    const int kPrograms = 256;
+    string manifest = writeManifest(benchDir, "batch_item.s", kPrograms);
+    cout << "batch: " << kPrograms << " x batch_item.s (best of " << repeat << ")\n";
+    cout << "   jobs    ms  programs/s  speedup\n";
+    double base = 0;
+    for (int j = 1; j <= maxThreads; ++j) {
+        double ms = bestOf(repeat, quote(scc) + " --run-batch " + quote(manifest) + " --jobs " + to_string(j));
+        if (j == 1) base = ms;
+        cout << setw(7) << j << setw(8) << fixed << setprecision(1) << ms
+             << setw(12) << setprecision(0) << kPrograms * 1000.0 / ms
+             << setw(8) << setprecision(2) << base / ms << "x\n";
+    }
+    filesystem::remove(manifest);
+}
+
+// Time-slices 1000 resident VMs at a few slice sizes; scc prints the
+// throughput, per-slice overhead and fairness line for each run.
+static void benchSlicing(const string& scc, const string& benchDir, int maxThreads) {
+    const int kPrograms = 1000;
+    string manifest = writeManifest(benchDir, "batch_item.s", kPrograms);
+    cout << "slicing: " << kPrograms << " x batch_item.s, " << maxThreads << " jobs\n";
+    for (int fuel : {100, 1000, 10000}) {
+        cout << "fuel " << fuel << ": " << flush;
+        string cmd = quote(scc) + " --run-batch " + quote(manifest) + " --jobs " + to_string(maxThreads) +
+                     " --fuel " + to_string(fuel);
+#ifdef _WIN32
+        string full = "cmd /c \"" + cmd + " | findstr /b slicing:\"";
+#else
+        string full = cmd + " | grep '^slicing:'";
+#endif
+        if (system(full.c_str()) != 0) throw runtime_error("Command failed: " + cmd);
+    }
+    filesystem::remove(manifest);
+}
+
+int main(int argc, char** argv) {
+    try {
+        if (argc < 2) {
+            cerr << "Usage: bench <scc.exe> [suite...] [--threads N] [--repeat N] [--max-functions N] [--perf-counters]\n";
+            cerr << "Suites: scaling batch slicing vm core emitcpp lanes native read switch logic pgo profile "
+                    "compile startup payload (default: all)\n";
+            return 1;
+        }
+        string scc = argv[1];
+        int maxThreads = max(1, static_cast<int>(thread::hardware_concurrency()));
+        int repeat = 3;
+        int maxFunctions = 1000000;
+        bool perfCounters = false;
+        vector<string> suites;
+        for (int argi = 2; argi < argc; ++argi) {
+            string arg = argv[argi];
+            if (arg == "--threads" && argi + 1 < argc) {
+                maxThreads = stoi(argv[++argi]);
+            } else if (arg == "--repeat" && argi + 1 < argc) {
+                repeat = stoi(argv[++argi]);
+            } else if (arg == "--max-functions" && argi + 1 < argc) {
+                maxFunctions = stoi(argv[++argi]);
+            } else if (arg == "--perf-counters") {
+                perfCounters = true;
+            } else if (arg.rfind("--", 0) != 0) {
+                suites.push_back(arg);
+            } else {
+                throw runtime_error("Unexpected argument: " + arg);
+            }
+        }
+        if (suites.empty()) {
+            suites = {"scaling", "batch", "slicing", "vm",    "core",    "emitcpp", "lanes",  "native",
+                      "read",    "switch", "logic",   "pgo", "profile", "compile", "startup", "payload"};
+        }
+
+        string benchDir = getExeDir(argv);
+        for (const auto& suite : suites) {
+            if (suite == "scaling") benchScaling(scc, benchDir, maxThreads, repeat);
+            else if (suite == "batch") benchBatch(scc, benchDir, maxThreads, repeat);
+            else if (suite == "slicing") benchSlicing(scc, benchDir, maxThreads);
+            else if (suite == "vm") benchVM(scc, benchDir, repeat, perfCounters);
+            else if (suite == "core") benchCore(benchDir, repeat);
+            else if (suite == "emitcpp") benchEmitCpp(scc, benchDir, repeat);
+            else if (suite == "lanes") benchLanes(scc, benchDir, repeat);
+            else if (suite == "native") benchNative(scc, repeat);
+            else if (suite == "read") benchRead(scc, repeat);
+            else if (suite == "switch") benchSwitch(scc, repeat);
+            else if (suite == "logic") benchLogic(scc, repeat);
+            else if (suite == "pgo") benchPgo(scc, benchDir, repeat);
+            else if (suite == "profile") benchProfile(scc, benchDir, repeat);
+            else if (suite == "compile") benchCompile(scc, maxFunctions, repeat);
+            else if (suite == "startup") benchStartup(scc, maxFunctions, repeat);
+            else if (suite == "payload") benchPayload(scc, maxFunctions, repeat);
+            else throw runtime_error("Unknown suite: " + suite);
+        }
+        return 0;
+    } catch (const exception& ex) {
+        cerr << "Error: " << ex.what() << "\n";
+        return 1;
+    }
+}
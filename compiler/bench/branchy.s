@@ -0,0 +1,29 @@
+// Branchy loop for the pgo bench: a mostly-true if/else and hot calls to
+// small leaf functions.
+int sq(int x) {
+    return x * x;
+}
+
+int step(int a, int b) {
+    int t = a - b;
+    if (t < 0) {
+        return 0 - t;
+    }
+    return t;
+}
+
+int main() {
+    int i = 0;
+    int sum = 0;
+    while (i < 3000000) {
+        if (i / 7 * 7 != i) {
+            sum = sum + sq(i / 1000) + step(i, 1500000);
+        } else {
+            sum = sum - 1;
+        }
+        sum = sum / 2;
+        i = i + 1;
+    }
+    print(sum);
+    return 0;
+}
@@ -0,0 +1,25 @@
+// Loop-heavy code with the sequences the quickening VM specializes:
+// counted loops (load-compare-branch), division by constants and calls.
+int digitSum(int n) {
+    int sum = 0;
+    while (n > 0) {
+        sum = sum + (n - (n / 10) * 10);
+        n = n / 10;
+    }
+    return sum;
+}
+
+int main() {
+    int total = 0;
+    int i = 0;
+    while (i < 300000) {
+        int j = 0;
+        while (j < 4) {
+            total = total + digitSum(i + j) / 3;
+            j = j + 1;
+        }
+        i = i + 1;
+    }
+    print(total);
+    return 0;
+}
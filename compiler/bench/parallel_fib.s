@@ -0,0 +1,21 @@
+int fib(int n) {
+    if (n < 2) {
+        return n;
+    }
+    return fib(n - 1) + fib(n - 2);
+}
+
+// Splits into tasks until the subproblem is small enough to run inline.
+int pfib(int n) {
+    if (n < 22) {
+        return fib(n);
+    }
+    int left = spawn(pfib, n - 1);
+    int right = pfib(n - 2);
+    return join(left) + right;
+}
+
+int main() {
+    print(pfib(32));
+    return 0;
+}
@@ -0,0 +1,45 @@
+// Scoring functions for the lanes suite (scc --map). score is branchy
+// straight-line code; scoreLoop adds a loop whose trip count varies by input,
+// so lanes diverge.
+int score(int a, int b) {
+    int x = a * 3 + b * 7 - 11;
+    int y = (a - b) * (a + b) / 13;
+    int s = x * x / 97 + y - a / 7;
+    if (s > 1000) {
+        s = s - 1000;
+    } else {
+        s = s + b * 2;
+    }
+    if (x < y) {
+        s = s + (x - y) * 5 / 3;
+    }
+    s = s - (a + 1) * (b - 1) / 11 + x / 5 - y / 9;
+    return s * 3 + x - y + a * b;
+}
+
+int scoreLoop(int a, int b) {
+    int s = 0;
+    int i = 0;
+    while (i < a / 1000) {
+        if (i * b > 50) {
+            s = s + i * 3 - b;
+        } else {
+            s = s - i + b * 2;
+        }
+        i = i + 1;
+    }
+    return s * 7 / 3;
+}
+
+// Division edge cases for the lanes suite, which checks --map results
+// for INT_MIN / -1 and other signs against --lanes 1.
+int ratio(int a, int b) {
+    return a / b;
+}
+
+int main() {
+    print(score(1234, 56));
+    print(scoreLoop(12345, 6));
+    print(ratio(-7, 2));
+    return 0;
+}
@@ -0,0 +1,210 @@
+// Runs S programs through the shared VM core (src/vm_core.h) under several
+// policies and through a copy of the hand-written loop the core replaced, so
+// instrumentation that is switched off can be checked to cost nothing, and
+// through the top-of-stack caching interpreter.
+// Output from print() is discarded in every variant; spawn is not supported.
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../src/scc.h"
+#include "../src/vm_core.h"
+
+using namespace std;
+using namespace svm;
+using scc::Program;
+
+// The interpreter loop as it was written out by hand in runtime.cpp before
+// the core existed, with output discarded.
+static int handWritten(const Program& program, int entryFunc, Worker& worker) {
+    const vector<scc::Function>& functions = program.functions;
+    const vector<string>& strings = program.strings;
+    vector<int>& stack = worker.stack;
+    vector<Frame>& callStack = worker.callStack;
+    const size_t baseDepth = callStack.size();
+
+    int funcIndex = entryFunc;
+    int ip = 0;
+    vector<int> locals(functions[funcIndex].numLocals, 0);
+
+    auto pop = [&]() {
+        int v = stack.back();
+        stack.pop_back();
+        return v;
+    };
+
+    while (true) {
+        const vector<int>& code = functions[funcIndex].code;
+        if (ip >= static_cast<int>(code.size())) {
+            throw runtime_error("Instruction pointer out of range");
+        }
+        int op = code[ip++];
+        switch (op) {
+            case OP_PUSH_INT: stack.push_back(code[ip++]); break;
+            case OP_LOAD: stack.push_back(locals.at(code[ip++])); break;
+            case OP_STORE: {
+                int idx = code[ip++];
+                locals.at(idx) = pop();
+                break;
+            }
+            case OP_ADD: { int b = pop(), a = pop(); stack.push_back(a + b); break; }
+            case OP_SUB: { int b = pop(), a = pop(); stack.push_back(a - b); break; }
+            case OP_MUL: { int b = pop(), a = pop(); stack.push_back(a * b); break; }
+            case OP_DIV: {
+                int b = pop(), a = pop();
+                if (b == 0) throw runtime_error("Division by zero");
+                stack.push_back(a / b);
+                break;
+            }
+            case OP_EQ: { int b = pop(), a = pop(); stack.push_back(a == b ? 1 : 0); break; }
+            case OP_NE: { int b = pop(), a = pop(); stack.push_back(a != b ? 1 : 0); break; }
+            case OP_LT: { int b = pop(), a = pop(); stack.push_back(a < b ? 1 : 0); break; }
+            case OP_LE: { int b = pop(), a = pop(); stack.push_back(a <= b ? 1 : 0); break; }
+            case OP_GT: { int b = pop(), a = pop(); stack.push_back(a > b ? 1 : 0); break; }
+            case OP_GE: { int b = pop(), a = pop(); stack.push_back(a >= b ? 1 : 0); break; }
+            case OP_JMP: ip = code[ip]; break;
+            case OP_JMP_IF_FALSE: {
+                int target = code[ip++];
+                int cond = pop();
+                if (cond == 0) ip = target;
+                break;
+            }
+            case OP_JMP_IF_TRUE: {
+                int target = code[ip++];
+                int cond = pop();
+                if (cond != 0) ip = target;
+                break;
+            }
+            case OP_CMP_BR: {
+                int b = pop(), a = pop();
+                ip = compare(code[ip], a, b) ? ip + 2 : code[ip + 1];
+                break;
+            }
+            case OP_CALL: {
+                int callee = code[ip++];
+                int argCount = code[ip++];
+                const scc::Function& fn = functions[callee];
+                if (argCount != fn.numParams) throw runtime_error("Call arity mismatch");
+
+                vector<int> newLocals(fn.numLocals, 0);
+                for (int i = argCount - 1; i >= 0; --i) {
+                    newLocals[i] = pop();
+                }
+
+                callStack.push_back({funcIndex, ip, locals});
+                funcIndex = callee;
+                ip = 0;
+                locals.swap(newLocals);
+                break;
+            }
+            case OP_RET: {
+                int ret = pop();
+                if (callStack.size() == baseDepth) return ret;
+                Frame fr = callStack.back();
+                callStack.pop_back();
+                funcIndex = fr.funcIndex;
+                ip = fr.ip;
+                locals.swap(fr.locals);
+                stack.push_back(ret);
+                break;
+            }
+            case OP_PRINT: pop(); break;
+            case OP_PRINT_STR: {
+                int idx = code[ip++];
+                if (idx < 0 || idx >= static_cast<int>(strings.size())) {
+                    throw runtime_error("String index out of range");
+                }
+                break;
+            }
+            case OP_POP: pop(); break;
+            default:
+                throw runtime_error("Unsupported opcode");
+        }
+    }
+}
+
+template <class P>
+static int runCore(const Program& program, int entryFunc, Worker&) {
+    Image<Program> image(program);
+    Scheduler<Program> sched(image, 1, execute<P, Program>);
+    return execute<P>(image, entryFunc, {}, sched.mainWorker(), sched);
+}
+
+template <class P>
+static int runCached(const Program& program, int entryFunc, Worker&) {
+    Image<Program> image(program);
+    Scheduler<Program> sched(image, 1, executeCached<P, Program>);
+    return executeCached<P>(image, entryFunc, {}, sched.mainWorker(), sched);
+}
+
+struct Variant {
+    const char* name;
+    int (*run)(const Program&, int, Worker&);
+};
+
+int main(int argc, char** argv) {
+    try {
+        int repeat = 5;
+        vector<string> files;
+        for (int argi = 1; argi < argc; ++argi) {
+            string arg = argv[argi];
+            if (arg == "--repeat" && argi + 1 < argc) repeat = stoi(argv[++argi]);
+            else files.push_back(arg);
+        }
+        if (files.empty()) {
+            filesystem::path dir = filesystem::path(argv[0]).parent_path();
+            files.push_back((dir / "hot_loops.s").string());
+        }
+
+        const vector<Variant> variants = {
+            {"hand-written", handWritten},
+            {"checked", runCore<Policy<true, false, false, false, false, NullSink>>},
+            {"unchecked", runCore<Policy<false, false, false, false, false, NullSink>>},
+            {"checked+profile", runCore<Policy<true, false, false, true, false, NullSink>>},
+            {"cached", runCached<Policy<true, false, false, false, false, NullSink>>},
+            {"unchecked+cached", runCached<Policy<false, false, false, false, false, NullSink>>},
+        };
+
+        cout << "core: VM policies vs the hand-written loop (best of " << repeat << ")\n";
+        for (const auto& file : files) {
+            ifstream in(file);
+            if (!in) throw runtime_error("Failed to open " + file);
+            string src((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+            auto program = scc::compile(src);
+            verify(*program);
+            int entry = program->findFunction("main");
+            if (entry < 0) throw runtime_error("No main function in " + file);
+
+            // Rounds interleave the variants so drift in machine load hits all alike.
+            vector<double> best(variants.size(), 0);
+            int expected = 0;
+            for (int r = 0; r < repeat; ++r) {
+                for (size_t i = 0; i < variants.size(); ++i) {
+                    Worker worker;
+                    auto start = chrono::steady_clock::now();
+                    int result = variants[i].run(*program, entry, worker);
+                    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+                    if (r == 0 && i == 0) expected = result;
+                    else if (result != expected) {
+                        throw runtime_error(string(variants[i].name) + " returned a different result");
+                    }
+                    if (r == 0 || ms < best[i]) best[i] = ms;
+                }
+            }
+            string name = filesystem::path(file).filename().string();
+            for (size_t i = 0; i < variants.size(); ++i) {
+                cout << setw(14) << name << setw(17) << variants[i].name << setw(9) << fixed << setprecision(1)
+                     << best[i] << " ms" << setw(8) << setprecision(2) << best[0] / best[i] << "x\n";
+            }
+        }
+        return 0;
+    } catch (const exception& ex) {
+        cerr << "Error: " << ex.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,44 @@
+// Embedding example: compile once against a host function, then run the same
+// program from several threads, each with its own VMContext and output sink.
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../src/scc.h"
+
+using namespace std;
+
+static const int kBonus[] = {5, 3, 8, 1};
+
+int main() {
+    try {
+        scc::NativeRegistry natives;
+        natives.add("bonus", 1, [](const int* args) { return kBonus[args[0] & 3]; });
+        auto program = scc::compile(R"(
+            int square(int x) {
+                print(x);
+                return x * x + bonus(x);
+            }
+        )", natives);
+
+        mutex coutMutex;
+        vector<thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&, t] {
+                scc::VMContext vm(program);
+                int printed = 0;
+                vm.setOutput([&printed](const string&) { printed++; });
+                int sum = 0;
+                for (int i = 0; i < 1000; ++i) sum += vm.call("square", {t});
+                lock_guard<mutex> lock(coutMutex);
+                cout << "thread " << t << ": sum " << sum << ", " << printed << " lines printed\n";
+            });
+        }
+        for (auto& th : threads) th.join();
+        return 0;
+    } catch (const exception& ex) {
+        cerr << "Error: " << ex.what() << "\n";
+        return 1;
+    }
+}
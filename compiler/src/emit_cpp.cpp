@@ -0,0 +1,415 @@
+#include <cstdio>
+#include <ostream>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "scc.h"
+#include "vm_core.h"
+
+using namespace std;
+
+namespace scc {
+
+namespace {
+
+using namespace svm;
+
+// Support code pasted at the top of every emitted file. Arithmetic goes
+// through unsigned so overflow wraps as it does in the VM instead of being
+// undefined behaviour the host compiler may exploit. spawn() queues a task
+// and join() runs queued tasks newest first until the one it waits for is
+// done, matching `scc --run --threads 1`; tasks still queued when main
+// returns run before exit.
+const char* const kPrelude = R"(// Generated by scc --emit-cpp.
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+char outBuf[1 << 16];
+size_t outLen = 0;
+
+inline void rt_flush() {
+    fwrite(outBuf, 1, outLen, stdout);
+    outLen = 0;
+}
+
+inline void rt_write(const char* s, size_t n) {
+    if (outLen + n > sizeof(outBuf)) {
+        rt_flush();
+        if (n > sizeof(outBuf)) {
+            fwrite(s, 1, n, stdout);
+            return;
+        }
+    }
+    memcpy(outBuf + outLen, s, n);
+    outLen += n;
+}
+
+inline void rt_print(int v) {
+    char tmp[16];
+    char* p = tmp + sizeof(tmp);
+    *--p = '\n';
+    unsigned u = v < 0 ? 0u - static_cast<unsigned>(v) : static_cast<unsigned>(v);
+    do {
+        *--p = static_cast<char>('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0) *--p = '-';
+    rt_write(p, static_cast<size_t>(tmp + sizeof(tmp) - p));
+}
+
+inline int rt_add(int a, int b) { return static_cast<int>(static_cast<unsigned>(a) + static_cast<unsigned>(b)); }
+inline int rt_sub(int a, int b) { return static_cast<int>(static_cast<unsigned>(a) - static_cast<unsigned>(b)); }
+inline int rt_mul(int a, int b) { return static_cast<int>(static_cast<unsigned>(a) * static_cast<unsigned>(b)); }
+
+inline int rt_div(int a, int b) {
+    if (b == 0) throw std::runtime_error("Division by zero");
+    return b == -1 ? static_cast<int>(0u - static_cast<unsigned>(a)) : a / b;
+}
+
+struct Task {
+    int (*fn)(const int*);
+    std::vector<int> args;
+    bool done = false;
+    bool failed = false;
+    int result = 0;
+    std::string error;
+};
+
+std::deque<Task> tasks;
+std::vector<int> queued;
+
+inline int rt_spawn(int (*fn)(const int*), std::vector<int> args) {
+    int handle = static_cast<int>(tasks.size());
+    tasks.emplace_back();
+    tasks.back().fn = fn;
+    tasks.back().args = std::move(args);
+    queued.push_back(handle);
+    return handle;
+}
+
+inline void rt_run_next() {
+    int handle = queued.back();
+    queued.pop_back();
+    Task& task = tasks[handle];
+    try {
+        task.result = task.fn(task.args.data());
+    } catch (const std::exception& ex) {
+        task.failed = true;
+        task.error = ex.what();
+    }
+    task.done = true;
+}
+
+inline int rt_join(int handle) {
+    if (handle < 0 || handle >= static_cast<int>(tasks.size())) throw std::runtime_error("Invalid task handle");
+    while (!tasks[handle].done) {
+        if (queued.empty()) throw std::runtime_error("join on a task that is still running");
+        rt_run_next();
+    }
+    if (tasks[handle].failed) throw std::runtime_error(tasks[handle].error);
+    return tasks[handle].result;
+}
+
+inline void rt_finish() {
+    while (!queued.empty()) rt_run_next();
+}
+
+} // namespace
+)";
+
+// read() and eof(), with the semantics of svm::IntReader, emitted when the
+// program uses them. The host compiler does well enough on the plain loop.
+const char* const kReaderSource = R"(namespace {
+
+char inBuf[1 << 20];
+size_t inPos = 0, inEnd = 0;
+bool inEof = false;
+
+inline bool rt_fill() {
+    memmove(inBuf, inBuf + inPos, inEnd - inPos);
+    inEnd -= inPos;
+    inPos = 0;
+    size_t got = fread(inBuf + inEnd, 1, sizeof(inBuf) - inEnd, stdin);
+    if (got == 0) inEof = true;
+    inEnd += got;
+    return got > 0;
+}
+
+inline int rt_peek() {
+    if (inPos == inEnd && (inEof || !rt_fill())) return -1;
+    return static_cast<unsigned char>(inBuf[inPos]);
+}
+
+inline bool rt_skip() {
+    for (int c = rt_peek(); c >= 0; c = rt_peek()) {
+        if (c == '-' || (c >= '0' && c <= '9')) return true;
+        inPos++;
+    }
+    return false;
+}
+
+inline int rt_eof() { return rt_skip() ? 0 : 1; }
+
+inline int rt_read() {
+    if (!rt_skip()) throw std::runtime_error("read() past the end of the input");
+    bool negative = rt_peek() == '-';
+    if (negative) inPos++;
+    int c = rt_peek();
+    if (c < '0' || c > '9') throw std::runtime_error("Malformed input: '-' without digits");
+    unsigned long long v = 0;
+    for (; c >= '0' && c <= '9'; c = rt_peek()) {
+        v = v * 10 + (c - '0');
+        if (v > 2147483648ull) throw std::runtime_error("Input integer out of range");
+        inPos++;
+    }
+    if (v > 2147483648ull - (negative ? 0 : 1)) throw std::runtime_error("Input integer out of range");
+    return static_cast<int>(negative ? 0u - static_cast<unsigned>(v) : static_cast<unsigned>(v));
+}
+
+} // namespace
+)";
+
+// Bodies of the builtin natives (svm::builtins), taking `const int* a`.
+struct NativeSource {
+    const char* name;
+    const char* body;
+};
+
+const NativeSource kNativeSources[] = {
+    {"abs", "return a[0] < 0 ? static_cast<int>(0u - static_cast<unsigned>(a[0])) : a[0];"},
+    {"min", "return a[0] < a[1] ? a[0] : a[1];"},
+    {"max", "return a[0] < a[1] ? a[1] : a[0];"},
+    {"clamp", "int t = a[0] < a[2] ? a[0] : a[2];\n    return t < a[1] ? a[1] : t;"},
+    {"mod", "if (a[1] == 0) throw std::runtime_error(\"Division by zero\");\n"
+            "    return a[1] == -1 ? 0 : a[0] % a[1];"},
+    {"pow", "int base = a[0], e = a[1];\n"
+            "    if (e < 0) return base == 1 ? 1 : base == -1 ? (e % 2 ? -1 : 1) : 0;\n"
+            "    unsigned r = 1, b = static_cast<unsigned>(base);\n"
+            "    for (unsigned n = static_cast<unsigned>(e); n; n >>= 1) {\n"
+            "        if (n & 1) r *= b;\n"
+            "        b *= b;\n"
+            "    }\n"
+            "    return static_cast<int>(r);"},
+    {"gcd", "unsigned x = a[0] < 0 ? 0u - static_cast<unsigned>(a[0]) : static_cast<unsigned>(a[0]);\n"
+            "    unsigned y = a[1] < 0 ? 0u - static_cast<unsigned>(a[1]) : static_cast<unsigned>(a[1]);\n"
+            "    while (y) {\n"
+            "        unsigned t = x % y;\n"
+            "        x = y;\n"
+            "        y = t;\n"
+            "    }\n"
+            "    return static_cast<int>(x);"},
+    {"isqrt", "if (a[0] < 0) throw std::runtime_error(\"isqrt of a negative number\");\n"
+              "    unsigned x = static_cast<unsigned>(a[0]);\n"
+              "    unsigned r = static_cast<unsigned>(std::sqrt(static_cast<double>(x)));\n"
+              "    while (r * r > x) --r;\n"
+              "    while ((r + 1) * (r + 1) <= x) ++r;\n"
+              "    return static_cast<int>(r);"},
+};
+
+// Only builtins can be emitted; a host-registered native has no source.
+const char* nativeSource(const NativeFunction& native) {
+    for (const auto& b : builtinNatives()) {
+        if (native.name != b.name || native.fn != b.fn) continue;
+        for (const auto& src : kNativeSources) {
+            if (native.name == src.name) return src.body;
+        }
+    }
+    throw runtime_error("Native function " + native.name + " is not available to --emit-cpp");
+}
+
+string cppName(const Function& fn) {
+    return "fn_" + fn.name;
+}
+
+const char* cppCompare(int cmp) {
+    switch (cmp) {
+        case OP_EQ: return "==";
+        case OP_NE: return "!=";
+        case OP_LT: return "<";
+        case OP_LE: return "<=";
+        case OP_GT: return ">";
+        default: return ">=";
+    }
+}
+
+// Octal escapes always end after three digits, unlike \x.
+string cppStringLiteral(const string& s) {
+    string out = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        } else if (c >= 0x20 && c < 0x7f && c != '?') {
+            out += static_cast<char>(c);
+        } else {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\%03o", c);
+            out += buf;
+        }
+    }
+    return out + "\"";
+}
+
+void emitFunction(const Program& program, const Function& fn, ostream& out) {
+    int maxDepth = 0;
+    vector<int> depth = stackDepths(fn, maxDepth);
+    const vector<int>& code = fn.code;
+
+    set<int> labels;
+    for (size_t ip = 0; ip < code.size(); ip += opLength(code[ip])) {
+        int t = targetOperand(code[ip]);
+        if (depth[ip] >= 0 && t) labels.insert(code[ip + t]);
+    }
+
+    out << "int " << cppName(fn) << "(";
+    for (int i = 0; i < fn.numParams; ++i) out << (i ? ", " : "") << "int l" << i;
+    out << ") {\n";
+    for (int i = fn.numParams; i < fn.numLocals; ++i) out << "    int l" << i << " = 0;\n";
+    for (int i = 0; i < maxDepth; ++i) out << "    int s" << i << " = 0;\n";
+
+    auto s = [](int i) { return "s" + to_string(i); };
+    for (size_t ip = 0; ip < code.size(); ip += opLength(code[ip])) {
+        int d = depth[ip];
+        if (d < 0) continue;
+        if (labels.count(static_cast<int>(ip))) out << "L" << ip << ":\n";
+        int op = code[ip];
+        int a = code.size() > ip + 1 ? code[ip + 1] : 0;
+        out << "    ";
+        switch (op) {
+            case OP_PUSH_INT: out << s(d) << " = " << a << ";"; break;
+            case OP_LOAD: out << s(d) << " = l" << a << ";"; break;
+            case OP_STORE: out << "l" << a << " = " << s(d - 1) << ";"; break;
+            case OP_ADD: out << s(d - 2) << " = rt_add(" << s(d - 2) << ", " << s(d - 1) << ");"; break;
+            case OP_SUB: out << s(d - 2) << " = rt_sub(" << s(d - 2) << ", " << s(d - 1) << ");"; break;
+            case OP_MUL: out << s(d - 2) << " = rt_mul(" << s(d - 2) << ", " << s(d - 1) << ");"; break;
+            case OP_DIV: out << s(d - 2) << " = rt_div(" << s(d - 2) << ", " << s(d - 1) << ");"; break;
+            case OP_EQ: out << s(d - 2) << " = " << s(d - 2) << " == " << s(d - 1) << ";"; break;
+            case OP_NE: out << s(d - 2) << " = " << s(d - 2) << " != " << s(d - 1) << ";"; break;
+            case OP_LT: out << s(d - 2) << " = " << s(d - 2) << " < " << s(d - 1) << ";"; break;
+            case OP_LE: out << s(d - 2) << " = " << s(d - 2) << " <= " << s(d - 1) << ";"; break;
+            case OP_GT: out << s(d - 2) << " = " << s(d - 2) << " > " << s(d - 1) << ";"; break;
+            case OP_GE: out << s(d - 2) << " = " << s(d - 2) << " >= " << s(d - 1) << ";"; break;
+            case OP_JMP: out << "goto L" << a << ";"; break;
+            case OP_JMP_IF_FALSE: out << "if (!" << s(d - 1) << ") goto L" << a << ";"; break;
+            case OP_JMP_IF_TRUE: out << "if (" << s(d - 1) << ") goto L" << a << ";"; break;
+            case OP_CMP_BR:
+                out << "if (!(" << s(d - 2) << " " << cppCompare(a) << " " << s(d - 1) << ")) goto L" << code[ip + 2]
+                    << ";";
+                break;
+            case OP_TABLESWITCH:
+            case OP_LOOKUPSWITCH: {
+                // The host compiler picks its own jump table or search; the
+                // table entries are consumed here.
+                const int count = code[ip + opLength(op) - 1];
+                size_t table = ip + opLength(op);
+                out << "switch (" << s(d - 1) << ") {";
+                for (int i = 0; i < count; ++i, table += 3) {
+                    out << " case " << code[table + 1] << ": goto L" << code[table + 2] << ";";
+                }
+                out << " default: goto L" << code[table + 1] << "; }";
+                ip = table;
+                break;
+            }
+            case OP_CALL: {
+                int argc = code[ip + 2];
+                out << s(d - argc) << " = " << cppName(program.functions[a]) << "(";
+                for (int i = 0; i < argc; ++i) out << (i ? ", " : "") << s(d - argc + i);
+                out << ");";
+                break;
+            }
+            case OP_RET: out << "return " << s(d - 1) << ";"; break;
+            case OP_PRINT: out << "rt_print(" << s(d - 1) << ");"; break;
+            case OP_PRINT_STR: {
+                string str = program.strings[a] + "\n";
+                out << "rt_write(" << cppStringLiteral(str) << ", " << str.size() << ");";
+                break;
+            }
+            case OP_POP: out << ";"; break;
+            case OP_SPAWN: {
+                int argc = code[ip + 2];
+                out << s(d - argc) << " = rt_spawn(task_" << program.functions[a].name << ", {";
+                for (int i = 0; i < argc; ++i) out << (i ? ", " : "") << s(d - argc + i);
+                out << "});";
+                break;
+            }
+            case OP_JOIN: out << s(d - 1) << " = rt_join(" << s(d - 1) << ");"; break;
+            case OP_READ: out << s(d) << " = " << (a == kReadEof ? "rt_eof();" : "rt_read();"); break;
+            case OP_CALL_NATIVE: {
+                int argc = code[ip + 2];
+                out << "{ ";
+                if (argc > 0) {
+                    out << "const int a[] = {";
+                    for (int i = 0; i < argc; ++i) out << (i ? ", " : "") << s(d - argc + i);
+                    out << "}; ";
+                }
+                out << s(d - argc) << " = nat_" << program.natives[a].name << "(" << (argc > 0 ? "a" : "nullptr")
+                    << "); }";
+                break;
+            }
+            default: throw runtime_error("Cannot emit opcode " + string(opName(op)));
+        }
+        out << "\n";
+    }
+    out << "}\n\n";
+}
+
+} // namespace
+
+void emitCpp(const Program& program, int entryFunc, ostream& out) {
+    verify(program);
+    out << kPrelude << "\n";
+    for (const auto& native : program.natives) {
+        out << "int nat_" << native.name << "(const int* a) {\n    " << nativeSource(native) << "\n}\n\n";
+    }
+    for (const auto& fn : program.functions) {
+        out << "int " << cppName(fn) << "(";
+        for (int i = 0; i < fn.numParams; ++i) out << (i ? ", int" : "int");
+        out << ");\n";
+    }
+    out << "\n";
+
+    // spawn() needs a uniform entry point per spawned function.
+    set<int> spawned;
+    bool reads = false;
+    for (const auto& fn : program.functions) {
+        for (size_t ip = 0; ip < fn.code.size(); ip += opLength(fn.code[ip])) {
+            if (fn.code[ip] == OP_SPAWN) spawned.insert(fn.code[ip + 1]);
+            if (fn.code[ip] == OP_READ) reads = true;
+        }
+    }
+    if (reads) out << kReaderSource << "\n";
+    for (int f : spawned) {
+        const Function& fn = program.functions[f];
+        out << "int task_" << fn.name << "(const int* a) {\n    return " << cppName(fn) << "(";
+        for (int i = 0; i < fn.numParams; ++i) out << (i ? ", " : "") << "a[" << i << "]";
+        out << ");\n}\n\n";
+    }
+
+    for (const auto& fn : program.functions) emitFunction(program, fn, out);
+
+    out << "int main() {\n"
+        << "    int rc = 0;\n"
+        << "    try {\n"
+        << "        rc = " << cppName(program.functions[entryFunc]) << "();\n"
+        << "        rt_finish();\n"
+        << "    } catch (const std::exception& ex) {\n"
+        << "        rt_flush();\n"
+        << "        fflush(stdout);\n"
+        << "        fprintf(stderr, \"Error: %s\\n\", ex.what());\n"
+        << "        return 1;\n"
+        << "    }\n"
+        << "    rt_flush();\n"
+        << "    return rc;\n"
+        << "}\n";
+}
+
+} // namespace scc
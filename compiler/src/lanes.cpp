@@ -0,0 +1,327 @@
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "scc.h"
+#include "vm_core.h"
+
+using namespace std;
+
+namespace scc {
+
+namespace {
+
+using namespace svm;
+
+// Opcodes a function may use to run lane-parallel: no calls (natives may have
+// side effects), tasks, input, output or switches.
+bool laneSafe(const Function& fn) {
+    for (size_t ip = 0; ip < fn.code.size(); ip += opLength(fn.code[ip])) {
+        switch (fn.code[ip]) {
+            case OP_CALL:
+            case OP_CALL_NATIVE:
+            case OP_SPAWN:
+            case OP_JOIN:
+            case OP_PRINT:
+            case OP_PRINT_STR:
+            case OP_READ:
+            case OP_TABLESWITCH:
+            case OP_LOOKUPSWITCH:
+                return false;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+// Wraps like the VM does, without the undefined behaviour that would stop the
+// compiler from vectorizing.
+inline int wrap(uint32_t v) {
+    return static_cast<int>(v);
+}
+
+// mask ? a : b for an all-ones or all-zeros mask, written with bit
+// operations so lane loops stay branch-free and vectorize.
+inline int blend(int32_t mask, int a, int b) {
+    return (a & mask) | (b & ~mask);
+}
+
+// Runs up to W inputs of fn in lock step. Every local and stack slot is a row
+// of W ints; the stack depth at an instruction is the same in every lane
+// (stackDepths), so lanes at the same ip share rows. Each step picks the
+// lowest ip of any live lane and executes it under the mask of lanes sitting
+// there, so lanes that branched apart reconverge as soon as the ones behind
+// catch up. Row updates are written as blends over all W lanes, which the
+// host compiler turns into SIMD.
+template <int W>
+class LaneGroup {
+public:
+    LaneGroup(const Function& fn, const vector<int>& depth, int maxDepth)
+        : fn_(fn), depth_(depth), locals_(static_cast<size_t>(fn.numLocals) * W),
+          stack_(static_cast<size_t>(maxDepth) * W) {}
+
+    // args holds numParams ints per input; inputs past n are left idle.
+    // Returns the first failing lane's offset within the group, or -1.
+    int run(const int* args, int n, int* results, string& error) {
+        const vector<int>& code = fn_.code;
+        const int numParams = fn_.numParams;
+        fill(locals_.begin(), locals_.end(), 0);
+        for (int l = 0; l < n; ++l) {
+            for (int p = 0; p < numParams; ++p) local(p)[l] = args[static_cast<size_t>(l) * numParams + p];
+        }
+        int failed = -1;
+        int ip[W];
+        int32_t live[W];
+        int32_t mask[W];
+        for (int l = 0; l < W; ++l) {
+            live[l] = l < n ? -1 : 0;
+            mask[l] = -1;
+        }
+        // While converged every live lane is at pc and mask covers all lanes:
+        // finished lanes compute garbage instead of being blended out. ip[] is
+        // only kept while lanes are apart.
+        int pc = 0;
+        bool converged = true;
+
+        // Sends the active lanes for which jumps(l) holds to target and the
+        // others on to next; lanes split up unless they all agree.
+        auto branch = [&](int target, int next, auto jumps) {
+            int taken = 0, fallen = 0;
+            for (int l = 0; l < W; ++l) {
+                int active = mask[l] & live[l] & 1;
+                int j = jumps(l) ? 1 : 0;
+                taken += active & j;
+                fallen += active & (j ^ 1);
+            }
+            if (converged && (taken == 0 || fallen == 0)) {
+                pc = taken ? target : next;
+                return;
+            }
+            if (converged) fill(ip, ip + W, pc);
+            for (int l = 0; l < W; ++l) ip[l] = blend(mask[l], jumps(l) ? target : next, ip[l]);
+            converged = false;
+        };
+
+        while (true) {
+            if (!converged) {
+                pc = INT_MAX;
+                for (int l = 0; l < W; ++l) pc = min(pc, blend(live[l], ip[l], INT_MAX));
+                if (pc == INT_MAX) return failed;
+                int waiting = 0;
+                for (int l = 0; l < W; ++l) {
+                    mask[l] = ip[l] == pc ? live[l] : 0;
+                    waiting += live[l] & ~mask[l] & 1;
+                }
+                if (waiting == 0) {
+                    converged = true;
+                    fill(mask, mask + W, -1);
+                }
+            }
+
+            int op = code[pc];
+            int d = depth_[pc];
+            int next = pc + opLength(op);
+            switch (op) {
+                case OP_PUSH_INT: {
+                    int k = code[pc + 1];
+                    int* dst = slot(d);
+                    for (int l = 0; l < W; ++l) dst[l] = blend(mask[l], k, dst[l]);
+                    break;
+                }
+                case OP_LOAD: {
+                    const int* src = local(code[pc + 1]);
+                    int* dst = slot(d);
+                    for (int l = 0; l < W; ++l) dst[l] = blend(mask[l], src[l], dst[l]);
+                    break;
+                }
+                case OP_STORE: {
+                    const int* src = slot(d - 1);
+                    int* dst = local(code[pc + 1]);
+                    for (int l = 0; l < W; ++l) dst[l] = blend(mask[l], src[l], dst[l]);
+                    break;
+                }
+                case OP_ADD: binary(d, mask, [](int a, int b) { return wrap(uint32_t(a) + uint32_t(b)); }); break;
+                case OP_SUB: binary(d, mask, [](int a, int b) { return wrap(uint32_t(a) - uint32_t(b)); }); break;
+                case OP_MUL: binary(d, mask, [](int a, int b) { return wrap(uint32_t(a) * uint32_t(b)); }); break;
+                case OP_DIV: {
+                    // A failing lane stops; the others run on so the lowest
+                    // failing input is the one reported.
+                    const int* b = slot(d - 1);
+                    int alive = 0;
+                    for (int l = 0; l < W; ++l) {
+                        if (mask[l] && live[l] && b[l] == 0) {
+                            error = "Division by zero";
+                            failed = failed < 0 ? l : min(failed, l);
+                            live[l] = 0;
+                        }
+                        alive |= live[l];
+                    }
+                    if (!alive) return failed;
+                    // x86 has no SIMD integer divide, but a double quotient of
+                    // two ints truncates to exactly the int quotient. Lanes not
+                    // taking part may hold anything, so they divide by 1, and
+                    // so does -1, which is negation wrapping INT_MIN to itself
+                    // as svm::divide does.
+                    binary(d, mask, [](int a, int b) {
+                        double q = double(a) / double(b == 0 || b == -1 ? 1 : b);
+                        return b == -1 ? wrap(0u - uint32_t(a)) : int(q);
+                    });
+                    break;
+                }
+                case OP_EQ: binary(d, mask, [](int a, int b) { return int(a == b); }); break;
+                case OP_NE: binary(d, mask, [](int a, int b) { return int(a != b); }); break;
+                case OP_LT: binary(d, mask, [](int a, int b) { return int(a < b); }); break;
+                case OP_LE: binary(d, mask, [](int a, int b) { return int(a <= b); }); break;
+                case OP_GT: binary(d, mask, [](int a, int b) { return int(a > b); }); break;
+                case OP_GE: binary(d, mask, [](int a, int b) { return int(a >= b); }); break;
+                case OP_JMP:
+                    next = code[pc + 1];
+                    break;
+                case OP_JMP_IF_FALSE: {
+                    const int* cond = slot(d - 1);
+                    branch(code[pc + 1], next, [cond](int l) { return cond[l] == 0; });
+                    continue;
+                }
+                case OP_JMP_IF_TRUE: {
+                    const int* cond = slot(d - 1);
+                    branch(code[pc + 1], next, [cond](int l) { return cond[l] != 0; });
+                    continue;
+                }
+                case OP_CMP_BR: {
+                    const int* a = slot(d - 2);
+                    const int* b = slot(d - 1);
+                    const int cmp = code[pc + 1];
+                    branch(code[pc + 2], next, [a, b, cmp](int l) { return !compare(cmp, a[l], b[l]); });
+                    continue;
+                }
+                case OP_RET: {
+                    const int* v = slot(d - 1);
+                    for (int l = 0; l < W; ++l) {
+                        if (mask[l] && live[l]) {
+                            results[l] = v[l];
+                            live[l] = 0;
+                        }
+                    }
+                    if (converged) return failed;
+                    continue;
+                }
+                case OP_POP:
+                    break;
+                default:
+                    throw runtime_error("Opcode " + string(opName(op)) + " cannot run lane-parallel");
+            }
+            if (converged) {
+                pc = next;
+            } else {
+                for (int l = 0; l < W; ++l) ip[l] = blend(mask[l], next, ip[l]);
+            }
+        }
+    }
+
+private:
+    int* local(int i) { return &locals_[static_cast<size_t>(i) * W]; }
+    int* slot(int i) { return &stack_[static_cast<size_t>(i) * W]; }
+
+    // Pops two rows and pushes f(a, b) in the active lanes.
+    template <class F>
+    void binary(int d, const int32_t* mask, F f) {
+        int* a = slot(d - 2);
+        const int* b = slot(d - 1);
+        for (int l = 0; l < W; ++l) {
+            int r = f(a[l], b[l]);
+            a[l] = blend(mask[l], r, a[l]);
+        }
+    }
+
+    const Function& fn_;
+    const vector<int>& depth_;
+    vector<int> locals_;
+    vector<int> stack_;
+};
+
+template <int W>
+void runLanes(const Function& fn, const vector<int>& depth, int maxDepth, const vector<int>& args,
+              vector<int>& results) {
+    LaneGroup<W> group(fn, depth, maxDepth);
+    const size_t count = results.size();
+    string error;
+    for (size_t base = 0; base < count; base += W) {
+        int n = static_cast<int>(min<size_t>(W, count - base));
+        int failed = group.run(args.data() + base * fn.numParams, n, results.data() + base, error);
+        if (failed >= 0) throw runtime_error(error + " (input " + to_string(base + failed) + ")");
+    }
+}
+
+} // namespace
+
+struct BatchEvaluator::Impl {
+    shared_ptr<const Program> program;
+    int funcIndex = -1;
+    int lanes = 1;
+    bool vectorized = false;
+    vector<int> depth;
+    int maxDepth = 0;
+    unique_ptr<VMContext> scalar;
+};
+
+BatchEvaluator::BatchEvaluator(shared_ptr<const Program> program, const string& name, int lanes)
+    : impl_(make_unique<Impl>()) {
+    if (lanes != 1 && lanes != 8 && lanes != 16) throw runtime_error("Lane count must be 1, 8 or 16");
+    impl_->program = std::move(program);
+    impl_->funcIndex = impl_->program->findFunction(name);
+    if (impl_->funcIndex < 0) throw runtime_error("Unknown function: " + name);
+    verify(*impl_->program);
+    const Function& fn = impl_->program->functions[impl_->funcIndex];
+    if (fn.numParams == 0) throw runtime_error("Function " + name + " takes no arguments");
+    impl_->lanes = lanes;
+    impl_->vectorized = lanes > 1 && laneSafe(fn);
+    if (impl_->vectorized) {
+        impl_->depth = stackDepths(fn, impl_->maxDepth);
+    } else {
+        impl_->scalar = make_unique<VMContext>(impl_->program);
+    }
+}
+
+BatchEvaluator::~BatchEvaluator() = default;
+
+bool BatchEvaluator::vectorized() const {
+    return impl_->vectorized;
+}
+
+int BatchEvaluator::lanes() const {
+    return impl_->vectorized ? impl_->lanes : 1;
+}
+
+int BatchEvaluator::arity() const {
+    return impl_->program->functions[impl_->funcIndex].numParams;
+}
+
+void BatchEvaluator::run(const vector<int>& args, vector<int>& results) {
+    const int numParams = arity();
+    if (args.size() % numParams != 0) {
+        throw runtime_error("Argument count is not a multiple of " + to_string(numParams));
+    }
+    const size_t count = args.size() / numParams;
+    results.assign(count, 0);
+    const Function& fn = impl_->program->functions[impl_->funcIndex];
+    if (impl_->vectorized && impl_->lanes == 16) {
+        runLanes<16>(fn, impl_->depth, impl_->maxDepth, args, results);
+    } else if (impl_->vectorized) {
+        runLanes<8>(fn, impl_->depth, impl_->maxDepth, args, results);
+    } else {
+        vector<int> one(numParams);
+        for (size_t i = 0; i < count; ++i) {
+            copy(args.begin() + i * numParams, args.begin() + (i + 1) * numParams, one.begin());
+            try {
+                results[i] = impl_->scalar->call(impl_->funcIndex, one);
+            } catch (const exception& ex) {
+                throw runtime_error(string(ex.what()) + " (input " + to_string(i) + ")");
+            }
+        }
+    }
+}
+
+} // namespace scc
@@ -1,767 +1,44 @@
 #include <algorithm>
-#include <cctype>
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
-#include <unordered_map>
+#include <thread>
 #include <vector>
 #include "embedded_runtime_x64.h"
 #include "embedded_runtime_x86.h"
+#include "scc.h"
 #ifdef _WIN32
 #include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
 #endif
 using namespace std;
+using namespace scc;
 
-enum class TokType {
-    End,
-    Ident,
-    Number,
-    String,
-    LParen, RParen,
-    LBrace, RBrace,
-    Comma, Semicolon,
-    Plus, Minus, Star, Slash,
-    Assign,
-    Eq, Ne, Lt, Le, Gt, Ge,
-    KwInt, KwReturn, KwIf, KwElse, KwWhile
-};
-
-struct Token {
-    TokType type;
-    string text;
-    int value = 0;
-    int line = 1;
-    int col = 1;
-};
-
-class Lexer {
-public:
-    explicit Lexer(const string& src) : src_(src) {}
-
-    Token next() {
-        skipWhitespaceAndComments();
-        if (pos_ >= src_.size()) return makeToken(TokType::End, "");
-
-        char c = src_[pos_];
-        if (isalpha(static_cast<unsigned char>(c)) || c == '_') {
-            return identOrKeyword();
-        }
-        if (isdigit(static_cast<unsigned char>(c))) {
-            return number();
-        }
-        if (c == '"') {
-            return stringLiteral();
-        }
-
-        switch (c) {
-            case '(': return simple(TokType::LParen, "(");
-            case ')': return simple(TokType::RParen, ")");
-            case '{': return simple(TokType::LBrace, "{");
-            case '}': return simple(TokType::RBrace, "}");
-            case ',': return simple(TokType::Comma, ",");
-            case ';': return simple(TokType::Semicolon, ";");
-            case '+': return simple(TokType::Plus, "+");
-            case '-': return simple(TokType::Minus, "-");
-            case '*': return simple(TokType::Star, "*");
-            case '/': return simple(TokType::Slash, "/");
-            case '=': return match('=') ? simple(TokType::Eq, "==") : simple(TokType::Assign, "=");
-            case '!': return match('=') ? simple(TokType::Ne, "!=") : errorToken("Unexpected '!'");
-            case '<': return match('=') ? simple(TokType::Le, "<=") : simple(TokType::Lt, "<");
-            case '>': return match('=') ? simple(TokType::Ge, ">=") : simple(TokType::Gt, ">");
-            default:
-                return errorToken(string("Unexpected '") + c + "'");
-        }
-    }
-
-private:
-    Token makeToken(TokType type, const string& text) {
-        Token t;
-        t.type = type;
-        t.text = text;
-        t.line = line_;
-        t.col = col_;
-        return t;
-    }
-
-    Token simple(TokType type, const string& text) {
-        Token t = makeToken(type, text);
-        advance(text.size());
-        return t;
-    }
-
-    Token errorToken(const string& msg) {
-        Token t = makeToken(TokType::End, "");
-        t.text = msg;
-        return t;
-    }
-
-    void advance(size_t n) {
-        for (size_t i = 0; i < n; ++i) {
-            if (src_[pos_] == '\n') { line_++; col_ = 1; }
-            else { col_++; }
-            pos_++;
-        }
-    }
-
-    bool match(char expected) {
-        if (pos_ + 1 >= src_.size()) return false;
-        return src_[pos_ + 1] == expected;
-    }
-
-    void skipWhitespaceAndComments() {
-        while (pos_ < src_.size()) {
-            char c = src_[pos_];
-            if (isspace(static_cast<unsigned char>(c))) {
-                advance(1);
-                continue;
-            }
-            if (c == '/' && pos_ + 1 < src_.size()) {
-                if (src_[pos_ + 1] == '/') {
-                    while (pos_ < src_.size() && src_[pos_] != '\n') advance(1);
-                    continue;
-                }
-                if (src_[pos_ + 1] == '*') {
-                    advance(2);
-                    while (pos_ + 1 < src_.size()) {
-                        if (src_[pos_] == '*' && src_[pos_ + 1] == '/') {
-                            advance(2);
-                            break;
-                        }
-                        advance(1);
-                    }
-                    continue;
-                }
-            }
-            return;
-        }
-    }
-
-    Token identOrKeyword() {
-        size_t start = pos_;
-        int startCol = col_;
-        while (pos_ < src_.size()) {
-            char c = src_[pos_];
-            if (!isalnum(static_cast<unsigned char>(c)) && c != '_') break;
-            advance(1);
-        }
-        string text = src_.substr(start, pos_ - start);
-        Token t;
-        t.text = text;
-        t.line = line_;
-        t.col = startCol;
-
-        if (text == "int") t.type = TokType::KwInt;
-        else if (text == "return") t.type = TokType::KwReturn;
-        else if (text == "if") t.type = TokType::KwIf;
-        else if (text == "else") t.type = TokType::KwElse;
-        else if (text == "while") t.type = TokType::KwWhile;
-        else t.type = TokType::Ident;
-        return t;
-    }
-
-    Token number() {
-        size_t start = pos_;
-        int startCol = col_;
-        while (pos_ < src_.size() && isdigit(static_cast<unsigned char>(src_[pos_]))) advance(1);
-        string text = src_.substr(start, pos_ - start);
-        Token t;
-        t.type = TokType::Number;
-        t.text = text;
-        t.value = stoi(text);
-        t.line = line_;
-        t.col = startCol;
-        return t;
-    }
-
-    Token stringLiteral() {
-        int startCol = col_;
-        advance(1); // opening quote
-        string value;
-        while (pos_ < src_.size()) {
-            char c = src_[pos_];
-            if (c == '"') {
-                advance(1);
-                Token t;
-                t.type = TokType::String;
-                t.text = value;
-                t.line = line_;
-                t.col = startCol;
-                return t;
-            }
-            if (c == '\\') {
-                if (pos_ + 1 >= src_.size()) break;
-                char n = src_[pos_ + 1];
-                switch (n) {
-                    case 'n': value.push_back('\n'); break;
-                    case 't': value.push_back('\t'); break;
-                    case 'r': value.push_back('\r'); break;
-                    case '"': value.push_back('"'); break;
-                    case '\\': value.push_back('\\'); break;
-                    default: value.push_back(n); break;
-                }
-                advance(2);
-                continue;
-            }
-            if (c == '\n') break;
-            value.push_back(c);
-            advance(1);
-        }
-        return errorToken("Unterminated string literal");
-    }
-
-    string src_;
-    size_t pos_ = 0;
-    int line_ = 1;
-    int col_ = 1;
-};
-
-enum Op {
-    OP_PUSH_INT,
-    OP_LOAD,
-    OP_STORE,
-    OP_ADD,
-    OP_SUB,
-    OP_MUL,
-    OP_DIV,
-    OP_EQ,
-    OP_NE,
-    OP_LT,
-    OP_LE,
-    OP_GT,
-    OP_GE,
-    OP_JMP,
-    OP_JMP_IF_FALSE,
-    OP_CALL,
-    OP_RET,
-    OP_PRINT,
-    OP_PRINT_STR,
-    OP_POP
-};
-
-struct Function {
-    string name;
-    int numParams = 0;
-    int numLocals = 0;
-    vector<int> code;
-};
-
-struct Program {
-    vector<Function> functions;
-    vector<string> strings;
-};
-
-struct PendingCall {
-    int funcIndex;
-    int codePos;
-    string name;
-    int argCount;
-};
-
-class Parser {
-public:
-    explicit Parser(const string& src) : lexer_(src) {
-        tok_ = lexer_.next();
-        nextTok_ = lexer_.next();
-    }
-
-    Program compile() {
-        while (tok_.type != TokType::End) {
-            parseFunction();
-        }
-        resolveCalls();
-        Program p;
-        p.functions = functions_;
-        p.strings = strings_;
-        return p;
-    }
-
-private:
-    void error(const string& msg) {
-        ostringstream oss;
-        oss << "Parse error at " << tok_.line << ":" << tok_.col << ": " << msg;
-        throw runtime_error(oss.str());
-    }
-
-    void advance() {
-        tok_ = nextTok_;
-        nextTok_ = lexer_.next();
-        if (tok_.type == TokType::End && !tok_.text.empty()) {
-            throw runtime_error(tok_.text);
-        }
-    }
-
-    bool match(TokType type) {
-        if (tok_.type != type) return false;
-        advance();
-        return true;
-    }
-
-    void expect(TokType type, const string& what) {
-        if (tok_.type != type) error("Expected " + what);
-        advance();
-    }
-
-    void parseFunction() {
-        expect(TokType::KwInt, "'int'");
-        if (tok_.type != TokType::Ident) error("Expected function name");
-        string name = tok_.text;
-        advance();
-        expect(TokType::LParen, "'('");
-        vector<string> params;
-        if (tok_.type != TokType::RParen) {
-            while (true) {
-                expect(TokType::KwInt, "'int'");
-                if (tok_.type != TokType::Ident) error("Expected parameter name");
-                params.push_back(tok_.text);
-                advance();
-                if (match(TokType::Comma)) continue;
-                break;
-            }
-        }
-        expect(TokType::RParen, "')'");
-
-        int funcIndex = addFunction(name);
-        currentFunc_ = funcIndex;
-        locals_.clear();
-
-        Function& fn = functions_[funcIndex];
-        fn.numParams = static_cast<int>(params.size());
-        fn.numLocals = fn.numParams;
-
-        for (int i = 0; i < static_cast<int>(params.size()); ++i) {
-            locals_[params[i]] = i;
-        }
-
-        parseBlock();
-
-        // Ensure function ends with return
-        emit(OP_PUSH_INT, 0);
-        emit(OP_RET);
-
-        currentFunc_ = -1;
-    }
-
-    void parseBlock() {
-        expect(TokType::LBrace, "'{'");
-        while (tok_.type != TokType::RBrace) {
-            parseStatement();
-        }
-        expect(TokType::RBrace, "'}'");
-    }
-
-    void parseStatement() {
-        if (tok_.type == TokType::KwInt) {
-            parseDeclaration();
-            return;
-        }
-        if (tok_.type == TokType::KwReturn) {
-            advance();
-            parseExpression();
-            expect(TokType::Semicolon, "';'");
-            emit(OP_RET);
-            return;
-        }
-        if (tok_.type == TokType::KwIf) {
-            parseIf();
-            return;
-        }
-        if (tok_.type == TokType::KwWhile) {
-            parseWhile();
-            return;
-        }
-        if (tok_.type == TokType::LBrace) {
-            parseBlock();
-            return;
-        }
-
-        if (tok_.type == TokType::Ident && nextTok_.type == TokType::Assign) {
-            string name = tok_.text;
-            advance();
-            advance();
-            parseExpression();
-            expect(TokType::Semicolon, "';'");
-            int idx = localIndex(name);
-            emit(OP_STORE, idx);
-            return;
-        }
-
-        parseExpression();
-        expect(TokType::Semicolon, "';'");
-        emit(OP_POP);
-    }
-
-    void parseDeclaration() {
-        expect(TokType::KwInt, "'int'");
-        if (tok_.type != TokType::Ident) error("Expected variable name");
-        string name = tok_.text;
-        advance();
-        int idx = addLocal(name);
-        if (match(TokType::Assign)) {
-            parseExpression();
-            emit(OP_STORE, idx);
-        }
-        expect(TokType::Semicolon, "';'");
-    }
-
-    void parseIf() {
-        expect(TokType::KwIf, "'if'");
-        expect(TokType::LParen, "'('");
-        parseExpression();
-        expect(TokType::RParen, "')'");
+static const uint32_t kVersion = 4;
 
-        int jmpFalsePos = emit(OP_JMP_IF_FALSE, 0);
-        parseStatement();
+// Payload header flags.
+static const uint32_t kCompressed = 1;
 
-        if (match(TokType::KwElse)) {
-            int jmpEndPos = emit(OP_JMP, 0);
-            patch(jmpFalsePos, currentCodeSize());
-            parseStatement();
-            patch(jmpEndPos, currentCodeSize());
-        } else {
-            patch(jmpFalsePos, currentCodeSize());
-        }
-    }
-
-    void parseWhile() {
-        expect(TokType::KwWhile, "'while'");
-        int loopStart = currentCodeSize();
-        expect(TokType::LParen, "'('");
-        parseExpression();
-        expect(TokType::RParen, "')'");
-        int jmpFalsePos = emit(OP_JMP_IF_FALSE, 0);
-        parseStatement();
-        emit(OP_JMP, loopStart);
-        patch(jmpFalsePos, currentCodeSize());
-    }
-
-    void parseExpression() {
-        parseEquality();
-    }
-
-    void parseEquality() {
-        parseRelational();
-        while (tok_.type == TokType::Eq || tok_.type == TokType::Ne) {
-            TokType op = tok_.type;
-            advance();
-            parseRelational();
-            emit(op == TokType::Eq ? OP_EQ : OP_NE);
-        }
-    }
-
-    void parseRelational() {
-        parseAdditive();
-        while (tok_.type == TokType::Lt || tok_.type == TokType::Le ||
-               tok_.type == TokType::Gt || tok_.type == TokType::Ge) {
-            TokType op = tok_.type;
-            advance();
-            parseAdditive();
-            switch (op) {
-                case TokType::Lt: emit(OP_LT); break;
-                case TokType::Le: emit(OP_LE); break;
-                case TokType::Gt: emit(OP_GT); break;
-                case TokType::Ge: emit(OP_GE); break;
-                default: break;
-            }
-        }
-    }
-
-    void parseAdditive() {
-        parseTerm();
-        while (tok_.type == TokType::Plus || tok_.type == TokType::Minus) {
-            TokType op = tok_.type;
-            advance();
-            parseTerm();
-            emit(op == TokType::Plus ? OP_ADD : OP_SUB);
-        }
-    }
-
-    void parseTerm() {
-        parseUnary();
-        while (tok_.type == TokType::Star || tok_.type == TokType::Slash) {
-            TokType op = tok_.type;
-            advance();
-            parseUnary();
-            emit(op == TokType::Star ? OP_MUL : OP_DIV);
-        }
-    }
-
-    void parseUnary() {
-        if (tok_.type == TokType::Minus) {
-            advance();
-            parseUnary();
-            emit(OP_PUSH_INT, -1);
-            emit(OP_MUL);
-            return;
-        }
-        parsePrimary();
-    }
-
-    void parsePrimary() {
-        if (tok_.type == TokType::Number) {
-            emit(OP_PUSH_INT, tok_.value);
-            advance();
-            return;
-        }
-        if (tok_.type == TokType::Ident) {
-            string name = tok_.text;
-            if (nextTok_.type == TokType::LParen) {
-                parseCall();
-                return;
-            }
-            advance();
-            int idx = localIndex(name);
-            emit(OP_LOAD, idx);
-            return;
-        }
-        if (match(TokType::LParen)) {
-            parseExpression();
-            expect(TokType::RParen, "')'");
-            return;
-        }
-        error("Expected expression");
-    }
-
-    void parseCall() {
-        if (tok_.type != TokType::Ident) error("Expected function name");
-        string name = tok_.text;
-        advance();
-        expect(TokType::LParen, "'('");
-        if (name == "print") {
-            if (tok_.type == TokType::String) {
-                int idx = addString(tok_.text);
-                advance();
-                expect(TokType::RParen, "')'");
-                emit(OP_PRINT_STR, idx);
-                emit(OP_PUSH_INT, 0);
-                return;
-            }
-            if (tok_.type == TokType::RParen) error("print expects 1 argument");
-            parseExpression();
-            expect(TokType::RParen, "')'");
-            emit(OP_PRINT);
-            emit(OP_PUSH_INT, 0);
-            return;
-        }
-
-        int argCount = 0;
-        if (tok_.type != TokType::RParen) {
-            while (true) {
-                if (tok_.type == TokType::String) {
-                    error("String literals are only allowed in print(...)");
-                }
-                parseExpression();
-                argCount++;
-                if (match(TokType::Comma)) continue;
-                break;
-            }
-        }
-        expect(TokType::RParen, "')'");
-
-        int callPos = emit(OP_CALL, 0);
-        emit(argCount);
-        pendingCalls_.push_back({currentFunc_, callPos, name, argCount});
-    }
-
-    int addFunction(const string& name) {
-        auto it = funcIndex_.find(name);
-        if (it != funcIndex_.end()) {
-            // Duplicate definition
-            error("Function already defined: " + name);
-        }
-        int idx = static_cast<int>(functions_.size());
-        funcIndex_[name] = idx;
-        functions_.push_back(Function());
-        functions_[idx].name = name;
-        return idx;
-    }
-
-    int addLocal(const string& name) {
-        if (locals_.count(name)) error("Variable already defined: " + name);
-        Function& fn = functions_[currentFunc_];
-        int idx = fn.numLocals;
-        fn.numLocals++;
-        locals_[name] = idx;
-        return idx;
-    }
-
-    int addString(const string& s) {
-        auto it = stringIndex_.find(s);
-        if (it != stringIndex_.end()) return it->second;
-        int idx = static_cast<int>(strings_.size());
-        strings_.push_back(s);
-        stringIndex_[s] = idx;
-        return idx;
-    }
-
-    int localIndex(const string& name) {
-        auto it = locals_.find(name);
-        if (it == locals_.end()) error("Unknown variable: " + name);
-        return it->second;
-    }
-
-    int emit(int op) {
-        Function& fn = functions_[currentFunc_];
-        fn.code.push_back(op);
-        return static_cast<int>(fn.code.size()) - 1;
-    }
-
-    int emit(int op, int operand) {
-        Function& fn = functions_[currentFunc_];
-        fn.code.push_back(op);
-        fn.code.push_back(operand);
-        return static_cast<int>(fn.code.size()) - 1;
-    }
-
-    void patch(int pos, int target) {
-        Function& fn = functions_[currentFunc_];
-        fn.code[pos] = target;
-    }
-
-    int currentCodeSize() {
-        return static_cast<int>(functions_[currentFunc_].code.size());
-    }
-
-    void resolveCalls() {
-        for (const auto& call : pendingCalls_) {
-            auto it = funcIndex_.find(call.name);
-            if (it == funcIndex_.end()) {
-                throw runtime_error("Unknown function: " + call.name);
-            }
-            int idx = it->second;
-            if (functions_[idx].numParams != call.argCount) {
-                throw runtime_error("Function " + call.name + " expects " +
-                                    to_string(functions_[idx].numParams) + " args, got " +
-                                    to_string(call.argCount));
-            }
-            functions_[call.funcIndex].code[call.codePos] = idx;
-        }
-    }
-
-    Lexer lexer_;
-    Token tok_;
-    Token nextTok_;
-    vector<Function> functions_;
-    unordered_map<string, int> funcIndex_;
-    unordered_map<string, int> locals_;
-    unordered_map<string, int> stringIndex_;
-    vector<PendingCall> pendingCalls_;
-    vector<string> strings_;
-    int currentFunc_ = -1;
-};
-
-struct Frame {
-    int funcIndex;
-    int ip;
-    vector<int> locals;
-};
-
-int runVM(const Program& program, int entryFunc) {
-    const vector<Function>& functions = program.functions;
-    const vector<string>& strings = program.strings;
-    vector<int> stack;
-    vector<Frame> callStack;
-
-    int funcIndex = entryFunc;
-    int ip = 0;
-    vector<int> locals(functions[funcIndex].numLocals, 0);
-
-    auto pop = [&]() {
-        int v = stack.back();
-        stack.pop_back();
-        return v;
-    };
-
-    while (true) {
-        const vector<int>& code = functions[funcIndex].code;
-        if (ip >= static_cast<int>(code.size())) {
-            throw runtime_error("Instruction pointer out of range in function " + functions[funcIndex].name);
-        }
-        int op = code[ip++];
-        switch (op) {
-            case OP_PUSH_INT: stack.push_back(code[ip++]); break;
-            case OP_LOAD: stack.push_back(locals.at(code[ip++])); break;
-            case OP_STORE: {
-                int idx = code[ip++];
-                locals.at(idx) = pop();
-                break;
-            }
-            case OP_ADD: { int b = pop(), a = pop(); stack.push_back(a + b); break; }
-            case OP_SUB: { int b = pop(), a = pop(); stack.push_back(a - b); break; }
-            case OP_MUL: { int b = pop(), a = pop(); stack.push_back(a * b); break; }
-            case OP_DIV: {
-                int b = pop(), a = pop();
-                if (b == 0) throw runtime_error("Division by zero");
-                stack.push_back(a / b);
-                break;
-            }
-            case OP_EQ: { int b = pop(), a = pop(); stack.push_back(a == b ? 1 : 0); break; }
-            case OP_NE: { int b = pop(), a = pop(); stack.push_back(a != b ? 1 : 0); break; }
-            case OP_LT: { int b = pop(), a = pop(); stack.push_back(a < b ? 1 : 0); break; }
-            case OP_LE: { int b = pop(), a = pop(); stack.push_back(a <= b ? 1 : 0); break; }
-            case OP_GT: { int b = pop(), a = pop(); stack.push_back(a > b ? 1 : 0); break; }
-            case OP_GE: { int b = pop(), a = pop(); stack.push_back(a >= b ? 1 : 0); break; }
-            case OP_JMP: ip = code[ip]; break;
-            case OP_JMP_IF_FALSE: {
-                int target = code[ip++];
-                int cond = pop();
-                if (cond == 0) ip = target;
-                break;
-            }
-            case OP_CALL: {
-                int callee = code[ip++];
-                int argCount = code[ip++];
-                const Function& fn = functions[callee];
-                if (argCount != fn.numParams) throw runtime_error("Call arity mismatch");
-
-                vector<int> newLocals(fn.numLocals, 0);
-                for (int i = argCount - 1; i >= 0; --i) {
-                    newLocals[i] = pop();
-                }
-
-                callStack.push_back({funcIndex, ip, locals});
-                funcIndex = callee;
-                ip = 0;
-                locals.swap(newLocals);
-                break;
-            }
-            case OP_RET: {
-                int ret = pop();
-                if (callStack.empty()) return ret;
-                Frame fr = callStack.back();
-                callStack.pop_back();
-                funcIndex = fr.funcIndex;
-                ip = fr.ip;
-                locals.swap(fr.locals);
-                stack.push_back(ret);
-                break;
-            }
-            case OP_PRINT: {
-                int v = pop();
-                cout << v << "\n";
-                break;
-            }
-            case OP_PRINT_STR: {
-                int idx = code[ip++];
-                if (idx < 0 || idx >= static_cast<int>(strings.size())) {
-                    throw runtime_error("String index out of range");
-                }
-                cout << strings[idx] << "\n";
-                break;
-            }
-            case OP_POP: {
-                pop();
-                break;
-            }
-            default:
-                throw runtime_error("Unknown opcode");
-        }
-    }
-}
-
-static const uint32_t kVersion = 1;
+// A compressed payload keeps its header (version, flags, entry) as is and
+// stores the rest in independently compressed blocks of kBlockSize bytes, so
+// the runtime only inflates the blocks it reads. A block size with
+// kStoredBlock set holds that block uncompressed.
+static const size_t kHeaderSize = 12;
+static const size_t kBlockSize = 64 * 1024;
+static const uint32_t kStoredBlock = 0x80000000u;
 
 void appendU32(vector<uint8_t>& out, uint32_t v) {
     out.push_back(static_cast<uint8_t>(v & 0xFF));
@@ -775,9 +52,99 @@ void appendString(vector<uint8_t>& out, const string& s) {
     out.insert(out.end(), s.begin(), s.end());
 }
 
+// Appends src[0, n) as one LZ4 block: greedy matching through a hash of the
+// next four bytes, with the format's end rules (the last match starts at
+// least 12 bytes and ends at least 5 bytes before the end). Returns false
+// without touching out if the block would not shrink.
+bool compressBlock(const uint8_t* src, size_t n, vector<uint8_t>& out) {
+    const size_t kMinMatch = 4, kLastLiterals = 5, kMatchLimit = 12;
+    const int kHashBits = 14;
+    vector<uint8_t> block;
+    block.reserve(n);
+    auto length = [&](size_t len) {
+        for (; len >= 255; len -= 255) block.push_back(255);
+        block.push_back(static_cast<uint8_t>(len));
+    };
+    auto sequence = [&](size_t anchor, size_t literals, size_t offset, size_t match) {
+        size_t extra = match ? match - kMinMatch : 0;
+        block.push_back(static_cast<uint8_t>(min<size_t>(literals, 15) << 4 | min<size_t>(extra, 15)));
+        if (literals >= 15) length(literals - 15);
+        block.insert(block.end(), src + anchor, src + anchor + literals);
+        if (!match) return;
+        block.push_back(static_cast<uint8_t>(offset & 0xFF));
+        block.push_back(static_cast<uint8_t>(offset >> 8));
+        if (extra >= 15) length(extra - 15);
+    };
+    auto load32 = [&](size_t i) {
+        uint32_t v;
+        memcpy(&v, src + i, 4);
+        return v;
+    };
+    vector<int32_t> table(size_t(1) << kHashBits, -1);
+    size_t anchor = 0;
+    if (n > kMatchLimit) {
+        for (size_t ip = 0; ip < n - kMatchLimit;) {
+            uint32_t seq = load32(ip);
+            uint32_t h = (seq * 2654435761u) >> (32 - kHashBits);
+            int32_t ref = table[h];
+            table[h] = static_cast<int32_t>(ip);
+            if (ref < 0 || ip - ref > 0xFFFF || load32(ref) != seq) {
+                ip++;
+                continue;
+            }
+            size_t start = ip, from = ref;
+            while (start > anchor && from > 0 && src[start - 1] == src[from - 1]) {
+                start--;
+                from--;
+            }
+            size_t match = ip - start + kMinMatch;
+            while (start + match < n - kLastLiterals && src[start + match] == src[from + match]) match++;
+            sequence(anchor, start - anchor, start - from, match);
+            ip = anchor = start + match;
+            if (block.size() >= n) return false;
+        }
+    }
+    sequence(anchor, n - anchor, 0, 0);
+    if (block.size() >= n) return false;
+    out.insert(out.end(), block.begin(), block.end());
+    return true;
+}
+
+// Compresses everything after the header: the raw size, the block count, each
+// block's stored size, then the blocks.
+vector<uint8_t> compressPayload(const vector<uint8_t>& raw) {
+    vector<uint8_t> out;
+    appendU32(out, kVersion);
+    appendU32(out, kCompressed);
+    out.insert(out.end(), raw.begin() + 8, raw.begin() + kHeaderSize); // entry
+    const size_t rawSize = raw.size() - kHeaderSize;
+    const size_t numBlocks = (rawSize + kBlockSize - 1) / kBlockSize;
+    appendU32(out, static_cast<uint32_t>(rawSize));
+    appendU32(out, static_cast<uint32_t>(numBlocks));
+    const size_t sizes = out.size();
+    out.resize(sizes + numBlocks * 4);
+    for (size_t b = 0; b < numBlocks; ++b) {
+        const uint8_t* block = raw.data() + kHeaderSize + b * kBlockSize;
+        const size_t n = min(kBlockSize, rawSize - b * kBlockSize);
+        const size_t before = out.size();
+        uint32_t stored = 0;
+        if (!compressBlock(block, n, out)) {
+            out.insert(out.end(), block, block + n);
+            stored = kStoredBlock;
+        }
+        vector<uint8_t> size;
+        appendU32(size, stored | static_cast<uint32_t>(out.size() - before));
+        copy(size.begin(), size.end(), out.begin() + sizes + b * 4);
+    }
+    return out;
+}
+
+// Offsets in the payload, such as those in the function index, are positions
+// in this uncompressed layout whether or not it is then compressed.
 vector<uint8_t> buildPayload(const Program& program, int entryFunc) {
     vector<uint8_t> out;
     appendU32(out, kVersion);
+    appendU32(out, 0); // flags
     appendU32(out, static_cast<uint32_t>(entryFunc));
 
     appendU32(out, static_cast<uint32_t>(program.strings.size()));
@@ -785,12 +152,35 @@ vector<uint8_t> buildPayload(const Program& program, int entryFunc) {
         appendString(out, s);
     }
 
+    // The runtime binds natives by name to its builtins; host-registered
+    // natives have no counterpart there.
+    appendU32(out, static_cast<uint32_t>(program.natives.size()));
+    NativeRegistry builtins;
+    for (const auto& native : program.natives) {
+        const NativeFunction* builtin = builtins.find(native.name);
+        if (!builtin || builtin->fn != native.fn) {
+            throw runtime_error("Native function " + native.name + " is not available in compiled executables");
+        }
+        appendString(out, native.name);
+        appendU32(out, static_cast<uint32_t>(native.numParams));
+    }
+
+    // A fixed-size index of every function comes before their bodies, so the
+    // runtime can decode a function on its first call without reading the
+    // ones before it. Each entry holds numParams, numLocals, the code length
+    // and the payload offset of the body: the name followed by the code.
     appendU32(out, static_cast<uint32_t>(program.functions.size()));
-    for (const auto& fn : program.functions) {
+    const size_t index = out.size();
+    out.resize(index + program.functions.size() * 16);
+    for (size_t f = 0; f < program.functions.size(); ++f) {
+        const Function& fn = program.functions[f];
+        vector<uint8_t> entry;
+        appendU32(entry, static_cast<uint32_t>(fn.numParams));
+        appendU32(entry, static_cast<uint32_t>(fn.numLocals));
+        appendU32(entry, static_cast<uint32_t>(fn.code.size()));
+        appendU32(entry, static_cast<uint32_t>(out.size()));
+        copy(entry.begin(), entry.end(), out.begin() + index + f * 16);
         appendString(out, fn.name);
-        appendU32(out, static_cast<uint32_t>(fn.numParams));
-        appendU32(out, static_cast<uint32_t>(fn.numLocals));
-        appendU32(out, static_cast<uint32_t>(fn.code.size()));
         for (int v : fn.code) {
             appendU32(out, static_cast<uint32_t>(v));
         }
@@ -854,69 +244,698 @@ string detectSystemArch() {
 #endif
 }
 
+// Peak resident set of this process so far.
+size_t peakMemoryBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0;
+    return pmc.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+// Wall time and peak memory per compiler phase, for --time-passes. Each
+// mark() closes the phase that started at the previous mark or add().
+class PassTimer {
+public:
+    PassTimer() : last_(Clock::now()) {}
+
+    void mark(const string& phase) {
+        add(phase, chrono::duration<double, milli>(Clock::now() - last_).count());
+    }
+
+    // Records a phase timed elsewhere that has just ended.
+    void add(const string& phase, double ms) {
+        phases_.push_back({phase, ms, peakMemoryBytes()});
+        last_ = Clock::now();
+    }
+
+    void report(ostream& out) const {
+        double total = 0;
+        for (const auto& p : phases_) total += p.ms;
+        out << "phase          ms       %   peak MB\n";
+        for (const auto& p : phases_) {
+            out << left << setw(10) << p.name << right << fixed << setprecision(2) << setw(9) << p.ms
+                << setw(8) << setprecision(1) << (total > 0 ? p.ms * 100 / total : 0.0)
+                << setw(10) << p.peakBytes / (1024.0 * 1024.0) << "\n";
+        }
+        out << left << setw(10) << "total" << right << setprecision(2) << setw(9) << total << "\n";
+    }
+
+private:
+    using Clock = chrono::steady_clock;
+    struct Phase {
+        string name;
+        double ms;
+        size_t peakBytes;
+    };
+    Clock::time_point last_;
+    vector<Phase> phases_;
+};
+
+int findEntry(const Program& program) {
+    int entry = program.findFunction("main");
+    if (entry < 0) {
+        throw runtime_error("No main function found");
+    }
+    if (program.functions[entry].numParams != 0) {
+        throw runtime_error("main must take 0 parameters");
+    }
+    return entry;
+}
+
+string readSource(const string& path) {
+    ifstream in(path, ios::binary | ios::ate);
+    if (!in) throw runtime_error("Failed to open " + path);
+    string src(static_cast<size_t>(in.tellg()), '\0');
+    in.seekg(0);
+    in.read(&src[0], static_cast<streamsize>(src.size()));
+    return src;
+}
+
+// Batch programs only ever run main, so nothing else is parsed.
+shared_ptr<const Program> compileBatchItem(const string& path) {
+    CompileOptions options;
+    options.roots = {"main"};
+    return compile(readSource(path), options);
+}
+
+struct BatchResult {
+    string path;
+    int exitCode = 0;
+    string output;
+    string error;
+    double compileMs = 0;
+    double runMs = 0;
+    uint64_t slices = 0;
+    uint64_t instructions = 0;
+};
+
+// Manifest: one program path per line, relative to the manifest. Blank lines
+// and lines starting with '#' are skipped.
+vector<string> readManifest(const string& manifestPath) {
+    ifstream in(manifestPath);
+    if (!in) throw runtime_error("Failed to open " + manifestPath);
+    filesystem::path baseDir = filesystem::path(manifestPath).parent_path();
+    vector<string> paths;
+    string line;
+    while (getline(in, line)) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#') continue;
+        size_t end = line.find_last_not_of(" \t\r");
+        filesystem::path p = line.substr(start, end - start + 1);
+        if (p.is_relative()) p = baseDir / p;
+        paths.push_back(p.string());
+    }
+    return paths;
+}
+
+BatchResult runBatchItem(const string& path, int numThreads) {
+    using Clock = chrono::steady_clock;
+    BatchResult result;
+    result.path = path;
+    ostringstream out;
+    try {
+        auto start = Clock::now();
+        shared_ptr<const Program> program = compileBatchItem(path);
+        int entry = findEntry(*program);
+        auto compiled = Clock::now();
+        result.compileMs = chrono::duration<double, milli>(compiled - start).count();
+        try {
+            VMContext vm(program, numThreads);
+            vm.setOutput([&out](const string& line) { out << line << "\n"; });
+            result.exitCode = vm.call(entry);
+        } catch (...) {
+            result.runMs = chrono::duration<double, milli>(Clock::now() - compiled).count();
+            throw;
+        }
+        result.runMs = chrono::duration<double, milli>(Clock::now() - compiled).count();
+    } catch (const exception& ex) {
+        result.exitCode = 1;
+        result.error = ex.what();
+    }
+    result.output = out.str();
+    return result;
+}
+
+// Compiles every program in the manifest and starts it on its own VM, to be
+// time-sliced afterwards. Programs that fail to compile are reported as such.
+void runSliced(const vector<string>& paths, vector<BatchResult>& results, int jobs, int numThreads,
+               uint64_t sliceFuel, uint64_t instructionLimit) {
+    vector<ostringstream> outputs(paths.size());
+    vector<unique_ptr<VMContext>> vms(paths.size());
+    atomic<size_t> next{0};
+    auto compileAll = [&] {
+        for (size_t i = next++; i < paths.size(); i = next++) {
+            BatchResult& r = results[i];
+            r.path = paths[i];
+            auto start = chrono::steady_clock::now();
+            try {
+                shared_ptr<const Program> program = compileBatchItem(paths[i]);
+                int entry = findEntry(*program);
+                vms[i] = make_unique<VMContext>(program, numThreads);
+                ostringstream& out = outputs[i];
+                vms[i]->setOutput([&out](const string& line) { out << line << "\n"; });
+                vms[i]->start(entry);
+            } catch (const exception& ex) {
+                vms[i].reset();
+                r.exitCode = 1;
+                r.error = ex.what();
+            }
+            r.compileMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        }
+    };
+    vector<thread> pool;
+    for (int i = 1; i < jobs; ++i) pool.emplace_back(compileAll);
+    compileAll();
+    for (auto& t : pool) t.join();
+
+    TimeSlicer slicer(jobs, sliceFuel);
+    slicer.setInstructionLimit(instructionLimit);
+    vector<size_t> slot;
+    for (size_t i = 0; i < vms.size(); ++i) {
+        if (!vms[i]) continue;
+        slicer.add(*vms[i]);
+        slot.push_back(i);
+    }
+    SliceStats stats = slicer.run();
+    for (size_t k = 0; k < slot.size(); ++k) {
+        const SliceOutcome& o = slicer.outcomes()[k];
+        BatchResult& r = results[slot[k]];
+        r.exitCode = o.ok ? o.result : 1;
+        r.error = o.error;
+        r.slices = o.slices;
+        r.instructions = o.instructions;
+    }
+    for (size_t i = 0; i < paths.size(); ++i) results[i].output = outputs[i].str();
+
+    cout << fixed << setprecision(2);
+    cout << "slicing: " << stats.slices << " slices of " << sliceFuel << " instructions, "
+         << stats.instructionsPerSec / 1e6 << " M instructions/s, " << stats.overheadNsPerSlice
+         << " ns overhead/slice, max wait " << stats.maxWaitMs << " ms, fairness " << setprecision(3)
+         << stats.fairness << "\n";
+}
+
+// Compiles and runs every program in the manifest inside this process. Each
+// program gets its own VM and output buffer; results print in manifest order.
+// With sliceFuel > 0 all programs are started up front and round-robined
+// across the jobs in slices of that many instructions.
+int runBatch(const string& manifestPath, int jobs, int numThreads, uint64_t sliceFuel, uint64_t instructionLimit) {
+    vector<string> paths = readManifest(manifestPath);
+    vector<BatchResult> results(paths.size());
+
+    auto start = chrono::steady_clock::now();
+    if (sliceFuel > 0) {
+        runSliced(paths, results, jobs, numThreads, sliceFuel, instructionLimit);
+    } else {
+        atomic<size_t> next{0};
+        auto work = [&] {
+            for (size_t i = next++; i < paths.size(); i = next++) {
+                results[i] = runBatchItem(paths[i], numThreads);
+            }
+        };
+        vector<thread> pool;
+        for (int i = 1; i < jobs; ++i) pool.emplace_back(work);
+        work();
+        for (auto& t : pool) t.join();
+    }
+    double wallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    int failed = 0;
+    cout << fixed << setprecision(2);
+    for (const auto& r : results) {
+        if (r.exitCode != 0) failed++;
+        cout << "== " << r.path << " (exit " << r.exitCode << ", compile " << r.compileMs << " ms, ";
+        if (sliceFuel > 0) {
+            cout << r.slices << " slices, " << r.instructions << " instructions)\n";
+        } else {
+            cout << "run " << r.runMs << " ms)\n";
+        }
+        cout << r.output;
+        if (!r.error.empty()) cout << "Error: " << r.error << "\n";
+    }
+    double perSec = wallMs > 0 ? results.size() * 1000.0 / wallMs : 0;
+    cout << "batch: " << results.size() << " programs, " << failed << " failed, " << jobs << " jobs, "
+         << wallMs << " ms, " << perSec << " programs/s\n";
+    return failed == 0 ? 0 : 1;
+}
+
+// Inputs for --map: one argument tuple per line, values separated by spaces
+// or commas. Blank lines are skipped.
+vector<int> readTuples(const string& path, int arity) {
+    string text = readSource(path);
+    vector<int> values;
+    int line = 1;
+    const char* p = text.c_str();
+    const char* end = p + text.size();
+    while (p < end) {
+        size_t before = values.size();
+        while (p < end && *p != '\n') {
+            if (*p == ' ' || *p == ',' || *p == '\t' || *p == '\r') {
+                ++p;
+                continue;
+            }
+            char* stop;
+            long v = strtol(p, &stop, 10);
+            if (stop == p) throw runtime_error(path + ":" + to_string(line) + ": expected an integer");
+            values.push_back(static_cast<int>(v));
+            p = stop;
+        }
+        size_t got = values.size() - before;
+        if (got != 0 && got != static_cast<size_t>(arity)) {
+            throw runtime_error(path + ":" + to_string(line) + ": expected " + to_string(arity) + " values, got " +
+                                to_string(got));
+        }
+        ++p;
+        ++line;
+    }
+    return values;
+}
+
+// Runs one function over every tuple in the inputs file, printing one result
+// per line; timing goes to stderr.
+int runMap(shared_ptr<const Program> program, const string& fn, const string& inputsPath, int lanes) {
+    BatchEvaluator eval(std::move(program), fn, lanes);
+    vector<int> args = readTuples(inputsPath, eval.arity());
+    vector<int> results;
+    auto start = chrono::steady_clock::now();
+    eval.run(args, results);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    string out;
+    out.reserve(results.size() * 8);
+    for (int r : results) {
+        out += to_string(r);
+        out += '\n';
+    }
+    cout << out << flush;
+    cerr << fixed << setprecision(2) << "map: " << results.size() << " inputs, "
+         << (eval.vectorized() ? to_string(eval.lanes()) + " lanes" : string("scalar")) << ", " << ms << " ms, "
+         << (ms > 0 ? results.size() / ms / 1000.0 : 0.0) << " M inputs/s\n";
+    return 0;
+}
+
+// Prints each function's local slots before and after slot sharing, for
+// --report-frames.
+void reportFrameSizes(const vector<FrameSize>& sizes, ostream& out) {
+    size_t width = 8;
+    for (const auto& f : sizes) width = max(width, f.function.size());
+    long long before = 0, after = 0;
+    out << left << setw(static_cast<int>(width)) << "function" << right << setw(8) << "before" << setw(8) << "after"
+        << "\n";
+    for (const auto& f : sizes) {
+        out << left << setw(static_cast<int>(width)) << f.function << right << setw(8) << f.before << setw(8)
+            << f.after << "\n";
+        before += f.before;
+        after += f.after;
+    }
+    out << left << setw(static_cast<int>(width)) << "total" << right << setw(8) << before << setw(8) << after << "\n";
+}
+
+void reportFoldedCalls(const vector<FoldedCall>& calls, ostream& out) {
+    for (const auto& c : calls) {
+        out << c.function << ":" << c.line << " " << c.callee << "(";
+        for (size_t i = 0; i < c.args.size(); ++i) out << (i ? ", " : "") << c.args[i];
+        out << ") = " << c.result;
+        if (c.instructions > 0) out << " (" << c.instructions << " instructions)";
+        out << "\n";
+    }
+    out << calls.size() << " calls folded\n";
+}
+
+// One "perf <name> <value>" line per counter, "n/a" where a counter or an
+// input of a derived figure is missing. bytecodes is the number of VM
+// instructions the measured run executed on all threads, 0 if unknown.
+void reportPerfCounters(const PerfCounters& perf, uint64_t bytecodes, ostream& out) {
+    if (!perf.error().empty()) out << "# perf counters unavailable: " << perf.error() << "\n";
+    const PerfCounters::Counter* cycles = nullptr;
+    const PerfCounters::Counter* instructions = nullptr;
+    vector<PerfCounters::Counter> counters = perf.read();
+    for (const auto& c : counters) {
+        out << "perf " << c.name << " ";
+        if (c.available) out << c.value << "\n";
+        else out << "n/a\n";
+        if (c.available && strcmp(c.name, "cycles") == 0) cycles = &c;
+        if (c.available && strcmp(c.name, "instructions") == 0) instructions = &c;
+    }
+    out << "perf bytecodes " << bytecodes << "\n" << fixed << setprecision(3);
+    out << "perf ipc ";
+    if (cycles && instructions && cycles->value > 0) out << double(instructions->value) / cycles->value << "\n";
+    else out << "n/a\n";
+    out << "perf cycles-per-bytecode ";
+    if (cycles && bytecodes > 0) out << double(cycles->value) / bytecodes << "\n";
+    else out << "n/a\n";
+}
+
+// Parses --args: comma-separated integers, possibly none.
+vector<int> parseArgs(const string& text) {
+    vector<int> values;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t comma = text.find(',', pos);
+        if (comma == string::npos) comma = text.size();
+        string item = text.substr(pos, comma - pos);
+        char* stop;
+        long v = strtol(item.c_str(), &stop, 10);
+        if (item.empty() || *stop != '\0' || v < INT_MIN || v > INT_MAX) {
+            throw runtime_error("Bad --args value: " + item);
+        }
+        values.push_back(static_cast<int>(v));
+        pos = comma + 1;
+    }
+    return values;
+}
+
+// One "entry:" line summarising the timed calls of --entry. micros holds one
+// latency per call; p99 is nearest-rank.
+void reportEntry(const string& name, const vector<int>& args, int warmup, vector<double> micros, uint64_t bytecodes,
+                 ostream& out) {
+    sort(micros.begin(), micros.end());
+    size_t n = micros.size();
+    size_t p99 = (n * 99 + 99) / 100;
+    out << "entry: " << name << "(";
+    for (size_t i = 0; i < args.size(); ++i) out << (i ? ", " : "") << args[i];
+    out << "), " << n << " calls after " << warmup << " warmup" << fixed << setprecision(3) << ", min "
+        << micros.front() << " us, median " << micros[n / 2] << " us, p99 " << micros[p99 - 1] << " us, ";
+    if (bytecodes > 0) out << bytecodes << " instructions/call\n";
+    else out << "n/a instructions/call\n";
+}
+
 int main(int argc, char** argv) {
     try {
         if (argc < 2) {
-            cerr << "Usage: scc <file.s> -o <out.exe> --arch x64\n";
+            cerr << "Usage: scc <file.s> -o <out.exe> --arch x64 [--time-passes] [--report-frames]\n";
+            cerr << "       [--fold-budget N] [--fold-total N] [--report-folds] [--compress]\n";
             cerr << "   or: scc <file.s> -o <out.exe>--arch x64\n";
-            cerr << "   or: scc --run <file.s>\n";
+            cerr << "   or: scc <file.s> --emit-cpp <out.cpp>\n";
+            cerr << "   or: scc --run [--threads N] [--vm basic|quicken|tos] [--trace] [--sample-profile=<hz> [--sample-output <file>]] <file.s>\n";
+            cerr << "   or: scc --run --perf-counters <file.s>\n";
+            cerr << "   or: scc --run --input <data.txt> <file.s>\n";
+            cerr << "   or: scc --run --entry <fn> [--args a,b] [--repeat N] [--warmup M] <file.s>\n";
+            cerr << "   or: scc --run --profile-out <prof.dat> <file.s>, then any mode with --profile-use <prof.dat>\n";
+            cerr << "   or: scc --map <fn> <inputs.txt> [--lanes 1|8|16] <file.s>\n";
+            cerr << "   or: scc --run-batch <manifest> [--jobs N] [--threads N] [--fuel N] [--max-instructions N]\n";
             return 1;
         }
 
         bool runMode = false;
+        bool batchMode = false;
         bool archExplicit = false;
 #if defined(_WIN64)
         string arch = "x64";
 #else
         string arch = "x86";
 #endif
-        int argi = 1;
-        if (string(argv[argi]) == "--run") {
-            runMode = true;
-            argi++;
-        }
-        if (argi < argc && string(argv[argi]) == "--arch") {
-            if (argi + 1 >= argc) throw runtime_error("Expected --arch x64|x86");
-            arch = argv[argi + 1];
-            archExplicit = true;
-            argi += 2;
-        }
-        if (argi >= argc) throw runtime_error("Missing input file");
-
-        string inputPath = argv[argi++];
+        int numThreads = 0;
+        string vmKind = "basic";
+        int jobs = max(1, static_cast<int>(thread::hardware_concurrency()));
+        uint64_t sliceFuel = 0;
+        uint64_t instructionLimit = 0;
+        bool timePasses = false;
+        bool reportFrames = false;
+        uint64_t foldBudget = CompileOptions().foldBudget;
+        uint64_t foldTotalBudget = CompileOptions().foldTotalBudget;
+        bool reportFolds = false;
+        bool compress = false;
+        bool trace = false;
+        bool perfCounters = false;
+        int sampleHz = 0;
+        string sampleOutput = "sample.folded";
+        string inputPath;
         string outExe;
-
-        if (!runMode) {
-            if (argi + 1 >= argc || string(argv[argi]) != "-o") {
-                throw runtime_error("Usage: scc <file.s> -o <out.exe> [--arch x64|x86]");
+        string outCpp;
+        string mapFunction;
+        string mapInputs;
+        int lanes = 16;
+        string profileOut;
+        string profileUse;
+        string inputData;
+        string entryName;
+        vector<int> entryArgs;
+        int repeat = 1;
+        int warmup = 0;
+
+        for (int argi = 1; argi < argc; ++argi) {
+            string arg = argv[argi];
+            if (arg == "--run") {
+                runMode = true;
+            } else if (arg == "--run-batch") {
+                batchMode = true;
+            } else if (arg == "--fuel") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --fuel N");
+                sliceFuel = stoull(argv[++argi]);
+            } else if (arg == "--max-instructions") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --max-instructions N");
+                instructionLimit = stoull(argv[++argi]);
+            } else if (arg == "--jobs") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --jobs N");
+                jobs = stoi(argv[++argi]);
+                if (jobs < 1) throw runtime_error("--jobs must be at least 1");
+            } else if (arg == "--arch") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --arch x64|x86");
+                arch = argv[++argi];
+                archExplicit = true;
+            } else if (arg == "--vm") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --vm basic|quicken|tos");
+                vmKind = argv[++argi];
+                if (vmKind != "basic" && vmKind != "quicken" && vmKind != "tos") {
+                    throw runtime_error("Unknown VM: " + vmKind);
+                }
+            } else if (arg.rfind("--sample-profile=", 0) == 0) {
+                sampleHz = stoi(arg.substr(strlen("--sample-profile=")));
+                if (sampleHz < 1) throw runtime_error("--sample-profile rate must be at least 1 Hz");
+            } else if (arg == "--trace") {
+                trace = true;
+            } else if (arg == "--perf-counters") {
+                perfCounters = true;
+            } else if (arg == "--time-passes") {
+                timePasses = true;
+            } else if (arg == "--report-frames") {
+                reportFrames = true;
+            } else if (arg == "--fold-budget") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --fold-budget N");
+                foldBudget = stoull(argv[++argi]);
+            } else if (arg == "--fold-total") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --fold-total N");
+                foldTotalBudget = stoull(argv[++argi]);
+            } else if (arg == "--report-folds") {
+                reportFolds = true;
+            } else if (arg == "--compress") {
+                compress = true;
+            } else if (arg == "--sample-output") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --sample-output <file>");
+                sampleOutput = argv[++argi];
+            } else if (arg == "--threads") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --threads N");
+                numThreads = stoi(argv[++argi]);
+                if (numThreads < 1) throw runtime_error("--threads must be at least 1");
+            } else if (arg == "--emit-cpp") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --emit-cpp <out.cpp>");
+                outCpp = argv[++argi];
+            } else if (arg == "--map") {
+                if (argi + 2 >= argc) throw runtime_error("Expected --map <fn> <inputs.txt>");
+                mapFunction = argv[++argi];
+                mapInputs = argv[++argi];
+            } else if (arg == "--lanes") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --lanes 1|8|16");
+                lanes = stoi(argv[++argi]);
+            } else if (arg == "--profile-out") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --profile-out <file>");
+                profileOut = argv[++argi];
+            } else if (arg == "--profile-use") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --profile-use <file>");
+                profileUse = argv[++argi];
+            } else if (arg == "--input") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --input <file>");
+                inputData = argv[++argi];
+            } else if (arg == "--entry") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --entry <fn>");
+                entryName = argv[++argi];
+            } else if (arg == "--args") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --args a,b");
+                entryArgs = parseArgs(argv[++argi]);
+            } else if (arg == "--repeat") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --repeat N");
+                repeat = stoi(argv[++argi]);
+                if (repeat < 1) throw runtime_error("--repeat must be at least 1");
+            } else if (arg == "--warmup") {
+                if (argi + 1 >= argc) throw runtime_error("Expected --warmup M");
+                warmup = stoi(argv[++argi]);
+                if (warmup < 0) throw runtime_error("--warmup must not be negative");
+            } else if (arg == "-o") {
+                if (argi + 1 >= argc) throw runtime_error("Expected -o <out.exe>");
+                outExe = argv[++argi];
+            } else if (inputPath.empty()) {
+                inputPath = arg;
+            } else {
+                throw runtime_error("Unexpected argument: " + arg);
             }
-            outExe = argv[argi + 1];
         }
-
-        ifstream in(inputPath);
-        if (!in) {
-            cerr << "Failed to open " << inputPath << "\n";
-            return 1;
+        if (inputPath.empty()) throw runtime_error("Missing input file");
+        if (batchMode) {
+            // Programs already run side by side, so spawn stays on the calling
+            // thread unless --threads asks for more.
+            return runBatch(inputPath, jobs, numThreads > 0 ? numThreads : 1, sliceFuel, instructionLimit);
+        }
+        if (numThreads == 0) numThreads = static_cast<int>(thread::hardware_concurrency());
+        if (!runMode && outExe.empty() && outCpp.empty() && mapFunction.empty()) {
+            throw runtime_error("Usage: scc <file.s> -o <out.exe> [--arch x64|x86]");
+        }
+        if (!profileOut.empty() && !runMode) throw runtime_error("--profile-out needs --run");
+        if (perfCounters && !runMode) throw runtime_error("--perf-counters needs --run");
+        if (!inputData.empty() && !runMode) throw runtime_error("--input needs --run");
+        if (!entryName.empty() && !runMode) throw runtime_error("--entry needs --run");
+        if (compress && outExe.empty()) throw runtime_error("--compress needs -o");
+        PassTimer passes;
+
+        string src = readSource(inputPath);
+        passes.mark("read");
+
+        CompileOptions options;
+        options.roots = {!entryName.empty() ? entryName : mapFunction.empty() ? "main" : mapFunction};
+        if (timePasses) options.onPhase = [&passes](const char* phase, double ms) { passes.add(phase, ms); };
+        Profile profileIn;
+        ProfileStats profileStats;
+        if (!profileUse.empty()) {
+            ifstream in(profileUse);
+            if (!in) throw runtime_error("Failed to open " + profileUse);
+            profileIn = Profile::read(in);
+            options.profile = &profileIn;
+            options.profileStats = &profileStats;
+        }
+        vector<FrameSize> frameSizes;
+        if (reportFrames) options.frameSizes = &frameSizes;
+        // A recorded profile must number call sites as an unfolded build does.
+        options.foldBudget = profileOut.empty() ? foldBudget : 0;
+        options.foldTotalBudget = foldTotalBudget;
+        vector<FoldedCall> foldedCalls;
+        if (reportFolds) options.foldedCalls = &foldedCalls;
+        shared_ptr<const Program> program = compile(src, options);
+        if (reportFrames) reportFrameSizes(frameSizes, cerr);
+        if (reportFolds) reportFoldedCalls(foldedCalls, cerr);
+        if (!profileUse.empty()) {
+            cerr << "profile: " << profileStats.branchesInverted << " branches inverted, " << profileStats.loopsRotated
+                 << " loops rotated, " << profileStats.callsInlined << " calls inlined\n";
+        }
+        if (!mapFunction.empty()) return runMap(program, mapFunction, mapInputs, lanes);
+        int entry = -1;
+        if (entryName.empty()) {
+            entry = findEntry(*program);
+        } else {
+            entry = program->findFunction(entryName);
+            if (entry < 0) throw runtime_error("Unknown function: " + entryName);
         }
 
-        string src((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
-
-        Parser parser(src);
-        Program program = parser.compile();
-
-        auto it = find_if(program.functions.begin(), program.functions.end(), [](const Function& f) {
-            return f.name == "main";
-        });
-        if (it == program.functions.end()) {
-            throw runtime_error("No main function found");
-        }
-        if (it->numParams != 0) {
-            throw runtime_error("main must take 0 parameters");
+        if (runMode) {
+            // read() takes integers from --input, or from stdin.
+            auto openInput = [&inputData](VMContext& vm) {
+                if (inputData.empty()) return;
+                shared_ptr<FILE> file(fopen(inputData.c_str(), "rb"), [](FILE* f) {
+                    if (f) fclose(f);
+                });
+                if (!file) throw runtime_error("Failed to open " + inputData);
+                vm.setInput([file](char* buf, size_t size) { return fread(buf, 1, size, file.get()); });
+            };
+            auto vm = make_unique<VMContext>(program, numThreads);
+            openInput(*vm);
+            if (vmKind == "quicken") vm->enableQuickening();
+            if (vmKind == "tos") vm->enableTopCaching();
+            if (trace) vm->enableTracing();
+            if (!profileOut.empty()) vm->enableCounting();
+            unique_ptr<SampleProfiler> profiler;
+            if (sampleHz > 0) {
+                vm->enableSampling();
+                profiler = make_unique<SampleProfiler>(sampleHz);
+                profiler->start();
+            }
+            unique_ptr<PerfCounters> perf;
+            if (perfCounters) {
+                // The run the counters measure also tallies its instructions.
+                vm->enableTally();
+                perf = make_unique<PerfCounters>();
+                perf->start();
+            }
+            // Without --perf-counters, --entry counts the instructions of one
+            // more call in a separate tallied context with the output
+            // discarded, so the timed calls run untallied. A program reading
+            // stdin finds it used up, which leaves the count at 0.
+            auto countBytecodes = [&]() -> uint64_t {
+                VMContext counter(program, numThreads);
+                counter.setOutput([](const string&) {});
+                openInput(counter);
+                counter.enableTally();
+                try {
+                    counter.call(entry, entryArgs);
+                    return counter.tally();
+                } catch (const exception&) {
+                    return 0;
+                }
+            };
+            int rc = 0;
+            vector<double> micros;
+            if (entryName.empty()) {
+                rc = vm->call(entry);
+            } else {
+                // Warmup calls settle quickening and caches; each timed call
+                // then gets its own latency sample.
+                for (int i = 0; i < warmup; ++i) vm->call(entry, entryArgs);
+                micros.reserve(repeat);
+                int result = 0;
+                for (int i = 0; i < repeat; ++i) {
+                    auto t0 = chrono::steady_clock::now();
+                    result = vm->call(entry, entryArgs);
+                    micros.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count());
+                }
+                cout << result << "\n" << flush;
+            }
+            if (profiler) profiler->stop();
+            const uint64_t tally = vm->tally();
+            const uint64_t quickened = vm->quickenedSites();
+            Profile profile = vm->profile();
+            // Spawned work reaches the inherited counters only as the worker
+            // threads exit, so the context, which joins them, goes first.
+            vm.reset();
+            if (perf) perf->stop();
+            passes.mark("run");
+            const uint64_t calls = entryName.empty() ? 1 : static_cast<uint64_t>(warmup) + repeat;
+            if (!micros.empty()) {
+                uint64_t perCall = perf ? tally / calls : countBytecodes();
+                reportEntry(entryName, entryArgs, warmup, micros, perCall, cerr);
+            }
+            if (perf) reportPerfCounters(*perf, tally, cerr);
+            if (vmKind == "quicken") cerr << "quickened sites: " << quickened << "\n";
+            if (!profileOut.empty()) {
+                ofstream out(profileOut);
+                if (!out) throw runtime_error("Failed to write " + profileOut);
+                profile.write(out);
+                cerr << "profile: " << profile.numBranches() << " branch sites, " << profile.numCalls()
+                     << " call sites -> " << profileOut << "\n";
+            }
+            if (profiler) {
+                ofstream out(sampleOutput);
+                if (!out) throw runtime_error("Failed to write " + sampleOutput);
+                profiler->writeFolded(out, *program);
+                cerr << "samples: " << profiler->samples() << " (" << profiler->dropped() << " dropped) -> "
+                     << sampleOutput << "\n";
+            }
+            if (timePasses) passes.report(cerr);
+            return rc;
         }
-        int entry = static_cast<int>(it - program.functions.begin());
 
-        if (runMode) {
-            return runVM(program, entry);
+        if (!outCpp.empty()) {
+            ofstream out(outCpp);
+            if (!out) throw runtime_error("Failed to create " + outCpp);
+            emitCpp(*program, entry, out);
+            if (!out) throw runtime_error("Failed to write " + outCpp);
+            passes.mark("emit");
+            if (timePasses) passes.report(cerr);
+            return 0;
         }
 
         if (!archExplicit) {
@@ -932,8 +951,17 @@ int main(int argc, char** argv) {
         if (base.empty()) {
             throw runtime_error("Embedded runtime is empty. Rebuild embedded runtimes.");
         }
-        vector<uint8_t> payload = buildPayload(program, entry);
+        vector<uint8_t> payload = buildPayload(*program, entry);
+        if (compress) {
+            const size_t raw = payload.size();
+            payload = compressPayload(payload);
+            cout << "Payload compressed from " << raw << " to " << payload.size() << " bytes (" << fixed
+                 << setprecision(1) << 100.0 * payload.size() / raw << "%)\n";
+        }
+        passes.mark("payload");
         writeExeWithPayload(base, outExe, payload);
+        passes.mark("write");
+        if (timePasses) passes.report(cerr);
         return 0;
 
     } catch (const exception& ex) {
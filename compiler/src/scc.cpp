@@ -0,0 +1,2685 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "scc.h"
+#include "vm_core.h"
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <sys/time.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+namespace scc {
+
+namespace {
+
+using namespace svm;
+
+enum class TokType {
+    End,
+    Ident,
+    Number,
+    String,
+    LParen, RParen,
+    LBrace, RBrace,
+    Comma, Semicolon, Colon,
+    Plus, Minus, Star, Slash,
+    Assign,
+    Eq, Ne, Lt, Le, Gt, Ge,
+    AndAnd, OrOr, Bang,
+    KwInt, KwReturn, KwIf, KwElse, KwWhile, KwSwitch, KwCase, KwDefault
+};
+
+struct Token {
+    TokType type = TokType::End;
+    int value = 0;
+    int line = 1;
+    int col = 1;
+    // Points into the source, or into the lexer's decoded string literals.
+    string_view text;
+};
+
+class Lexer {
+public:
+    // The source must outlive the lexer, and the lexer its tokens. Throws on
+    // the first malformed token.
+    explicit Lexer(const string& src) : src_(src), end_(src.size()) {}
+
+    // Lexes src[begin, end), which starts at line:col.
+    Lexer(const string& src, size_t begin, size_t end, int line, int col)
+        : src_(src), end_(end), pos_(begin), line_(line), col_(col) {}
+
+    size_t pos() const { return pos_; }
+
+    Token next() {
+        skipWhitespaceAndComments();
+        if (pos_ >= end_) return makeToken(TokType::End, "");
+
+        char c = src_[pos_];
+        if (isalpha(static_cast<unsigned char>(c)) || c == '_') {
+            return identOrKeyword();
+        }
+        if (isdigit(static_cast<unsigned char>(c))) {
+            return number();
+        }
+        if (c == '"') {
+            return stringLiteral();
+        }
+
+        switch (c) {
+            case '(': return simple(TokType::LParen, "(");
+            case ')': return simple(TokType::RParen, ")");
+            case '{': return simple(TokType::LBrace, "{");
+            case '}': return simple(TokType::RBrace, "}");
+            case ',': return simple(TokType::Comma, ",");
+            case ';': return simple(TokType::Semicolon, ";");
+            case ':': return simple(TokType::Colon, ":");
+            case '+': return simple(TokType::Plus, "+");
+            case '-': return simple(TokType::Minus, "-");
+            case '*': return simple(TokType::Star, "*");
+            case '/': return simple(TokType::Slash, "/");
+            case '=': return match('=') ? simple(TokType::Eq, "==") : simple(TokType::Assign, "=");
+            case '!': return match('=') ? simple(TokType::Ne, "!=") : simple(TokType::Bang, "!");
+            case '&': return match('&') ? simple(TokType::AndAnd, "&&") : errorToken("Unexpected '&'");
+            case '|': return match('|') ? simple(TokType::OrOr, "||") : errorToken("Unexpected '|'");
+            case '<': return match('=') ? simple(TokType::Le, "<=") : simple(TokType::Lt, "<");
+            case '>': return match('=') ? simple(TokType::Ge, ">=") : simple(TokType::Gt, ">");
+            default:
+                return errorToken(string("Unexpected '") + c + "'");
+        }
+    }
+
+    // Called after next() returned '{': skips to just past the matching '}'
+    // without lexing what lies between, minding comments and string literals.
+    // Returns false if the source ends first.
+    bool skipBlock() {
+        const char* src = src_.data();
+        size_t pos = pos_;
+        size_t lineStart = pos - (col_ - 1);
+        int depth = 1;
+        while (pos < end_) {
+            char c = src[pos++];
+            if (c == '\n') {
+                line_++;
+                lineStart = pos;
+            } else if (c == '{') {
+                depth++;
+            } else if (c == '}') {
+                if (--depth == 0) break;
+            } else if (c == '"') {
+                while (pos < end_ && src[pos] != '"' && src[pos] != '\n') {
+                    if (src[pos] == '\\' && pos + 1 < end_ && src[pos + 1] == '\n') {
+                        line_++;
+                        lineStart = pos + 2;
+                    }
+                    pos += src[pos] == '\\' ? 2 : 1;
+                }
+                if (pos < end_ && src[pos] == '"') pos++;
+            } else if (c == '/' && pos < end_ && src[pos] == '/') {
+                while (pos < end_ && src[pos] != '\n') pos++;
+            } else if (c == '/' && pos < end_ && src[pos] == '*') {
+                pos++;
+                while (pos < end_ && !(src[pos] == '*' && pos + 1 < end_ && src[pos + 1] == '/')) {
+                    if (src[pos++] == '\n') {
+                        line_++;
+                        lineStart = pos;
+                    }
+                }
+                pos = min(pos + 2, end_);
+            }
+        }
+        pos_ = min(pos, end_);
+        col_ = static_cast<int>(pos_ - lineStart) + 1;
+        return depth == 0;
+    }
+
+private:
+    Token makeToken(TokType type, string_view text) {
+        Token t;
+        t.type = type;
+        t.text = text;
+        t.line = line_;
+        t.col = col_;
+        return t;
+    }
+
+    Token simple(TokType type, string_view text) {
+        Token t = makeToken(type, text);
+        advance(text.size());
+        return t;
+    }
+
+    Token errorToken(const string& msg) {
+        throw runtime_error(msg);
+    }
+
+    void advance(size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            if (src_[pos_] == '\n') { line_++; col_ = 1; }
+            else { col_++; }
+            pos_++;
+        }
+    }
+
+    bool match(char expected) {
+        if (pos_ + 1 >= end_) return false;
+        return src_[pos_ + 1] == expected;
+    }
+
+    void skipWhitespaceAndComments() {
+        while (pos_ < end_) {
+            char c = src_[pos_];
+            if (isspace(static_cast<unsigned char>(c))) {
+                advance(1);
+                continue;
+            }
+            if (c == '/' && pos_ + 1 < end_) {
+                if (src_[pos_ + 1] == '/') {
+                    while (pos_ < end_ && src_[pos_] != '\n') advance(1);
+                    continue;
+                }
+                if (src_[pos_ + 1] == '*') {
+                    advance(2);
+                    while (pos_ + 1 < end_) {
+                        if (src_[pos_] == '*' && src_[pos_ + 1] == '/') {
+                            advance(2);
+                            break;
+                        }
+                        advance(1);
+                    }
+                    continue;
+                }
+            }
+            return;
+        }
+    }
+
+    Token identOrKeyword() {
+        size_t start = pos_;
+        int startCol = col_;
+        while (pos_ < end_) {
+            char c = src_[pos_];
+            if (!isalnum(static_cast<unsigned char>(c)) && c != '_') break;
+            advance(1);
+        }
+        Token t;
+        t.text = string_view(src_).substr(start, pos_ - start);
+        t.line = line_;
+        t.col = startCol;
+
+        string_view text = t.text;
+        if (text == "int") t.type = TokType::KwInt;
+        else if (text == "return") t.type = TokType::KwReturn;
+        else if (text == "if") t.type = TokType::KwIf;
+        else if (text == "else") t.type = TokType::KwElse;
+        else if (text == "while") t.type = TokType::KwWhile;
+        else if (text == "switch") t.type = TokType::KwSwitch;
+        else if (text == "case") t.type = TokType::KwCase;
+        else if (text == "default") t.type = TokType::KwDefault;
+        else t.type = TokType::Ident;
+        return t;
+    }
+
+    Token number() {
+        size_t start = pos_;
+        int startCol = col_;
+        while (pos_ < end_ && isdigit(static_cast<unsigned char>(src_[pos_]))) advance(1);
+        Token t;
+        t.type = TokType::Number;
+        t.text = string_view(src_).substr(start, pos_ - start);
+        t.value = stoi(string(t.text));
+        t.line = line_;
+        t.col = startCol;
+        return t;
+    }
+
+    Token stringLiteral() {
+        int startCol = col_;
+        advance(1); // opening quote
+        string value;
+        while (pos_ < end_) {
+            char c = src_[pos_];
+            if (c == '"') {
+                advance(1);
+                Token t;
+                t.type = TokType::String;
+                literals_.push_back(std::move(value));
+                t.text = literals_.back();
+                t.line = line_;
+                t.col = startCol;
+                return t;
+            }
+            if (c == '\\') {
+                if (pos_ + 1 >= end_) break;
+                char n = src_[pos_ + 1];
+                switch (n) {
+                    case 'n': value.push_back('\n'); break;
+                    case 't': value.push_back('\t'); break;
+                    case 'r': value.push_back('\r'); break;
+                    case '"': value.push_back('"'); break;
+                    case '\\': value.push_back('\\'); break;
+                    default: value.push_back(n); break;
+                }
+                advance(2);
+                continue;
+            }
+            if (c == '\n') break;
+            value.push_back(c);
+            advance(1);
+        }
+        return errorToken("Unterminated string literal");
+    }
+
+    const string& src_;
+    size_t end_;
+    deque<string> literals_;
+    size_t pos_ = 0;
+    int line_ = 1;
+    int col_ = 1;
+};
+
+// Feeds the parser from a window of lexed tokens that is refilled in
+// batches, so memory stays flat on large sources and lexing can be timed
+// separately at the cost of one clock read per batch.
+class TokenStream {
+public:
+    // buf lends the storage of an earlier stream, which release() hands back,
+    // so streams over many short spans don't each regrow their buffer.
+    explicit TokenStream(Lexer& lexer, vector<Token> buf = {}) : lexer_(lexer), buf_(std::move(buf)) {
+        buf_.clear();
+        fill();
+    }
+
+    vector<Token> release() { return std::move(buf_); }
+
+    const Token& current() const { return buf_[pos_]; }
+    const Token& peek() const { return buf_[min(pos_ + 1, buf_.size() - 1)]; }
+
+    // Invalidates references to earlier tokens.
+    void advance() {
+        if (pos_ + 1 < buf_.size()) pos_++;
+        if (pos_ + 1 >= buf_.size()) fill();
+    }
+
+    double lexMs() const { return lexMs_; }
+
+private:
+    static const size_t kBatch = 4096;
+
+    void fill() {
+        if (done_) return;
+        auto start = chrono::steady_clock::now();
+        buf_.erase(buf_.begin(), buf_.begin() + pos_);
+        pos_ = 0;
+        while (buf_.size() < kBatch) {
+            buf_.push_back(lexer_.next());
+            if (buf_.back().type == TokType::End) {
+                done_ = true;
+                break;
+            }
+        }
+        lexMs_ += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+
+    Lexer& lexer_;
+    vector<Token> buf_;
+    size_t pos_ = 0;
+    bool done_ = false;
+    double lexMs_ = 0;
+};
+
+struct PendingCall {
+    int funcIndex;
+    int codePos;
+    string name;
+    int argCount;
+    // The profile saw this call often enough to inline it.
+    bool hot = false;
+};
+
+// Code cut out of the function being parsed so it can be placed again later,
+// with the calls it makes (positions relative to the start of the chunk).
+struct CodeChunk {
+    vector<int> code;
+    vector<int> lines;
+    vector<PendingCall> calls;
+};
+
+// A parsed expression. Plain expressions leave their value on the stack. Once
+// a logical operator applies, the code jumps instead: it falls through when
+// the condition holds, and each slot in t (f) is the target operand of a jump
+// taken when it holds (fails), patched once the destination is known. branch
+// is the position of the last jump, which ends the code and targets f.
+struct Cond {
+    int branch = -1;
+    vector<int> t, f;
+    // Recorded outcomes of the last jump, if the profile has them.
+    const Profile::Branch* counts = nullptr;
+
+    bool jumps() const { return branch >= 0; }
+    // One test, which can be turned around or back into a value.
+    bool simple() const { return jumps() && t.empty() && f.size() == 1; }
+};
+
+// Profile thresholds: a call is inlined once it ran kHotCallCount times and
+// the callee is a leaf of at most kMaxInlineSize code slots.
+const uint64_t kHotCallCount = 100;
+const size_t kMaxInlineSize = 64;
+
+// The compare that yields the opposite result; -1 for other opcodes.
+int negatedCompare(int op) {
+    switch (op) {
+        case OP_EQ: return OP_NE;
+        case OP_NE: return OP_EQ;
+        case OP_LT: return OP_GE;
+        case OP_GE: return OP_LT;
+        case OP_LE: return OP_GT;
+        case OP_GT: return OP_LE;
+        default: return -1;
+    }
+}
+
+// Functions with more locals than this keep one slot per local: the
+// interference matrix grows with the square of the count.
+const int kMaxSharedLocals = 4096;
+
+// Gives locals whose lifetimes never overlap the same slot. Liveness is solved
+// backwards over basic blocks; a STORE makes its local interfere with
+// everything live after it. Parameters, and locals read before any store
+// (which rely on the frame's zero fill), are all defined at entry and so
+// interfere with each other and with whatever is live there. Parameters keep
+// their slots, since callers fill them by position; the rest are colored
+// greedily with the lowest free slot. One instance is reused for every
+// function so its buffers are allocated once.
+class SlotSharer {
+public:
+    void run(Function& fn) {
+        const int n = fn.numLocals;
+        const vector<int>& code = fn.code;
+        const int size = static_cast<int>(code.size());
+        if (n <= fn.numParams || n > kMaxSharedLocals || code.empty()) return;
+        words_ = (static_cast<size_t>(n) + 63) / 64;
+
+        // Blocks start at the entry, at jump targets and after jumps and returns.
+        ips_.clear();
+        leader_.assign(size + 1, 0);
+        leader_[0] = 1;
+        for (int ip = 0; ip < size; ip += opLength(code[ip])) {
+            ips_.push_back(ip);
+            int op = code[ip];
+            if (int t = targetOperand(op)) leader_[code[ip + t]] = 1;
+            if (targetOperand(op) || op == OP_RET) leader_[ip + opLength(op)] = 1;
+        }
+        blockOf_.assign(size + 1, -1);
+        first_.clear();
+        for (size_t i = 0; i < ips_.size(); ++i) {
+            if (!leader_[ips_[i]]) continue;
+            blockOf_[ips_[i]] = static_cast<int>(first_.size());
+            first_.push_back(static_cast<int>(i));
+        }
+        const size_t numBlocks = first_.size();
+        first_.push_back(static_cast<int>(ips_.size()));
+
+        gen_.assign(numBlocks * words_, 0);
+        kill_.assign(numBlocks * words_, 0);
+        for (size_t b = 0; b < numBlocks; ++b) {
+            uint64_t* gen = &gen_[b * words_];
+            uint64_t* kill = &kill_[b * words_];
+            for (int i = first_[b + 1]; i-- > first_[b];) {
+                int ip = ips_[i];
+                if (code[ip] == OP_STORE) {
+                    clear(gen, code[ip + 1]);
+                    set(kill, code[ip + 1]);
+                } else if (code[ip] == OP_LOAD) {
+                    set(gen, code[ip + 1]);
+                }
+            }
+        }
+
+        liveIn_.assign(numBlocks * words_, 0);
+        liveOut_.assign(numBlocks * words_, 0);
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t b = numBlocks; b-- > 0;) {
+                uint64_t* out = &liveOut_[b * words_];
+                int succ[2];
+                for (int k = successors(code, b, succ); k-- > 0;) {
+                    const uint64_t* in = &liveIn_[succ[k] * words_];
+                    for (size_t w = 0; w < words_; ++w) out[w] |= in[w];
+                }
+                uint64_t* in = &liveIn_[b * words_];
+                for (size_t w = 0; w < words_; ++w) {
+                    uint64_t v = gen_[b * words_ + w] | (out[w] & ~kill_[b * words_ + w]);
+                    if (v != in[w]) {
+                        in[w] = v;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        interferes_.assign(static_cast<size_t>(n) * words_, 0);
+        live_.assign(liveIn_.begin(), liveIn_.begin() + words_);
+        for (int p = 0; p < fn.numParams; ++p) set(live_.data(), p);
+        for (int a = 0; a < n; ++a) {
+            if (!has(live_.data(), a)) continue;
+            for (int b = a + 1; b < n; ++b) {
+                if (has(live_.data(), b)) edge(a, b);
+            }
+        }
+        for (size_t b = 0; b < numBlocks; ++b) {
+            copy(liveOut_.begin() + b * words_, liveOut_.begin() + (b + 1) * words_, live_.begin());
+            for (int i = first_[b + 1]; i-- > first_[b];) {
+                int ip = ips_[i];
+                int v = code[ip + 1];
+                if (code[ip] == OP_STORE) {
+                    for (int u = 0; u < n; ++u) {
+                        if (has(live_.data(), u)) edge(v, u);
+                    }
+                    clear(live_.data(), v);
+                } else if (code[ip] == OP_LOAD) {
+                    set(live_.data(), v);
+                }
+            }
+        }
+
+        slot_.assign(n, -1);
+        int numSlots = fn.numParams;
+        for (int p = 0; p < fn.numParams; ++p) slot_[p] = p;
+        for (int v = fn.numParams; v < n; ++v) {
+            taken_.assign(numSlots + 1, 0);
+            for (int u = 0; u < n; ++u) {
+                if (slot_[u] >= 0 && has(&interferes_[v * words_], u)) taken_[slot_[u]] = 1;
+            }
+            int s = 0;
+            while (taken_[s]) ++s;
+            slot_[v] = s;
+            numSlots = max(numSlots, s + 1);
+        }
+        for (int ip : ips_) {
+            if (code[ip] == OP_LOAD || code[ip] == OP_STORE) fn.code[ip + 1] = slot_[code[ip + 1]];
+        }
+        fn.numLocals = numSlots;
+    }
+
+private:
+    static bool has(const uint64_t* b, int i) { return (b[i / 64] >> (i % 64)) & 1; }
+    static void set(uint64_t* b, int i) { b[i / 64] |= uint64_t(1) << (i % 64); }
+    static void clear(uint64_t* b, int i) { b[i / 64] &= ~(uint64_t(1) << (i % 64)); }
+
+    void edge(int a, int b) {
+        if (a == b) return;
+        set(&interferes_[a * words_], b);
+        set(&interferes_[b * words_], a);
+    }
+
+    // Blocks that may run after block b; returns how many there are.
+    int successors(const vector<int>& code, size_t b, int out[2]) const {
+        int ip = ips_[first_[b + 1] - 1];
+        int op = code[ip];
+        int next = ip + opLength(op);
+        int count = 0;
+        if (op == OP_JMP) {
+            out[count++] = blockOf_[code[ip + 1]];
+        } else if (op != OP_RET) {
+            if (int t = targetOperand(op)) out[count++] = blockOf_[code[ip + t]];
+            if (next < static_cast<int>(code.size())) out[count++] = blockOf_[next];
+        }
+        return count;
+    }
+
+    // Bit sets of locals are `words_` 64-bit words each, stored back to back.
+    size_t words_ = 0;
+    vector<int> ips_;
+    vector<char> leader_;
+    vector<int> blockOf_;
+    // Index into ips_ of each block's first instruction, then ips_.size().
+    vector<int> first_;
+    vector<uint64_t> gen_, kill_, liveIn_, liveOut_, interferes_, live_;
+    vector<int> slot_;
+    vector<char> taken_;
+};
+
+// A function found by Parser::preparse(): where it lies in the source, from
+// its 'int' to the closing brace.
+struct FunctionSpan {
+    string_view name;
+    size_t begin = 0;
+    size_t end = 0;
+    int line = 0;
+    int col = 0;
+    bool reached = false;
+};
+
+class Parser {
+public:
+    Parser(const string& source, const NativeRegistry& natives, const CompileOptions& options)
+        : source_(source), roots_(options.roots), natives_(natives), profile_(options.profile),
+          stats_(options.profileStats), frameSizes_(options.frameSizes) {}
+
+    // Parses every function, or with roots only those they reach. Either way
+    // functions keep their order in the source.
+    void parse() {
+        if (roots_.empty()) {
+            Lexer lexer(source_);
+            TokenStream tokens(lexer);
+            tokens_ = &tokens;
+            while (tok().type != TokType::End) {
+                parseFunction();
+            }
+            lexMs_ += tokens.lexMs();
+            return;
+        }
+        auto start = chrono::steady_clock::now();
+        preparse();
+        preparseMs_ = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        deque<int> work;
+        auto reach = [&](string_view name) {
+            auto it = spanIndex_.find(name);
+            if (it == spanIndex_.end() || spans_[it->second].reached) return;
+            spans_[it->second].reached = true;
+            work.push_back(it->second);
+        };
+        for (const auto& root : roots_) reach(root);
+        // Span indices of the parsed functions, in parse order.
+        vector<int> parsed;
+        for (size_t seen = 0; !work.empty();) {
+            parsed.push_back(work.front());
+            parseSpan(spans_[work.front()]);
+            work.pop_front();
+            for (; seen < pendingCalls_.size(); ++seen) reach(pendingCalls_[seen].name);
+        }
+
+        vector<int> order(functions_.size());
+        for (size_t f = 0; f < order.size(); ++f) order[f] = static_cast<int>(f);
+        sort(order.begin(), order.end(), [&](int a, int b) { return parsed[a] < parsed[b]; });
+        vector<int> renumber(order.size());
+        vector<Function> sorted;
+        sorted.reserve(order.size());
+        for (int f : order) {
+            renumber[f] = static_cast<int>(sorted.size());
+            funcIndex_[functions_[f].name] = renumber[f];
+            sorted.push_back(std::move(functions_[f]));
+        }
+        functions_.swap(sorted);
+        for (auto& call : pendingCalls_) call.funcIndex = renumber[call.funcIndex];
+    }
+
+    // Time spent in the lexer during parse(), and in preparse().
+    double lexMs() const { return lexMs_; }
+    double preparseMs() const { return preparseMs_; }
+
+    // Links calls to their targets and hands over the parsed functions.
+    Program link() {
+        resolveCalls();
+        if (profile_) inlineHotCalls();
+        SlotSharer sharer;
+        for (auto& fn : functions_) {
+            int before = fn.numLocals;
+            sharer.run(fn);
+            if (frameSizes_) frameSizes_->push_back({fn.name, before, fn.numLocals});
+        }
+        Program p;
+        p.functions = std::move(functions_);
+        p.strings = std::move(strings_);
+        p.natives = std::move(programNatives_);
+        return p;
+    }
+
+    // Bounds recursion in the parser so deeply nested input fails with a parse
+    // error instead of overflowing the native stack (1 MB on Windows).
+    static const int kMaxDepth = 256;
+
+private:
+    void error(const string& msg) { errorAt(tok(), msg); }
+
+    static void errorAt(const Token& t, const string& msg) {
+        ostringstream oss;
+        oss << "Parse error at " << t.line << ":" << t.col << ": " << msg;
+        throw runtime_error(oss.str());
+    }
+
+    const Token& tok() const { return tokens_->current(); }
+
+    const Token& peek() const { return tokens_->peek(); }
+
+    void advance() { tokens_->advance(); }
+
+    // Records where every function lies in the source. Bodies are only
+    // brace-matched, so errors inside them surface when, and if, they are
+    // parsed.
+    void preparse() {
+        Lexer lexer(source_);
+        Token t = lexer.next();
+        auto expectRaw = [&](TokType type, const string& what) {
+            if (t.type != type) errorAt(t, "Expected " + what);
+            t = lexer.next();
+        };
+        while (t.type != TokType::End) {
+            FunctionSpan span;
+            span.begin = lexer.pos() - t.text.size();
+            span.line = t.line;
+            span.col = t.col;
+            expectRaw(TokType::KwInt, "'int'");
+            if (t.type != TokType::Ident) errorAt(t, "Expected function name");
+            span.name = t.text;
+            t = lexer.next();
+            expectRaw(TokType::LParen, "'('");
+            if (t.type != TokType::RParen) {
+                while (true) {
+                    expectRaw(TokType::KwInt, "'int'");
+                    expectRaw(TokType::Ident, "parameter name");
+                    if (t.type != TokType::Comma) break;
+                    t = lexer.next();
+                }
+            }
+            expectRaw(TokType::RParen, "')'");
+            if (t.type != TokType::LBrace) errorAt(t, "Expected '{'");
+            if (!spanIndex_.emplace(span.name, static_cast<int>(spans_.size())).second) {
+                errorAt(t, "Function already defined: " + string(span.name));
+            }
+            bool closed = lexer.skipBlock();
+            span.end = lexer.pos();
+            t = lexer.next();
+            if (!closed) errorAt(t, "Expected '}'");
+            spans_.push_back(span);
+        }
+    }
+
+    void parseSpan(const FunctionSpan& span) {
+        Lexer lexer(source_, span.begin, span.end, span.line, span.col);
+        TokenStream tokens(lexer, std::move(tokenBuf_));
+        tokens_ = &tokens;
+        parseFunction();
+        lexMs_ += tokens.lexMs();
+        tokenBuf_ = tokens.release();
+        tokens_ = nullptr;
+    }
+
+    struct DepthGuard {
+        explicit DepthGuard(Parser& p) : parser(p) {
+            if (++parser.depth_ > kMaxDepth) {
+                parser.error("Nesting too deep (limit " + to_string(kMaxDepth) + ")");
+            }
+        }
+        ~DepthGuard() { parser.depth_--; }
+        Parser& parser;
+    };
+
+    bool match(TokType type) {
+        if (tok().type != type) return false;
+        advance();
+        return true;
+    }
+
+    void expect(TokType type, const string& what) {
+        if (tok().type != type) error("Expected " + what);
+        advance();
+    }
+
+    void parseFunction() {
+        int line = tok().line;
+        expect(TokType::KwInt, "'int'");
+        if (tok().type != TokType::Ident) error("Expected function name");
+        string name(tok().text);
+        advance();
+        expect(TokType::LParen, "'('");
+        vector<string> params;
+        if (tok().type != TokType::RParen) {
+            while (true) {
+                expect(TokType::KwInt, "'int'");
+                if (tok().type != TokType::Ident) error("Expected parameter name");
+                params.emplace_back(tok().text);
+                advance();
+                if (match(TokType::Comma)) continue;
+                break;
+            }
+        }
+        expect(TokType::RParen, "')'");
+
+        int funcIndex = addFunction(name);
+        currentFunc_ = funcIndex;
+        locals_.clear();
+        branchSites_.clear();
+        callSites_.clear();
+
+        Function& fn = functions_[funcIndex];
+        fn.line = line;
+        fn.numParams = static_cast<int>(params.size());
+        fn.numLocals = fn.numParams;
+
+        for (int i = 0; i < static_cast<int>(params.size()); ++i) {
+            locals_[params[i]] = i;
+        }
+
+        parseBlock();
+
+        // Ensure function ends with return
+        emit(OP_PUSH_INT, 0);
+        emit(OP_RET);
+
+        currentFunc_ = -1;
+    }
+
+    void parseBlock() {
+        expect(TokType::LBrace, "'{'");
+        while (tok().type != TokType::RBrace) {
+            parseStatement();
+        }
+        expect(TokType::RBrace, "'}'");
+    }
+
+    void parseStatement() {
+        DepthGuard guard(*this);
+        if (tok().type == TokType::KwInt) {
+            parseDeclaration();
+            return;
+        }
+        if (tok().type == TokType::KwReturn) {
+            advance();
+            parseExpression();
+            expect(TokType::Semicolon, "';'");
+            emit(OP_RET);
+            return;
+        }
+        if (tok().type == TokType::KwIf) {
+            parseIf();
+            return;
+        }
+        if (tok().type == TokType::KwWhile) {
+            parseWhile();
+            return;
+        }
+        if (tok().type == TokType::KwSwitch) {
+            parseSwitch();
+            return;
+        }
+        if (tok().type == TokType::LBrace) {
+            parseBlock();
+            return;
+        }
+
+        if (tok().type == TokType::Ident && peek().type == TokType::Assign) {
+            string name(tok().text);
+            advance();
+            advance();
+            parseExpression();
+            expect(TokType::Semicolon, "';'");
+            int idx = localIndex(name);
+            emit(OP_STORE, idx);
+            return;
+        }
+
+        parseExpression();
+        expect(TokType::Semicolon, "';'");
+        emit(OP_POP);
+    }
+
+    void parseDeclaration() {
+        expect(TokType::KwInt, "'int'");
+        if (tok().type != TokType::Ident) error("Expected variable name");
+        string name(tok().text);
+        advance();
+        int idx = addLocal(name);
+        if (match(TokType::Assign)) {
+            parseExpression();
+            emit(OP_STORE, idx);
+        }
+        expect(TokType::Semicolon, "';'");
+    }
+
+    void parseIf() {
+        int line = tok().line;
+        expect(TokType::KwIf, "'if'");
+        expect(TokType::LParen, "'('");
+        Cond cond = parseCondition(line);
+        expect(TokType::RParen, "')'");
+
+        int thenStart = currentCodeSize();
+        patchAll(cond.t, thenStart);
+        size_t thenCalls = pendingCalls_.size();
+        parseStatement();
+
+        if (match(TokType::KwElse)) {
+            // A mostly-taken then-arm goes last with the test turned around,
+            // so the hot path falls through to the join point instead of
+            // jumping over the else-arm.
+            const Profile::Branch* counts = cond.counts;
+            if (counts && counts->fallen > counts->taken && cond.simple()) {
+                CodeChunk thenArm = cut(thenStart, thenCalls);
+                invertBranch(cond.branch);
+                parseStatement();
+                int jmpEndPos = emit(OP_JMP, 0);
+                patchAll(cond.f, currentCodeSize());
+                place(thenArm);
+                patch(jmpEndPos, currentCodeSize());
+                if (stats_) stats_->branchesInverted++;
+                return;
+            }
+            int jmpEndPos = emit(OP_JMP, 0);
+            patchAll(cond.f, currentCodeSize());
+            parseStatement();
+            patch(jmpEndPos, currentCodeSize());
+        } else {
+            patchAll(cond.f, currentCodeSize());
+        }
+    }
+
+    void parseWhile() {
+        int line = tok().line;
+        expect(TokType::KwWhile, "'while'");
+        int loopStart = currentCodeSize();
+        size_t condCalls = pendingCalls_.size();
+        expect(TokType::LParen, "'('");
+        Cond cond = parseCondition(line);
+        expect(TokType::RParen, "')'");
+
+        // A loop that usually runs its body is rotated: entered by a jump to
+        // the test at the bottom, which branches back to the body while the
+        // condition holds, so an iteration costs no separate jump.
+        const Profile::Branch* counts = cond.counts;
+        if (counts && counts->fallen > counts->taken && cond.simple()) {
+            invertBranch(cond.branch);
+            CodeChunk test = cut(loopStart, condCalls);
+            int jmpTestPos = emit(OP_JMP, 0);
+            int bodyStart = currentCodeSize();
+            parseStatement();
+            patch(jmpTestPos, currentCodeSize());
+            place(test);
+            // The test ends in its jump, whose target is the last slot.
+            patch(currentCodeSize() - 1, bodyStart);
+            if (stats_) stats_->loopsRotated++;
+            return;
+        }
+        patchAll(cond.t, currentCodeSize());
+        parseStatement();
+        emit(OP_JMP, loopStart);
+        patchAll(cond.f, currentCodeSize());
+    }
+
+    // Cases never fall through: labels written back to back share a body, and
+    // every body but the last jumps past the switch. The bodies are parsed
+    // first and moved behind the table once all keys are known. Keys filling
+    // at least half their range get an OP_TABLESWITCH, others an
+    // OP_LOOKUPSWITCH.
+    void parseSwitch() {
+        int line = tok().line;
+        expect(TokType::KwSwitch, "'switch'");
+        expect(TokType::LParen, "'('");
+        parseExpression();
+        expect(TokType::RParen, "')'");
+        expect(TokType::LBrace, "'{'");
+
+        const int bodiesStart = currentCodeSize();
+        const size_t bodiesCalls = pendingCalls_.size();
+        map<int, int> cases; // key -> body start
+        int defaultStart = -1;
+        vector<int> exits;
+        for (bool first = true; tok().type != TokType::RBrace; first = false) {
+            if (tok().type != TokType::KwCase && tok().type != TokType::KwDefault) {
+                error("Expected 'case' or 'default'");
+            }
+            if (!first) exits.push_back(emit(OP_JMP, 0));
+            while (tok().type == TokType::KwCase || tok().type == TokType::KwDefault) {
+                if (match(TokType::KwDefault)) {
+                    if (defaultStart >= 0) error("Duplicate default");
+                    defaultStart = currentCodeSize();
+                } else {
+                    advance();
+                    bool negative = match(TokType::Minus);
+                    if (tok().type != TokType::Number) error("Expected an integer case value");
+                    int key = negative ? -tok().value : tok().value;
+                    if (!cases.emplace(key, currentCodeSize()).second) error("Duplicate case " + to_string(key));
+                    advance();
+                }
+                expect(TokType::Colon, "':'");
+            }
+            while (tok().type != TokType::KwCase && tok().type != TokType::KwDefault &&
+                   tok().type != TokType::RBrace) {
+                parseStatement();
+            }
+        }
+        expect(TokType::RBrace, "'}'");
+        const int bodiesEnd = currentCodeSize();
+        CodeChunk bodies = cut(bodiesStart, bodiesCalls);
+
+        Function& fn = functions_[currentFunc_];
+        auto put = [&](int v) {
+            fn.code.push_back(v);
+            fn.lines.push_back(line);
+        };
+        const int count = static_cast<int>(cases.size());
+        const long long lo = count ? cases.begin()->first : 0, hi = count ? cases.rbegin()->first : 0;
+        const bool dense = hi - lo + 1 <= 2LL * count;
+        const int entries = dense ? static_cast<int>(hi - lo + 1) : count;
+        // Where the bodies land once the table is in front of them.
+        const int start = currentCodeSize() + (count == 0 ? 1 : (dense ? 3 : 2) + 3 * entries + 2);
+        auto at = [&](int bodyPos) { return start + bodyPos - bodiesStart; };
+        if (count == 0) {
+            put(OP_POP);
+        } else {
+            const int fallback = at(defaultStart >= 0 ? defaultStart : bodiesEnd);
+            if (dense) {
+                put(OP_TABLESWITCH);
+                put(static_cast<int>(lo));
+                put(entries);
+                for (long long key = lo; key <= hi; ++key) {
+                    auto it = cases.find(static_cast<int>(key));
+                    put(OP_CASE);
+                    put(static_cast<int>(key));
+                    put(it != cases.end() ? at(it->second) : fallback);
+                }
+            } else {
+                put(OP_LOOKUPSWITCH);
+                put(count);
+                for (const auto& c : cases) {
+                    put(OP_CASE);
+                    put(c.first);
+                    put(at(c.second));
+                }
+            }
+            put(OP_JMP);
+            put(fallback);
+        }
+        place(bodies);
+        for (int e : exits) patch(at(e), at(bodiesEnd));
+    }
+
+    void parseExpression() {
+        Cond c = parseOr();
+        toValue(c);
+    }
+
+    // The condition of an if or while at `line`, which its jumps are
+    // attributed to.
+    Cond parseCondition(int line) {
+        int saved = branchLine_;
+        branchLine_ = line;
+        Cond c = parseOr();
+        toCond(c);
+        branchLine_ = saved;
+        return c;
+    }
+
+    // A true left side jumps straight to the true exit; a false one falls
+    // into the right side.
+    Cond parseOr() {
+        DepthGuard guard(*this);
+        Cond c = parseAnd();
+        while (match(TokType::OrOr)) {
+            toCond(c);
+            invertBranch(c.branch);
+            c.t.push_back(c.f.back());
+            c.f.pop_back();
+            patchAll(c.f, currentCodeSize());
+            Cond right = parseAnd();
+            toCond(right);
+            right.t.insert(right.t.end(), c.t.begin(), c.t.end());
+            c = std::move(right);
+        }
+        return c;
+    }
+
+    Cond parseAnd() {
+        Cond c = parseEquality();
+        while (match(TokType::AndAnd)) {
+            toCond(c);
+            patchAll(c.t, currentCodeSize());
+            Cond right = parseEquality();
+            toCond(right);
+            right.f.insert(right.f.begin(), c.f.begin(), c.f.end());
+            c = std::move(right);
+        }
+        return c;
+    }
+
+    Cond parseEquality() {
+        Cond c = parseRelational();
+        while (tok().type == TokType::Eq || tok().type == TokType::Ne) {
+            TokType op = tok().type;
+            toValue(c);
+            advance();
+            Cond right = parseRelational();
+            toValue(right);
+            emit(op == TokType::Eq ? OP_EQ : OP_NE);
+        }
+        return c;
+    }
+
+    Cond parseRelational() {
+        Cond c = parseAdditive();
+        while (tok().type == TokType::Lt || tok().type == TokType::Le ||
+               tok().type == TokType::Gt || tok().type == TokType::Ge) {
+            TokType op = tok().type;
+            toValue(c);
+            advance();
+            Cond right = parseAdditive();
+            toValue(right);
+            switch (op) {
+                case TokType::Lt: emit(OP_LT); break;
+                case TokType::Le: emit(OP_LE); break;
+                case TokType::Gt: emit(OP_GT); break;
+                case TokType::Ge: emit(OP_GE); break;
+                default: break;
+            }
+        }
+        return c;
+    }
+
+    Cond parseAdditive() {
+        Cond c = parseTerm();
+        while (tok().type == TokType::Plus || tok().type == TokType::Minus) {
+            TokType op = tok().type;
+            toValue(c);
+            advance();
+            Cond right = parseTerm();
+            toValue(right);
+            emit(op == TokType::Plus ? OP_ADD : OP_SUB);
+        }
+        return c;
+    }
+
+    Cond parseTerm() {
+        Cond c = parseUnary();
+        while (tok().type == TokType::Star || tok().type == TokType::Slash) {
+            TokType op = tok().type;
+            toValue(c);
+            advance();
+            Cond right = parseUnary();
+            toValue(right);
+            emit(op == TokType::Star ? OP_MUL : OP_DIV);
+        }
+        return c;
+    }
+
+    Cond parseUnary() {
+        DepthGuard guard(*this);
+        if (match(TokType::Bang)) {
+            Cond c = parseUnary();
+            toCond(c);
+            negate(c);
+            return c;
+        }
+        if (tok().type == TokType::Minus) {
+            advance();
+            Cond c = parseUnary();
+            toValue(c);
+            emit(OP_PUSH_INT, -1);
+            emit(OP_MUL);
+            return Cond();
+        }
+        return parsePrimary();
+    }
+
+    Cond parsePrimary() {
+        if (tok().type == TokType::Number) {
+            emit(OP_PUSH_INT, tok().value);
+            advance();
+            return Cond();
+        }
+        if (tok().type == TokType::Ident) {
+            string name(tok().text);
+            if (peek().type == TokType::LParen) {
+                parseCall();
+                return Cond();
+            }
+            advance();
+            int idx = localIndex(name);
+            emit(OP_LOAD, idx);
+            return Cond();
+        }
+        if (match(TokType::LParen)) {
+            Cond c = parseOr();
+            expect(TokType::RParen, "')'");
+            return c;
+        }
+        error("Expected expression");
+        return Cond();
+    }
+
+    // Ends a value with a jump taken when it is 0. A compare that ends the
+    // value fuses with the jump into one OP_CMP_BR.
+    void toCond(Cond& c) {
+        if (c.jumps()) return;
+        int line = branchLine_ >= 0 ? branchLine_ : tok().line;
+        c.counts = branchCounts(line);
+        Function& fn = functions_[currentFunc_];
+        if (lastOp_ >= 0 && lastOp_ == currentCodeSize() - 1 && isCompare(fn.code[lastOp_])) {
+            int cmp = fn.code[lastOp_];
+            fn.code.pop_back();
+            fn.lines.pop_back();
+            c.branch = emitSite(line, OP_CMP_BR, cmp) - 1;
+            fn.code.push_back(0);
+            fn.lines.push_back(line);
+            c.f.push_back(c.branch + 2);
+        } else {
+            c.f.push_back(emitSite(line, OP_JMP_IF_FALSE, 0));
+            c.branch = c.f.back() - 1;
+        }
+    }
+
+    // Leaves 1 or 0 on the stack for jumping code. A single test becomes the
+    // compare, or the comparison with 0, it stands for.
+    void toValue(Cond& c) {
+        if (!c.jumps()) return;
+        Function& fn = functions_[currentFunc_];
+        if (c.simple()) {
+            int op = fn.code[c.branch];
+            int cmp = op == OP_CMP_BR ? fn.code[c.branch + 1] : op == OP_JMP_IF_FALSE ? OP_NE : OP_EQ;
+            branchSites_[fn.lines[c.branch] - fn.line]--;
+            fn.code.resize(c.branch);
+            fn.lines.resize(c.branch);
+            if (op != OP_CMP_BR) emit(OP_PUSH_INT, 0);
+            emit(cmp);
+        } else {
+            patchAll(c.t, currentCodeSize());
+            emit(OP_PUSH_INT, 1);
+            int jmpEndPos = emit(OP_JMP, 0);
+            patchAll(c.f, currentCodeSize());
+            emit(OP_PUSH_INT, 0);
+            patch(jmpEndPos, currentCodeSize());
+        }
+        c = Cond();
+    }
+
+    // Makes jumping code jump where it fell through and fall through where it
+    // jumped, turning its last jump around.
+    void negate(Cond& c) {
+        invertBranch(c.branch);
+        int last = c.f.back();
+        c.f.pop_back();
+        swap(c.t, c.f);
+        c.f.push_back(last);
+    }
+
+    void parseCall() {
+        if (tok().type != TokType::Ident) error("Expected function name");
+        int line = tok().line;
+        string name(tok().text);
+        advance();
+        expect(TokType::LParen, "'('");
+        if (name == "print") {
+            if (tok().type == TokType::String) {
+                int idx = addString(string(tok().text));
+                advance();
+                expect(TokType::RParen, "')'");
+                emit(OP_PRINT_STR, idx);
+                emit(OP_PUSH_INT, 0);
+                return;
+            }
+            if (tok().type == TokType::RParen) error("print expects 1 argument");
+            parseExpression();
+            expect(TokType::RParen, "')'");
+            emit(OP_PRINT);
+            emit(OP_PUSH_INT, 0);
+            return;
+        }
+        if (name == "spawn") {
+            if (tok().type != TokType::Ident) error("spawn expects a function name");
+            string callee(tok().text);
+            advance();
+            int argCount = 0;
+            while (match(TokType::Comma)) {
+                if (tok().type == TokType::String) {
+                    error("String literals are only allowed in print(...)");
+                }
+                parseExpression();
+                argCount++;
+            }
+            expect(TokType::RParen, "')'");
+            int spawnPos = emitCall(line, OP_SPAWN, argCount);
+            pendingCalls_.push_back({currentFunc_, spawnPos, callee, argCount});
+            return;
+        }
+        if (name == "join") {
+            if (tok().type == TokType::RParen) error("join expects 1 argument");
+            parseExpression();
+            expect(TokType::RParen, "')'");
+            emit(OP_JOIN);
+            return;
+        }
+        if (name == "read" || name == "eof") {
+            if (tok().type != TokType::RParen) error(name + " expects no arguments");
+            advance();
+            emit(OP_READ, name == "read" ? kReadInt : kReadEof);
+            return;
+        }
+
+        int argCount = 0;
+        if (tok().type != TokType::RParen) {
+            while (true) {
+                if (tok().type == TokType::String) {
+                    error("String literals are only allowed in print(...)");
+                }
+                parseExpression();
+                argCount++;
+                if (match(TokType::Comma)) continue;
+                break;
+            }
+        }
+        expect(TokType::RParen, "')'");
+
+        // Sites are numbered as they are emitted, after the calls in their
+        // arguments, which matches the order VMContext::profile() sees.
+        auto [rel, n] = nextSite(callSites_, line);
+        const Profile::Call* counts = profile_ ? profile_->call(functions_[currentFunc_].name, rel, n) : nullptr;
+        int callPos = emitCall(line, OP_CALL, argCount);
+        pendingCalls_.push_back({currentFunc_, callPos, name, argCount, counts && counts->count >= kHotCallCount});
+    }
+
+    int addFunction(const string& name) {
+        auto it = funcIndex_.find(name);
+        if (it != funcIndex_.end()) {
+            // Duplicate definition
+            error("Function already defined: " + name);
+        }
+        int idx = static_cast<int>(functions_.size());
+        funcIndex_[name] = idx;
+        functions_.push_back(Function());
+        functions_[idx].name = name;
+        return idx;
+    }
+
+    int addLocal(const string& name) {
+        if (locals_.count(name)) error("Variable already defined: " + name);
+        Function& fn = functions_[currentFunc_];
+        int idx = fn.numLocals;
+        fn.numLocals++;
+        locals_[name] = idx;
+        return idx;
+    }
+
+    int addString(const string& s) {
+        auto it = stringIndex_.find(s);
+        if (it != stringIndex_.end()) return it->second;
+        int idx = static_cast<int>(strings_.size());
+        strings_.push_back(s);
+        stringIndex_[s] = idx;
+        return idx;
+    }
+
+    int localIndex(const string& name) {
+        auto it = locals_.find(name);
+        if (it == locals_.end()) error("Unknown variable: " + name);
+        return it->second;
+    }
+
+    int emit(int op) {
+        Function& fn = functions_[currentFunc_];
+        lastOp_ = static_cast<int>(fn.code.size());
+        fn.code.push_back(op);
+        fn.lines.push_back(tok().line);
+        return lastOp_;
+    }
+
+    int emit(int op, int operand) {
+        emit(op);
+        Function& fn = functions_[currentFunc_];
+        fn.code.push_back(operand);
+        fn.lines.push_back(tok().line);
+        return lastOp_ + 1;
+    }
+
+    // Emits a branch or call attributed to `line`, the line its statement or
+    // callee name is on, rather than wherever the parser has got to.
+    int emitSite(int line, int op, int operand) {
+        int pos = emit(op, operand);
+        vector<int>& lines = functions_[currentFunc_].lines;
+        lines[pos - 1] = lines[pos] = line;
+        return pos;
+    }
+
+    // Emits a CALL or SPAWN and returns the position of its callee operand.
+    int emitCall(int line, int op, int argCount) {
+        int pos = emitSite(line, op, 0);
+        Function& fn = functions_[currentFunc_];
+        fn.code.push_back(argCount);
+        fn.lines.push_back(line);
+        return pos;
+    }
+
+    // Profile key of the next site of one kind on `line`: the line relative
+    // to the function header and the number of such sites already on it.
+    pair<int, int> nextSite(unordered_map<int, int>& sites, int line) {
+        int rel = line - functions_[currentFunc_].line;
+        return {rel, sites[rel]++};
+    }
+
+    const Profile::Branch* branchCounts(int line) {
+        auto [rel, n] = nextSite(branchSites_, line);
+        return profile_ ? profile_->branch(functions_[currentFunc_].name, rel, n) : nullptr;
+    }
+
+    // Makes the branch at pos jump when it fell through and vice versa.
+    void invertBranch(int pos) {
+        vector<int>& code = functions_[currentFunc_].code;
+        if (code[pos] == OP_CMP_BR) code[pos + 1] = negatedCompare(code[pos + 1]);
+        else code[pos] = code[pos] == OP_JMP_IF_FALSE ? OP_JMP_IF_TRUE : OP_JMP_IF_FALSE;
+    }
+
+    // Removes the code from `start` on, along with the calls recorded since
+    // pendingCalls_ had `firstCall` entries. The code must be self-contained:
+    // its jumps stay inside it, and nothing outside jumps into it.
+    CodeChunk cut(int start, size_t firstCall) {
+        Function& fn = functions_[currentFunc_];
+        CodeChunk chunk;
+        chunk.code.assign(fn.code.begin() + start, fn.code.end());
+        chunk.lines.assign(fn.lines.begin() + start, fn.lines.end());
+        fn.code.resize(start);
+        fn.lines.resize(start);
+        chunk.calls.assign(pendingCalls_.begin() + firstCall, pendingCalls_.end());
+        pendingCalls_.resize(firstCall);
+        relocate(chunk.code, -start);
+        for (auto& call : chunk.calls) call.codePos -= start;
+        return chunk;
+    }
+
+    // Appends a chunk from cut() at the current position.
+    void place(CodeChunk& chunk) {
+        Function& fn = functions_[currentFunc_];
+        int start = currentCodeSize();
+        relocate(chunk.code, start);
+        fn.code.insert(fn.code.end(), chunk.code.begin(), chunk.code.end());
+        fn.lines.insert(fn.lines.end(), chunk.lines.begin(), chunk.lines.end());
+        for (auto& call : chunk.calls) {
+            call.codePos += start;
+            pendingCalls_.push_back(std::move(call));
+        }
+        lastOp_ = -1;
+    }
+
+    static void relocate(vector<int>& code, int delta) {
+        for (size_t ip = 0; ip < code.size(); ip += opLength(code[ip])) {
+            if (int t = targetOperand(code[ip])) code[ip + t] += delta;
+        }
+    }
+
+    void patch(int pos, int target) {
+        Function& fn = functions_[currentFunc_];
+        fn.code[pos] = target;
+    }
+
+    void patchAll(const vector<int>& positions, int target) {
+        for (int pos : positions) patch(pos, target);
+    }
+
+    int currentCodeSize() {
+        return static_cast<int>(functions_[currentFunc_].code.size());
+    }
+
+    // A call to an undefined function that names a native becomes
+    // OP_CALL_NATIVE, indexing the program's own native table.
+    void resolveCalls() {
+        unordered_map<string, int> nativeIndex;
+        for (const auto& call : pendingCalls_) {
+            auto it = funcIndex_.find(call.name);
+            if (it == funcIndex_.end()) {
+                const NativeFunction* native = natives_.find(call.name);
+                if (!native) throw runtime_error("Unknown function: " + call.name);
+                vector<int>& code = functions_[call.funcIndex].code;
+                if (code[call.codePos - 1] == OP_SPAWN) {
+                    throw runtime_error("Cannot spawn native function: " + call.name);
+                }
+                if (native->numParams != call.argCount) {
+                    throw runtime_error("Function " + call.name + " expects " + to_string(native->numParams) +
+                                        " args, got " + to_string(call.argCount));
+                }
+                auto [slot, added] = nativeIndex.try_emplace(call.name, static_cast<int>(programNatives_.size()));
+                if (added) programNatives_.push_back(*native);
+                code[call.codePos - 1] = OP_CALL_NATIVE;
+                code[call.codePos] = slot->second;
+                continue;
+            }
+            int idx = it->second;
+            if (functions_[idx].numParams != call.argCount) {
+                throw runtime_error("Function " + call.name + " expects " +
+                                    to_string(functions_[idx].numParams) + " args, got " +
+                                    to_string(call.argCount));
+            }
+            functions_[call.funcIndex].code[call.codePos] = idx;
+        }
+    }
+
+    // A leaf of at most kMaxInlineSize slots whose every return leaves just
+    // the result on the stack, as compiled functions always do.
+    bool inlinable(const Function& fn) {
+        if (fn.code.size() > kMaxInlineSize) return false;
+        for (size_t ip = 0; ip < fn.code.size(); ip += opLength(fn.code[ip])) {
+            if (fn.code[ip] == OP_CALL || fn.code[ip] == OP_SPAWN) return false;
+        }
+        int maxDepth = 0;
+        vector<int> depth = stackDepths(fn, maxDepth);
+        for (size_t ip = 0; ip < fn.code.size(); ip += opLength(fn.code[ip])) {
+            if (fn.code[ip] == OP_RET && depth[ip] >= 0 && depth[ip] != 1) return false;
+        }
+        return true;
+    }
+
+    // Replaces hot calls to inlinable functions with a copy of the callee:
+    // the arguments are stored into a block of locals past the caller's own,
+    // which the callee's LOADs and STOREs are shifted onto, its other locals
+    // are cleared as a new frame's would be, and its returns jump past the
+    // copy with the result on the stack. A caller's sites share one block,
+    // as they never run at the same time.
+    void inlineHotCalls() {
+        vector<vector<int>> sites(functions_.size());
+        for (const auto& call : pendingCalls_) {
+            const vector<int>& code = functions_[call.funcIndex].code;
+            if (!call.hot || code[call.codePos - 1] != OP_CALL) continue;
+            int callee = code[call.codePos];
+            if (callee != call.funcIndex && inlinable(functions_[callee])) {
+                sites[call.funcIndex].push_back(call.codePos - 1);
+            }
+        }
+        for (size_t f = 0; f < functions_.size(); ++f) {
+            if (sites[f].empty()) continue;
+            sort(sites[f].begin(), sites[f].end());
+            inlineCalls(functions_[f], sites[f]);
+        }
+    }
+
+    void inlineCalls(Function& fn, const vector<int>& sites) {
+        const int base = fn.numLocals;
+        int extraLocals = 0;
+        vector<int> code, lines, jumps;
+        vector<int> newPos(fn.code.size() + 1, 0);
+        size_t nextSite = 0;
+        for (int ip = 0; ip < static_cast<int>(fn.code.size()); ip += opLength(fn.code[ip])) {
+            newPos[ip] = static_cast<int>(code.size());
+            int op = fn.code[ip];
+            int line = fn.lines[ip];
+            auto put = [&](int v) {
+                code.push_back(v);
+                lines.push_back(line);
+            };
+            if (nextSite == sites.size() || sites[nextSite] != ip) {
+                for (int k = 0; k < opLength(op); ++k) put(fn.code[ip + k]);
+                if (targetOperand(op)) jumps.push_back(static_cast<int>(code.size()) - 1);
+                continue;
+            }
+            nextSite++;
+            const Function& callee = functions_[fn.code[ip + 1]];
+            for (int i = callee.numParams - 1; i >= 0; --i) {
+                put(OP_STORE);
+                put(base + i);
+            }
+            for (int i = callee.numParams; i < callee.numLocals; ++i) {
+                put(OP_PUSH_INT);
+                put(0);
+                put(OP_STORE);
+                put(base + i);
+            }
+            const int size = static_cast<int>(callee.code.size());
+            vector<int> calleePos(size + 1, 0);
+            vector<int> innerJumps, exits;
+            for (int cip = 0; cip < size; cip += opLength(callee.code[cip])) {
+                calleePos[cip] = static_cast<int>(code.size());
+                int cop = callee.code[cip];
+                if (cop == OP_RET) {
+                    // The last instruction falls through instead.
+                    if (cip + 1 == size) continue;
+                    put(OP_JMP);
+                    put(0);
+                    exits.push_back(static_cast<int>(code.size()) - 1);
+                    continue;
+                }
+                for (int k = 0; k < opLength(cop); ++k) put(callee.code[cip + k]);
+                if (cop == OP_LOAD || cop == OP_STORE) code.back() += base;
+                if (targetOperand(cop)) innerJumps.push_back(static_cast<int>(code.size()) - 1);
+            }
+            calleePos[size] = static_cast<int>(code.size());
+            for (int j : innerJumps) code[j] = calleePos[code[j]];
+            for (int e : exits) code[e] = static_cast<int>(code.size());
+            extraLocals = max(extraLocals, callee.numLocals);
+            if (stats_) stats_->callsInlined++;
+        }
+        newPos[fn.code.size()] = static_cast<int>(code.size());
+        for (int j : jumps) code[j] = newPos[code[j]];
+        fn.code.swap(code);
+        fn.lines.swap(lines);
+        fn.numLocals += extraLocals;
+    }
+
+    const string& source_;
+    const vector<string>& roots_;
+    // The stream of the function being parsed.
+    TokenStream* tokens_ = nullptr;
+    vector<Token> tokenBuf_;
+    double lexMs_ = 0;
+    double preparseMs_ = 0;
+    vector<FunctionSpan> spans_;
+    unordered_map<string_view, int> spanIndex_;
+    const NativeRegistry& natives_;
+    const Profile* profile_;
+    ProfileStats* stats_;
+    vector<FrameSize>* frameSizes_;
+    vector<NativeFunction> programNatives_;
+    int depth_ = 0;
+    vector<Function> functions_;
+    unordered_map<string, int> funcIndex_;
+    unordered_map<string, int> locals_;
+    unordered_map<string, int> stringIndex_;
+    vector<PendingCall> pendingCalls_;
+    vector<string> strings_;
+    int currentFunc_ = -1;
+    // Position of the last opcode emitted, -1 after place().
+    int lastOp_ = -1;
+    // Line the jumps of the condition being parsed are attributed to, or -1
+    // outside if and while conditions.
+    int branchLine_ = -1;
+    // Branch and call sites emitted so far per relative line of the function.
+    unordered_map<int, int> branchSites_;
+    unordered_map<int, int> callSites_;
+};
+
+using Scheduler = svm::Scheduler<Program>;
+
+// Interpreter variants used by the library. A Program handed to a VMContext
+// may have been built by hand, so every variant is checked.
+using PlainPolicy = Policy<true>;
+using ProfiledPolicy = Policy<true, false, false, true>;
+using TracedPolicy = Policy<true, false, false, false, true>;
+template <bool Metered>
+using CountedPolicy = Policy<true, Metered, false, false, false, SchedulerSink, true>;
+template <bool Profile>
+using TalliedPolicy = Policy<true, false, false, Profile, false, SchedulerSink, false, true>;
+using FoldPolicy = Policy<true, true>;
+
+// Replaces calls with constant arguments to pure functions by their results,
+// which it computes by running the calls (see CompileOptions::foldBudget and
+// foldTotalBudget). A function is pure if it prints nothing, reads no input,
+// spawns and joins no tasks and calls only pure functions and builtins; host
+// natives may have side effects.
+class CallFolder {
+public:
+    CallFolder(Program& program, uint64_t budget, uint64_t totalBudget, vector<FoldedCall>* report)
+        : program_(program), budget_(budget), totalBudget_(totalBudget), report_(report) {}
+
+    void run() {
+        findPure();
+        vector<vector<Site>> sites(program_.functions.size());
+        bool any = false;
+        for (size_t f = 0; f < sites.size(); ++f) {
+            findSites(program_.functions[f], sites[f]);
+            any = any || !sites[f].empty();
+        }
+        if (!any) return;
+        // Decodes nothing: the image only defers laying out and verifying
+        // each function until a call runs it.
+        size_t codeSize = 0;
+        for (const auto& fn : program_.functions) codeSize += fn.code.size();
+        Image<Program> image(program_, codeSize, [](int) {});
+        Scheduler sched(image, 1, execute<PlainPolicy, Program>);
+        for (size_t f = 0; f < sites.size(); ++f) {
+            Function& fn = program_.functions[f];
+            vector<Site> folded;
+            for (auto& site : sites[f]) {
+                if (!evaluate(image, sched, fn, site)) continue;
+                folded.push_back(site);
+                if (report_) {
+                    FoldedCall call{fn.name, fn.lines.empty() ? 0 : fn.lines[site.call], calleeName(fn, site), {},
+                                    site.result, site.instructions};
+                    for (int ip = site.begin; ip < site.call; ip += 2) call.args.push_back(fn.code[ip + 1]);
+                    report_->push_back(std::move(call));
+                }
+            }
+            // The image reads the code, so it is rewritten only once all
+            // calls have run.
+            sites[f].swap(folded);
+        }
+        for (size_t f = 0; f < sites.size(); ++f) {
+            if (!sites[f].empty()) rewrite(program_.functions[f], sites[f]);
+        }
+    }
+
+    // Bounds the frames an evaluated call may stack up, which would
+    // otherwise only be limited by the budget.
+    static const size_t kMaxDepth = 100000;
+
+private:
+    // A CALL or CALL_NATIVE at `call` whose arguments are the PUSH_INTs
+    // from `begin`.
+    struct Site {
+        int begin = 0;
+        int call = 0;
+        int result = 0;
+        uint64_t instructions = 0;
+    };
+
+    static bool isBuiltin(const NativeFunction& native) {
+        for (const auto& b : builtinNatives()) {
+            if (b.fn == native.fn) return true;
+        }
+        return false;
+    }
+
+    // Starts from every function being pure and clears those that do, or
+    // call, something impure until nothing changes, so recursion stays pure.
+    void findPure() {
+        const auto& functions = program_.functions;
+        pure_.assign(functions.size(), true);
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t f = 0; f < functions.size(); ++f) {
+                if (!pure_[f]) continue;
+                const vector<int>& code = functions[f].code;
+                for (size_t ip = 0; ip < code.size() && pure_[f]; ip += opLength(code[ip])) {
+                    int op = code[ip];
+                    bool impure = op == OP_PRINT || op == OP_PRINT_STR || op == OP_READ || op == OP_SPAWN ||
+                                  op == OP_JOIN ||
+                                  (op == OP_CALL && !pure_[code[ip + 1]]) ||
+                                  (op == OP_CALL_NATIVE && !isBuiltin(program_.natives[code[ip + 1]]));
+                    if (impure) {
+                        pure_[f] = false;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    void findSites(const Function& fn, vector<Site>& sites) {
+        const vector<int>& code = fn.code;
+        vector<char> target(code.size() + 1, 0);
+        for (size_t ip = 0; ip < code.size(); ip += opLength(code[ip])) {
+            if (int t = targetOperand(code[ip])) target[code[ip + t]] = 1;
+        }
+        // PUSH_INTs running up to ip that no jump lands among.
+        vector<int> pushes;
+        for (size_t ip = 0; ip < code.size(); ip += opLength(code[ip])) {
+            if (target[ip]) pushes.clear();
+            int op = code[ip];
+            if (op == OP_PUSH_INT) {
+                pushes.push_back(static_cast<int>(ip));
+                continue;
+            }
+            int argc = -1;
+            if (op == OP_CALL && pure_[code[ip + 1]]) argc = program_.functions[code[ip + 1]].numParams;
+            if (op == OP_CALL_NATIVE && isBuiltin(program_.natives[code[ip + 1]])) argc = code[ip + 2];
+            if (argc >= 0 && static_cast<int>(pushes.size()) >= argc) {
+                sites.push_back({pushes.empty() || argc == 0 ? static_cast<int>(ip) : pushes[pushes.size() - argc],
+                                 static_cast<int>(ip)});
+            }
+            pushes.clear();
+        }
+    }
+
+    string calleeName(const Function& fn, const Site& site) const {
+        int target = fn.code[site.call + 1];
+        return fn.code[site.call] == OP_CALL ? program_.functions[target].name : program_.natives[target].name;
+    }
+
+    // Runs the call at site, reusing the results of earlier calls with the
+    // same arguments. False if it fails or runs out of budget.
+    bool evaluate(const Image<Program>& image, Scheduler& sched, const Function& fn, Site& site) {
+        vector<int> key{fn.code[site.call], fn.code[site.call + 1]};
+        for (int ip = site.begin; ip < site.call; ip += 2) key.push_back(fn.code[ip + 1]);
+        auto cached = results_.find(key);
+        if (cached == results_.end()) cached = results_.emplace(key, call(image, sched, key)).first;
+        if (!cached->second.ok) return false;
+        site.result = cached->second.value;
+        site.instructions = cached->second.instructions;
+        return true;
+    }
+
+    struct Result {
+        bool ok = false;
+        int value = 0;
+        uint64_t instructions = 0;
+    };
+
+    // key is [opcode, callee, args...]. Runs on what is left of the total
+    // budget when that is less than the per-call one, and charges every
+    // instruction run to the total, whether or not the call succeeds.
+    Result call(const Image<Program>& image, Scheduler& sched, const vector<int>& key) {
+        const vector<int> args(key.begin() + 2, key.end());
+        const uint64_t budget = min(budget_, totalBudget_ - spent_);
+        Result r;
+        if (budget == 0) return r;
+        try {
+            if (key[0] == OP_CALL_NATIVE) {
+                r.value = program_.natives[key[1]].fn(args.data());
+                r.ok = true;
+                return r;
+            }
+            Worker& worker = sched.mainWorker();
+            worker.stack.clear();
+            worker.callStack.clear();
+            worker.shadow.depth.store(0, memory_order_relaxed);
+            Registers regs = enter(image, key[1], args, worker);
+            // Runs in slices so a deep recursion is caught before it has
+            // used up the whole budget.
+            const uint64_t kSlice = 65536;
+            while (r.instructions < budget && worker.callStack.size() <= kMaxDepth) {
+                uint64_t given = min(kSlice, budget - r.instructions);
+                uint64_t fuel = given;
+                r.ok = interpret<FoldPolicy>(image, regs, worker, sched, fuel, r.value, nullptr);
+                r.instructions += given - fuel;
+                if (r.ok) break;
+            }
+        } catch (const runtime_error&) {
+            r.ok = false;
+        }
+        spent_ += r.instructions;
+        return r;
+    }
+
+    // Puts a PUSH_INT of each site's result in place of its arguments and
+    // call, moving jump targets along.
+    static void rewrite(Function& fn, const vector<Site>& sites) {
+        vector<int> code, lines, jumps;
+        vector<int> newPos(fn.code.size() + 1, 0);
+        const bool hasLines = fn.lines.size() == fn.code.size();
+        size_t next = 0;
+        for (int ip = 0; ip < static_cast<int>(fn.code.size());) {
+            newPos[ip] = static_cast<int>(code.size());
+            int op = fn.code[ip];
+            if (next < sites.size() && sites[next].begin == ip) {
+                const Site& site = sites[next++];
+                code.push_back(OP_PUSH_INT);
+                code.push_back(site.result);
+                if (hasLines) lines.insert(lines.end(), 2, fn.lines[site.call]);
+                ip = site.call + opLength(fn.code[site.call]);
+                continue;
+            }
+            for (int k = 0; k < opLength(op); ++k) {
+                code.push_back(fn.code[ip + k]);
+                if (hasLines) lines.push_back(fn.lines[ip + k]);
+            }
+            if (targetOperand(op)) jumps.push_back(static_cast<int>(code.size()) - 1);
+            ip += opLength(op);
+        }
+        newPos[fn.code.size()] = static_cast<int>(code.size());
+        for (int j : jumps) code[j] = newPos[code[j]];
+        fn.code.swap(code);
+        if (hasLines) fn.lines.swap(lines);
+    }
+
+    Program& program_;
+    const uint64_t budget_;
+    const uint64_t totalBudget_;
+    uint64_t spent_ = 0;
+    vector<FoldedCall>* report_;
+    vector<char> pure_;
+    map<vector<int>, Result> results_;
+};
+
+} // namespace
+
+int Program::findFunction(const string& name) const {
+    for (size_t i = 0; i < functions.size(); ++i) {
+        if (functions[i].name == name) return static_cast<int>(i);
+    }
+    return -1;
+}
+
+NativeRegistry::NativeRegistry() {
+    for (const auto& b : builtinNatives()) functions_.push_back({b.name, b.numParams, b.fn});
+}
+
+void NativeRegistry::add(const string& name, int numParams, NativeFn fn) {
+    if (name == "print" || name == "spawn" || name == "join" || name == "read" || name == "eof") {
+        throw runtime_error("Reserved name: " + name);
+    }
+    if (find(name)) throw runtime_error("Native function already registered: " + name);
+    if (numParams < 0 || !fn) throw runtime_error("Invalid native function: " + name);
+    functions_.push_back({name, numParams, fn});
+}
+
+const NativeFunction* NativeRegistry::find(const string& name) const {
+    for (const auto& f : functions_) {
+        if (f.name == name) return &f;
+    }
+    return nullptr;
+}
+
+namespace {
+
+using SiteKey = tuple<string, int, int>;
+
+void parseProfileLine(const string& line, int lineNo, Profile& profile) {
+    istringstream in(line);
+    string kind, function, callee;
+    int siteLine = 0, n = 0;
+    uint64_t a = 0, b = 0;
+    bool ok = false;
+    if (in >> kind >> function >> siteLine >> n) {
+        if (kind == "branch" && in >> a >> b) {
+            profile.addBranch(function, siteLine, n, a, b);
+            ok = true;
+        } else if (kind == "call" && in >> callee >> a) {
+            profile.addCall(function, siteLine, n, callee, a);
+            ok = true;
+        }
+    }
+    string rest;
+    if (!ok || in >> rest) throw runtime_error("Malformed profile line " + to_string(lineNo));
+}
+
+} // namespace
+
+void Profile::addBranch(const string& function, int line, int n, uint64_t taken, uint64_t fallen) {
+    Branch& b = branches_[SiteKey(function, line, n)];
+    b.taken += taken;
+    b.fallen += fallen;
+}
+
+void Profile::addCall(const string& function, int line, int n, const string& callee, uint64_t count) {
+    Call& c = calls_[SiteKey(function, line, n)];
+    c.callee = callee;
+    c.count += count;
+}
+
+const Profile::Branch* Profile::branch(const string& function, int line, int n) const {
+    auto it = branches_.find(SiteKey(function, line, n));
+    return it == branches_.end() ? nullptr : &it->second;
+}
+
+const Profile::Call* Profile::call(const string& function, int line, int n) const {
+    auto it = calls_.find(SiteKey(function, line, n));
+    return it == calls_.end() ? nullptr : &it->second;
+}
+
+size_t Profile::numBranches() const {
+    return branches_.size();
+}
+
+size_t Profile::numCalls() const {
+    return calls_.size();
+}
+
+void Profile::write(ostream& out) const {
+    out << "# scc profile: branch <function> <line> <n> <taken> <fallen-through>\n";
+    out << "#              call <function> <line> <n> <callee> <count>\n";
+    for (const auto& [key, b] : branches_) {
+        out << "branch " << get<0>(key) << " " << get<1>(key) << " " << get<2>(key) << " " << b.taken << " "
+            << b.fallen << "\n";
+    }
+    for (const auto& [key, c] : calls_) {
+        out << "call " << get<0>(key) << " " << get<1>(key) << " " << get<2>(key) << " " << c.callee << " "
+            << c.count << "\n";
+    }
+}
+
+Profile Profile::read(istream& in) {
+    Profile profile;
+    string line;
+    for (int lineNo = 1; getline(in, line); ++lineNo) {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos || line[first] == '#') continue;
+        parseProfileLine(line, lineNo, profile);
+    }
+    return profile;
+}
+
+shared_ptr<const Program> compile(const string& source, const PhaseFn& onPhase) {
+    CompileOptions options;
+    options.onPhase = onPhase;
+    return compile(source, options);
+}
+
+shared_ptr<const Program> compile(const string& source, const NativeRegistry& natives, const PhaseFn& onPhase) {
+    CompileOptions options;
+    options.natives = &natives;
+    options.onPhase = onPhase;
+    return compile(source, options);
+}
+
+shared_ptr<const Program> compile(const string& source, const CompileOptions& options) {
+    using Clock = chrono::steady_clock;
+    auto ms = [](Clock::time_point from) { return chrono::duration<double, milli>(Clock::now() - from).count(); };
+    static const NativeRegistry builtins;
+    const PhaseFn& onPhase = options.onPhase;
+
+    auto start = Clock::now();
+    Parser parser(source, options.natives ? *options.natives : builtins, options);
+    parser.parse();
+    double parseMs = ms(start);
+    if (onPhase) {
+        if (!options.roots.empty()) onPhase("preparse", parser.preparseMs());
+        onPhase("lex", parser.lexMs());
+        onPhase("parse", parseMs - parser.preparseMs() - parser.lexMs());
+    }
+    start = Clock::now();
+    Program program = parser.link();
+    if (onPhase) onPhase("resolve", ms(start));
+    if (options.foldBudget > 0) {
+        start = Clock::now();
+        CallFolder(program, options.foldBudget, options.foldTotalBudget, options.foldedCalls).run();
+        if (onPhase) onPhase("fold", ms(start));
+    }
+    return make_shared<const Program>(std::move(program));
+}
+
+struct VMContext::Impl {
+    Impl(shared_ptr<const Program> p, int numThreads)
+        : program(std::move(p)), image(*program), sched(image, numThreads, execute<PlainPolicy, Program>) {}
+
+    // Validates the call and sets up the main worker's registers for it.
+    void start(int funcIndex, const vector<int>& args) {
+        if (funcIndex < 0 || funcIndex >= static_cast<int>(program->functions.size())) {
+            throw runtime_error("Invalid function index");
+        }
+        const Function& fn = program->functions[funcIndex];
+        if (static_cast<int>(args.size()) != fn.numParams) {
+            throw runtime_error("Function " + fn.name + " expects " + to_string(fn.numParams) + " args, got " +
+                                to_string(args.size()));
+        }
+        Worker& worker = sched.mainWorker();
+        worker.stack.clear();
+        worker.callStack.clear();
+        regs = enter(image, funcIndex, args, worker);
+        active = true;
+        result = 0;
+        instructions = 0;
+    }
+
+    // Runs the current call on the main worker with whichever interpreter
+    // variant the context is configured for.
+    template <bool Metered>
+    bool run(uint64_t& fuel) {
+        if (tracing) return run<Metered, false, true>(fuel);
+        if (counting) {
+            return interpret<CountedPolicy<Metered>>(image, regs, sched.mainWorker(), sched, fuel, result, nullptr);
+        }
+        if (tallying) return sampling ? run<Metered, true, false, true>(fuel) : run<Metered, false, false, true>(fuel);
+        if (sampling) return run<Metered, true, false>(fuel);
+        return run<Metered, false, false>(fuel);
+    }
+
+    template <bool Metered, bool Profile, bool Trace, bool Tally = false>
+    bool run(uint64_t& fuel) {
+        Worker& worker = sched.mainWorker();
+        if constexpr (!Metered && !Trace) {
+            if (cacheTop && !quick) {
+                using P = Policy<true, false, false, Profile, false, SchedulerSink, false, Tally>;
+                result = interpretCached<P>(image, regs, worker, sched);
+                return true;
+            }
+        }
+        if (quick) {
+            using P = Policy<true, Metered, true, Profile, Trace, SchedulerSink, false, Tally>;
+            return interpret<P>(image, regs, worker, sched, fuel, result, quick.get());
+        }
+        using P = Policy<true, Metered, false, Profile, Trace, SchedulerSink, false, Tally>;
+        return interpret<P>(image, regs, worker, sched, fuel, result, nullptr);
+    }
+
+    // Picks the interpreter spawned tasks run; they never quicken.
+    void updateRunner() {
+        if (tracing) {
+            sched.setRunner(execute<TracedPolicy, Program>);
+        } else if (counting) {
+            sched.setRunner(execute<CountedPolicy<false>, Program>);
+        } else if (tallying && cacheTop) {
+            sched.setRunner(sampling ? executeCached<TalliedPolicy<true>, Program>
+                                     : executeCached<TalliedPolicy<false>, Program>);
+        } else if (tallying) {
+            sched.setRunner(sampling ? execute<TalliedPolicy<true>, Program> : execute<TalliedPolicy<false>, Program>);
+        } else if (cacheTop) {
+            sched.setRunner(sampling ? executeCached<ProfiledPolicy, Program> : executeCached<PlainPolicy, Program>);
+        } else {
+            sched.setRunner(sampling ? execute<ProfiledPolicy, Program> : execute<PlainPolicy, Program>);
+        }
+    }
+
+    // Ends the current call: drains leftover tasks so the next call starts clean.
+    void stop() {
+        active = false;
+        sched.mainWorker().shadow.depth.store(0, memory_order_release);
+        sched.finish(sched.mainWorker());
+    }
+
+    shared_ptr<const Program> program;
+    Image<Program> image;
+    Scheduler sched;
+    Registers regs;
+    unique_ptr<QuickenState> quick;
+    bool sampling = false;
+    bool tracing = false;
+    bool cacheTop = false;
+    bool counting = false;
+    bool tallying = false;
+    bool active = false;
+    int result = 0;
+    uint64_t instructions = 0;
+};
+
+VMContext::VMContext(shared_ptr<const Program> program, int numThreads)
+    : impl_(make_unique<Impl>(std::move(program), numThreads)) {}
+
+VMContext::~VMContext() = default;
+
+void VMContext::setOutput(OutputFn out) {
+    impl_->sched.setOutput(std::move(out));
+}
+
+void VMContext::setInput(function<size_t(char* buf, size_t size)> source) {
+    if (impl_->active) throw runtime_error("Cannot change input during a call");
+    impl_->sched.setInput(std::move(source));
+}
+
+int VMContext::call(const string& name, const vector<int>& args) {
+    int funcIndex = impl_->program->findFunction(name);
+    if (funcIndex < 0) throw runtime_error("Unknown function: " + name);
+    return call(funcIndex, args);
+}
+
+int VMContext::call(int funcIndex, const vector<int>& args) {
+    impl_->start(funcIndex, args);
+    uint64_t fuel = 0;
+    try {
+        impl_->run<false>(fuel);
+    } catch (...) {
+        impl_->stop();
+        throw;
+    }
+    impl_->stop();
+    return impl_->result;
+}
+
+void VMContext::start(const string& name, const vector<int>& args) {
+    int funcIndex = impl_->program->findFunction(name);
+    if (funcIndex < 0) throw runtime_error("Unknown function: " + name);
+    start(funcIndex, args);
+}
+
+void VMContext::start(int funcIndex, const vector<int>& args) {
+    impl_->start(funcIndex, args);
+}
+
+RunStatus VMContext::resume(uint64_t fuel) {
+    if (!impl_->active) throw runtime_error("No call in progress");
+    uint64_t remaining = fuel;
+    bool done;
+    try {
+        done = impl_->run<true>(remaining);
+    } catch (...) {
+        impl_->instructions += fuel - remaining;
+        impl_->stop();
+        throw;
+    }
+    impl_->instructions += fuel - remaining;
+    if (!done) return RunStatus::Suspended;
+    impl_->stop();
+    return RunStatus::Finished;
+}
+
+void VMContext::enableQuickening() {
+    if (impl_->active) throw runtime_error("Cannot enable quickening during a call");
+    if (impl_->quick) return;
+    impl_->quick = make_unique<QuickenState>(impl_->image);
+}
+
+uint64_t VMContext::quickenedSites() const {
+    return impl_->quick ? impl_->quick->sites : 0;
+}
+
+void VMContext::enableSampling() {
+    if (impl_->active) throw runtime_error("Cannot enable sampling during a call");
+    impl_->sampling = true;
+    impl_->updateRunner();
+}
+
+void VMContext::enableTracing() {
+    if (impl_->active) throw runtime_error("Cannot enable tracing during a call");
+    impl_->tracing = true;
+    impl_->updateRunner();
+}
+
+void VMContext::enableCounting() {
+    if (impl_->active) throw runtime_error("Cannot enable counting during a call");
+    if (impl_->counting) return;
+    impl_->counting = true;
+    for (size_t w = 0; w < impl_->sched.numWorkers(); ++w) {
+        impl_->sched.worker(w).counts.assign(impl_->image.code.size(), 0);
+    }
+    impl_->updateRunner();
+}
+
+Profile VMContext::profile() const {
+    Profile profile;
+    if (!impl_->counting) return profile;
+    const Program& program = *impl_->program;
+    Scheduler& sched = impl_->sched;
+    for (size_t f = 0; f < program.functions.size(); ++f) {
+        const Function& fn = program.functions[f];
+        if (fn.lines.size() != fn.code.size()) continue;
+        vector<uint64_t> counts(fn.code.size(), 0);
+        const size_t base = impl_->image.entry[f];
+        for (size_t w = 0; w < sched.numWorkers(); ++w) {
+            const vector<uint64_t>& c = sched.worker(w).counts;
+            for (size_t i = 0; i < counts.size(); ++i) counts[i] += c[base + i];
+        }
+        // Sites are numbered per line in code order, as the parser does.
+        unordered_map<int, int> branchSites, callSites;
+        for (size_t ip = 0; ip < fn.code.size(); ip += opLength(fn.code[ip])) {
+            int op = fn.code[ip];
+            int line = fn.lines[ip] - fn.line;
+            if (isBranch(op)) {
+                int n = branchSites[line]++;
+                if (counts[ip] + counts[ip + 1] > 0) profile.addBranch(fn.name, line, n, counts[ip], counts[ip + 1]);
+            } else if (op == OP_CALL || op == OP_CALL_NATIVE) {
+                int n = callSites[line]++;
+                if (counts[ip] == 0) continue;
+                const string& callee =
+                    op == OP_CALL ? program.functions[fn.code[ip + 1]].name : program.natives[fn.code[ip + 1]].name;
+                profile.addCall(fn.name, line, n, callee, counts[ip]);
+            }
+        }
+    }
+    return profile;
+}
+
+void VMContext::enableTally() {
+    if (impl_->active) throw runtime_error("Cannot enable the tally during a call");
+    impl_->tallying = true;
+    impl_->updateRunner();
+}
+
+uint64_t VMContext::tally() const {
+    uint64_t total = 0;
+    for (size_t w = 0; w < impl_->sched.numWorkers(); ++w) total += impl_->sched.worker(w).executed;
+    return total;
+}
+
+void VMContext::enableTopCaching() {
+    if (impl_->active) throw runtime_error("Cannot enable top-of-stack caching during a call");
+    impl_->cacheTop = true;
+    impl_->updateRunner();
+}
+
+void VMContext::cancel() {
+    if (impl_->active) impl_->stop();
+}
+
+bool VMContext::running() const {
+    return impl_->active;
+}
+
+int VMContext::result() const {
+    return impl_->result;
+}
+
+uint64_t VMContext::instructions() const {
+    return impl_->instructions;
+}
+
+const Program& VMContext::program() const {
+    return *impl_->program;
+}
+
+struct TimeSlicer::Impl {
+    using Clock = chrono::steady_clock;
+
+    struct Entry {
+        VMContext* vm = nullptr;
+        Clock::time_point queuedAt;
+        double maxWaitMs = 0;
+        double totalWaitMs = 0;
+    };
+
+    // Pops the next runnable VM; returns -1 once every VM has finished.
+    int next() {
+        unique_lock<mutex> lock(queueMutex);
+        queueCv.wait(lock, [this] { return !queue.empty() || unfinished == 0; });
+        if (queue.empty()) return -1;
+        int id = queue.front();
+        queue.pop_front();
+        return id;
+    }
+
+    void workerLoop() {
+        uint64_t localBusyNs = 0;
+        while (true) {
+            int id = next();
+            if (id < 0) break;
+            Entry& e = entries[id];
+            SliceOutcome& out = outcomes[id];
+            auto begin = Clock::now();
+            double waitMs = chrono::duration<double, milli>(begin - e.queuedAt).count();
+            e.maxWaitMs = max(e.maxWaitMs, waitMs);
+            e.totalWaitMs += waitMs;
+            bool finished = true;
+            try {
+                finished = e.vm->resume(sliceFuel) == RunStatus::Finished;
+                if (finished) {
+                    out.ok = true;
+                    out.result = e.vm->result();
+                } else if (instructionLimit > 0 && e.vm->instructions() > instructionLimit) {
+                    e.vm->cancel();
+                    finished = true;
+                    out.error = "Instruction limit exceeded";
+                }
+            } catch (const exception& ex) {
+                out.error = ex.what();
+            }
+            auto end = Clock::now();
+            localBusyNs += chrono::duration_cast<chrono::nanoseconds>(end - begin).count();
+            out.slices++;
+            out.instructions = e.vm->instructions();
+
+            lock_guard<mutex> lock(queueMutex);
+            if (finished) {
+                if (--unfinished == 0) queueCv.notify_all();
+            } else {
+                e.queuedAt = end;
+                queue.push_back(id);
+                queueCv.notify_one();
+            }
+        }
+        busyNs += localBusyNs;
+    }
+
+    int numThreads;
+    uint64_t sliceFuel;
+    uint64_t instructionLimit = 0;
+    vector<Entry> entries;
+    vector<SliceOutcome> outcomes;
+    deque<int> queue;
+    mutex queueMutex;
+    condition_variable queueCv;
+    size_t unfinished = 0;
+    atomic<uint64_t> busyNs{0};
+};
+
+TimeSlicer::TimeSlicer(int numThreads, uint64_t sliceFuel) : impl_(make_unique<Impl>()) {
+    impl_->numThreads = max(1, numThreads);
+    impl_->sliceFuel = max<uint64_t>(1, sliceFuel);
+}
+
+TimeSlicer::~TimeSlicer() = default;
+
+void TimeSlicer::add(VMContext& vm) {
+    if (!vm.running()) throw runtime_error("TimeSlicer::add needs a started VMContext");
+    Impl::Entry e;
+    e.vm = &vm;
+    impl_->entries.push_back(e);
+}
+
+void TimeSlicer::setInstructionLimit(uint64_t limit) {
+    impl_->instructionLimit = limit;
+}
+
+SliceStats TimeSlicer::run() {
+    Impl& im = *impl_;
+    auto start = Impl::Clock::now();
+    im.outcomes.assign(im.entries.size(), SliceOutcome());
+    im.queue.clear();
+    for (size_t i = 0; i < im.entries.size(); ++i) {
+        im.entries[i].queuedAt = start;
+        im.queue.push_back(static_cast<int>(i));
+    }
+    im.unfinished = im.entries.size();
+    im.busyNs = 0;
+
+    vector<thread> threads;
+    for (int i = 1; i < im.numThreads; ++i) threads.emplace_back([&im] { im.workerLoop(); });
+    im.workerLoop();
+    for (auto& t : threads) t.join();
+    auto end = Impl::Clock::now();
+
+    SliceStats stats;
+    stats.vms = im.entries.size();
+    stats.wallMs = chrono::duration<double, milli>(end - start).count();
+    double sumWait = 0, sumWaitSq = 0;
+    for (size_t i = 0; i < im.entries.size(); ++i) {
+        const SliceOutcome& out = im.outcomes[i];
+        if (!out.ok) stats.failed++;
+        stats.slices += out.slices;
+        stats.instructions += out.instructions;
+        stats.maxWaitMs = max(stats.maxWaitMs, im.entries[i].maxWaitMs);
+        double meanWait = out.slices > 0 ? im.entries[i].totalWaitMs / out.slices : 0;
+        sumWait += meanWait;
+        sumWaitSq += meanWait * meanWait;
+    }
+    if (stats.wallMs > 0) stats.instructionsPerSec = stats.instructions * 1000.0 / stats.wallMs;
+    if (stats.slices > 0) {
+        double totalNs = stats.wallMs * 1e6 * im.numThreads;
+        stats.overheadNsPerSlice = max(0.0, totalNs - static_cast<double>(im.busyNs)) / stats.slices;
+    }
+    stats.fairness = sumWaitSq > 0 ? (sumWait * sumWait) / (stats.vms * sumWaitSq) : 1.0;
+    return stats;
+}
+
+const vector<SliceOutcome>& TimeSlicer::outcomes() const {
+    return impl_->outcomes;
+}
+
+namespace {
+
+struct Sample {
+    atomic<size_t> seq{0};
+    int depth = 0;
+    int frames[ShadowStack::kMaxFrames];
+};
+
+// Bounded multi-producer queue (Vyukov). push() touches nothing but atomics
+// and preallocated slots, so it may run inside a signal handler; a full queue
+// drops the sample instead of waiting.
+class SampleQueue {
+public:
+    static const size_t kCapacity = 1024;
+
+    SampleQueue() {
+        for (size_t i = 0; i < kCapacity; ++i) slots_[i].seq.store(i, memory_order_relaxed);
+    }
+
+    void push(const ShadowStack& stack) {
+        size_t pos = head_.load(memory_order_relaxed);
+        while (true) {
+            Sample& slot = slots_[pos & (kCapacity - 1)];
+            size_t seq = slot.seq.load(memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    int depth = stack.depth.load(memory_order_acquire);
+                    int n = min(depth, ShadowStack::kMaxFrames);
+                    for (int i = 0; i < n; ++i) slot.frames[i] = stack.frames[i];
+                    slot.depth = depth;
+                    slot.seq.store(pos + 1, memory_order_release);
+                    return;
+                }
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, memory_order_relaxed);
+                return;
+            } else {
+                pos = head_.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // Single consumer.
+    bool pop(vector<int>& frames, int& depth) {
+        Sample& slot = slots_[tail_ & (kCapacity - 1)];
+        if (slot.seq.load(memory_order_acquire) != tail_ + 1) return false;
+        depth = slot.depth;
+        frames.assign(slot.frames, slot.frames + min(depth, ShadowStack::kMaxFrames));
+        slot.seq.store(tail_ + kCapacity, memory_order_release);
+        tail_++;
+        return true;
+    }
+
+    uint64_t dropped() const { return dropped_.load(memory_order_relaxed); }
+
+private:
+    Sample slots_[kCapacity];
+    atomic<size_t> head_{0};
+    size_t tail_ = 0;
+    atomic<uint64_t> dropped_{0};
+};
+
+atomic<SampleQueue*> activeQueue{nullptr};
+
+#ifndef _WIN32
+void onSigprof(int) {
+    int savedErrno = errno;
+    SampleQueue* queue = activeQueue.load(memory_order_acquire);
+    const ShadowStack* stack = currentShadow;
+    if (queue && stack && stack->depth.load(memory_order_relaxed) > 0) queue->push(*stack);
+    errno = savedErrno;
+}
+#endif
+
+} // namespace
+
+struct SampleProfiler::Impl {
+    // Folds everything queued so far into counts.
+    void drain() {
+        vector<int> frames;
+        int depth = 0;
+        lock_guard<mutex> lock(countsMutex);
+        while (queue->pop(frames, depth)) {
+            if (depth > ShadowStack::kMaxFrames) frames.push_back(-1);
+            counts[frames]++;
+            total++;
+        }
+    }
+
+    int hz = 0;
+    unique_ptr<SampleQueue> queue = make_unique<SampleQueue>();
+    map<vector<int>, uint64_t> counts;
+    uint64_t total = 0;
+    mutable mutex countsMutex;
+    thread drainer;
+    mutex stopMutex;
+    condition_variable stopCv;
+    bool running = false;
+#ifndef _WIN32
+    struct sigaction oldAction;
+#endif
+};
+
+SampleProfiler::SampleProfiler(int hz) : impl_(make_unique<Impl>()) {
+    if (hz <= 0 || hz > 1000000) throw runtime_error("Sampling rate must be between 1 and 1000000 Hz");
+    impl_->hz = hz;
+}
+
+SampleProfiler::~SampleProfiler() {
+    stop();
+}
+
+void SampleProfiler::start() {
+#ifdef _WIN32
+    throw runtime_error("Sampling profiler needs SIGPROF; not supported on Windows");
+#else
+    Impl& im = *impl_;
+    if (im.running) return;
+    SampleQueue* expected = nullptr;
+    if (!activeQueue.compare_exchange_strong(expected, im.queue.get())) {
+        throw runtime_error("Another sampling profiler is already running");
+    }
+    im.running = true;
+    im.drainer = thread([&im] {
+        unique_lock<mutex> lock(im.stopMutex);
+        while (im.running) {
+            im.stopCv.wait_for(lock, chrono::milliseconds(20));
+            im.drain();
+        }
+    });
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSigprof;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &im.oldAction);
+
+    long usec = max(1L, 1000000L / im.hz);
+    struct itimerval timer;
+    timer.it_interval.tv_sec = usec / 1000000;
+    timer.it_interval.tv_usec = usec % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+#endif
+}
+
+void SampleProfiler::stop() {
+#ifndef _WIN32
+    Impl& im = *impl_;
+    if (!im.running) return;
+    struct itimerval off;
+    memset(&off, 0, sizeof(off));
+    setitimer(ITIMER_PROF, &off, nullptr);
+    sigaction(SIGPROF, &im.oldAction, nullptr);
+    activeQueue.store(nullptr, memory_order_release);
+    {
+        lock_guard<mutex> lock(im.stopMutex);
+        im.running = false;
+    }
+    im.stopCv.notify_all();
+    im.drainer.join();
+    im.drain();
+#endif
+}
+
+uint64_t SampleProfiler::samples() const {
+    lock_guard<mutex> lock(impl_->countsMutex);
+    return impl_->total;
+}
+
+uint64_t SampleProfiler::dropped() const {
+    return impl_->queue->dropped();
+}
+
+void SampleProfiler::writeFolded(ostream& out, const Program& program) const {
+    lock_guard<mutex> lock(impl_->countsMutex);
+    for (const auto& entry : impl_->counts) {
+        const vector<int>& frames = entry.first;
+        for (size_t i = 0; i < frames.size(); ++i) {
+            if (i > 0) out << ';';
+            int f = frames[i];
+            if (f >= 0 && f < static_cast<int>(program.functions.size())) out << program.functions[f].name;
+            else out << "[truncated]";
+        }
+        out << ' ' << entry.second << '\n';
+    }
+}
+
+namespace {
+
+struct PerfEvent {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+};
+
+#ifdef __linux__
+constexpr uint64_t cacheMisses(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+const PerfEvent perfEvents[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1-icache-load-misses", PERF_TYPE_HW_CACHE, cacheMisses(PERF_COUNT_HW_CACHE_L1I)},
+    {"L1-dcache-load-misses", PERF_TYPE_HW_CACHE, cacheMisses(PERF_COUNT_HW_CACHE_L1D)},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+#else
+const PerfEvent perfEvents[] = {
+    {"cycles", 0, 0},
+    {"instructions", 0, 0},
+    {"branch-misses", 0, 0},
+    {"L1-icache-load-misses", 0, 0},
+    {"L1-dcache-load-misses", 0, 0},
+    {"page-faults", 0, 0},
+};
+#endif
+
+const size_t kNumPerfEvents = sizeof(perfEvents) / sizeof(perfEvents[0]);
+
+} // namespace
+
+struct PerfCounters::Impl {
+    int fds[kNumPerfEvents];
+    string error;
+};
+
+// The events are opened separately rather than as a group: a group has to fit
+// on the PMU at once, and inherited counters cannot be read as a group.
+PerfCounters::PerfCounters() : impl_(make_unique<Impl>()) {
+    fill(begin(impl_->fds), end(impl_->fds), -1);
+#ifdef __linux__
+    bool any = false;
+    for (size_t i = 0; i < kNumPerfEvents; ++i) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perfEvents[i].type;
+        attr.config = perfEvents[i].config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        if (fd >= 0) {
+            impl_->fds[i] = fd;
+            any = true;
+        } else if (impl_->error.empty()) {
+            impl_->error = string("perf_event_open: ") + strerror(errno);
+        }
+    }
+    if (any) impl_->error.clear();
+#else
+    impl_->error = "perf_event_open is Linux only";
+#endif
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+    for (int fd : impl_->fds) {
+        if (fd >= 0) close(fd);
+    }
+#endif
+}
+
+void PerfCounters::start() {
+#ifdef __linux__
+    for (int fd : impl_->fds) {
+        if (fd < 0) continue;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+void PerfCounters::stop() {
+#ifdef __linux__
+    for (int fd : impl_->fds) {
+        if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+#endif
+}
+
+vector<PerfCounters::Counter> PerfCounters::read() const {
+    vector<Counter> counters(kNumPerfEvents);
+    for (size_t i = 0; i < kNumPerfEvents; ++i) {
+        counters[i].name = perfEvents[i].name;
+#ifdef __linux__
+        // value, time enabled, time running; running < enabled when the
+        // event was multiplexed, and 0 when it never got a counter.
+        uint64_t data[3];
+        int fd = impl_->fds[i];
+        if (fd < 0 || ::read(fd, data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)) || data[2] == 0) {
+            continue;
+        }
+        counters[i].available = true;
+        counters[i].value =
+            data[2] < data[1] ? static_cast<uint64_t>(static_cast<double>(data[0]) * data[1] / data[2]) : data[0];
+#endif
+    }
+    return counters;
+}
+
+const string& PerfCounters::error() const {
+    return impl_->error;
+}
+
+} // namespace scc
@@ -0,0 +1,394 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Embedding API for S: compile source once, then run it from any number of
+// VMContexts. A compiled Program is immutable and may be shared freely
+// between threads; each VMContext must only be used by one thread at a time.
+// Errors (parse errors, division by zero, ...) are thrown as std::runtime_error.
+namespace scc {
+
+struct Function {
+    std::string name;
+    int numParams = 0;
+    int numLocals = 0;
+    std::vector<int> code;
+    // Source line of the function's header, and of every code slot. Hand-built
+    // functions may leave both unset; they then have no profile entries.
+    int line = 0;
+    std::vector<int> lines;
+};
+
+// A host function S code calls like any other: name(args...). args points at
+// numParams values on the caller's value stack, valid only during the call.
+// Errors are thrown as std::runtime_error.
+using NativeFn = int (*)(const int* args);
+
+struct NativeFunction {
+    std::string name;
+    int numParams = 0;
+    NativeFn fn = nullptr;
+};
+
+// Native functions a program may call, looked up by name when its calls are
+// resolved; functions the program defines itself take precedence. Starts out
+// with the builtins abs, min, max, clamp(x, lo, hi), mod, pow, gcd and isqrt,
+// the only natives compiled executables and --emit-cpp support.
+class NativeRegistry {
+public:
+    NativeRegistry();
+
+    // Throws if the name is taken.
+    void add(const std::string& name, int numParams, NativeFn fn);
+    // Returns nullptr if there is no such native.
+    const NativeFunction* find(const std::string& name) const;
+
+private:
+    std::vector<NativeFunction> functions_;
+};
+
+struct Program {
+    std::vector<Function> functions;
+    std::vector<std::string> strings;
+    // Natives called by OP_CALL_NATIVE, in first-use order.
+    std::vector<NativeFunction> natives;
+
+    // Returns the index of the named function, or -1.
+    int findFunction(const std::string& name) const;
+};
+
+// Receives the wall time of each compiler phase ("lex", "parse", "resolve")
+// once it is known. Lexing runs interleaved with parsing, so both are
+// reported when parsing ends.
+using PhaseFn = std::function<void(const char* phase, double ms)>;
+
+// Branch and call counts from a counting run (VMContext::enableCounting). A
+// site is keyed by its function's name, its line relative to the function
+// header and its position among sites of the same kind on that line, so
+// edits outside a function leave its entries valid. Saved as text:
+//   branch <function> <line> <n> <taken> <fallen-through>
+//   call <function> <line> <n> <callee> <count>
+// where taken counts conditions that were false (the jump over the then-arm
+// or out of the loop).
+class Profile {
+public:
+    struct Branch {
+        uint64_t taken = 0;
+        uint64_t fallen = 0;
+    };
+    struct Call {
+        std::string callee;
+        uint64_t count = 0;
+    };
+
+    // Adding a site twice sums its counts, so runs can be merged.
+    void addBranch(const std::string& function, int line, int n, uint64_t taken, uint64_t fallen);
+    void addCall(const std::string& function, int line, int n, const std::string& callee, uint64_t count);
+    // Return nullptr for sites the profile has not seen.
+    const Branch* branch(const std::string& function, int line, int n) const;
+    const Call* call(const std::string& function, int line, int n) const;
+    size_t numBranches() const;
+    size_t numCalls() const;
+
+    void write(std::ostream& out) const;
+    // Throws std::runtime_error on a malformed line.
+    static Profile read(std::istream& in);
+
+private:
+    std::map<std::tuple<std::string, int, int>, Branch> branches_;
+    std::map<std::tuple<std::string, int, int>, Call> calls_;
+};
+
+// What compiling against a profile changed.
+struct ProfileStats {
+    // if/else statements whose hot then-arm was moved after the else-arm so it
+    // falls through to the join point instead of jumping over it.
+    int branchesInverted = 0;
+    // Hot while loops compiled with the test at the bottom, which saves the
+    // jump back to the top on every iteration.
+    int loopsRotated = 0;
+    // Hot calls to small leaf functions replaced by the callee's code.
+    int callsInlined = 0;
+};
+
+// Local slots of a function before and after locals whose lifetimes never
+// overlap were given shared slots.
+struct FrameSize {
+    std::string function;
+    int before = 0;
+    int after = 0;
+};
+
+// A call compile-time evaluation replaced by its result.
+struct FoldedCall {
+    std::string function;
+    // Source line of the call, 0 in hand-built functions.
+    int line = 0;
+    std::string callee;
+    std::vector<int> args;
+    int result = 0;
+    // Instructions the call ran at compile time; 0 for builtins.
+    uint64_t instructions = 0;
+};
+
+struct CompileOptions {
+    // Resolves calls to undefined functions; the builtins when null.
+    const NativeRegistry* natives = nullptr;
+    // Lays out branches and inlines calls by these counts; the profile should
+    // come from a build that used neither a profile nor call folding.
+    const Profile* profile = nullptr;
+    ProfileStats* profileStats = nullptr;
+    // Receives one entry per compiled function, in definition order.
+    std::vector<FrameSize>* frameSizes = nullptr;
+    PhaseFn onPhase;
+    // When set, only these functions and the ones they call, directly or not,
+    // are parsed and compiled, and the Program holds just those. Other bodies
+    // are only brace-matched, so errors inside them go unreported. Roots that
+    // are not defined are ignored.
+    std::vector<std::string> roots;
+    // Calls whose arguments are all constants, to builtins or to functions
+    // that print and read nothing, use no tasks and call only such
+    // functions, are run while compiling and replaced by their result. A
+    // call that fails, or runs more than foldBudget instructions, is left
+    // alone. 0 disables it. All calls together, folded or not, run at most
+    // foldTotalBudget instructions per compile; calls reached after that are
+    // left alone too.
+    uint64_t foldBudget = 10000000;
+    uint64_t foldTotalBudget = 100000000;
+    std::vector<FoldedCall>* foldedCalls = nullptr;
+};
+
+std::shared_ptr<const Program> compile(const std::string& source, const PhaseFn& onPhase = nullptr);
+// Resolves calls to undefined functions against `natives` instead of the builtins.
+std::shared_ptr<const Program> compile(const std::string& source, const NativeRegistry& natives,
+                                       const PhaseFn& onPhase = nullptr);
+std::shared_ptr<const Program> compile(const std::string& source, const CompileOptions& options);
+
+// Translates a program into a standalone C++17 source file whose main() runs
+// entryFunc: locals and stack slots become native ints and branches become
+// gotos. Output, exit code and runtime errors match `scc --run --threads 1`,
+// except that recursion uses the native stack.
+void emitCpp(const Program& program, int entryFunc, std::ostream& out);
+
+// Receives each line written by print(), without the trailing newline.
+using OutputFn = std::function<void(const std::string& line)>;
+
+enum class RunStatus { Finished, Suspended };
+
+class VMContext {
+public:
+    // numThreads sizes the worker pool used by spawn(); 1 runs tasks inline on join.
+    explicit VMContext(std::shared_ptr<const Program> program, int numThreads = 1);
+    ~VMContext();
+    VMContext(const VMContext&) = delete;
+    VMContext& operator=(const VMContext&) = delete;
+
+    // Output goes to std::cout until a callback is set.
+    void setOutput(OutputFn out);
+    // read() and eof() take integers from `source` instead of stdin. source
+    // fills buf with up to size bytes and returns how many, 0 at the end.
+    void setInput(std::function<size_t(char* buf, size_t size)> source);
+
+    // Switches this context to the quickening interpreter: it copies the code
+    // and rewrites hot sequences in place (calls without arity checks, division
+    // by known non-zero constants, fused load-compare-branch) after their first
+    // execution. Spawned tasks keep using the shared, unmodified code.
+    void enableQuickening();
+    // Number of instruction sites rewritten so far.
+    uint64_t quickenedSites() const;
+
+    // Runs call() and spawned tasks with the top of the value stack held in a
+    // register (svm::interpretCached), which saves a store and a capacity check
+    // per operator. start()/resume(), quickening and tracing keep using the
+    // regular interpreter.
+    void enableTopCaching();
+
+    // Keeps a shadow call stack per worker so a running SampleProfiler can
+    // attribute samples to S functions. Costs two stores per call when on.
+    void enableSampling();
+
+    // Writes every executed instruction, with the top of the value stack, to
+    // std::cerr. Takes precedence over sampling.
+    void enableTracing();
+
+    // Counts branch outcomes and calls per site, in this context's calls and
+    // the tasks they spawn, for profile(). Runs the plain interpreter: takes
+    // precedence over quickening, top-of-stack caching and sampling, but not
+    // over tracing.
+    void enableCounting();
+    // Counts gathered since enableCounting(), keyed by source position.
+    Profile profile() const;
+
+    // Counts every instruction run by this context's calls and the tasks they
+    // spawn, whichever interpreter runs them, at the cost of an increment per
+    // instruction. Tracing and counting take precedence and are not tallied.
+    void enableTally();
+    // Instructions run since enableTally(), summed over workers; read it
+    // between calls.
+    uint64_t tally() const;
+
+    // Calls a function with integer arguments and returns its result. Value and
+    // frame stacks are kept between calls, so repeated calls do not reallocate.
+    int call(const std::string& name, const std::vector<int>& args = {});
+    int call(int funcIndex, const std::vector<int>& args = {});
+
+    // Metered execution: start() prepares a call without running it, resume()
+    // executes at most `fuel` instructions. A Suspended call keeps its frames
+    // and stack in the context and continues on the next resume(), from any
+    // thread. Tasks run by spawn()/join() are not metered.
+    void start(const std::string& name, const std::vector<int>& args = {});
+    void start(int funcIndex, const std::vector<int>& args = {});
+    RunStatus resume(uint64_t fuel);
+    // Abandons a suspended call.
+    void cancel();
+    bool running() const;
+    int result() const;
+    // Instructions executed by resume() since the last start().
+    uint64_t instructions() const;
+
+    const Program& program() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+struct SliceStats {
+    size_t vms = 0;
+    size_t failed = 0;
+    uint64_t slices = 0;
+    uint64_t instructions = 0;
+    double wallMs = 0;
+    double instructionsPerSec = 0;
+    // Time per slice spent outside resume(): queueing, locking, idling.
+    double overheadNsPerSlice = 0;
+    // Longest time a runnable VM waited between two of its slices.
+    double maxWaitMs = 0;
+    // Jain's index over each VM's mean wait for its next slice; 1.0 means
+    // every VM waited equally long.
+    double fairness = 0;
+};
+
+struct SliceOutcome {
+    bool ok = false;
+    int result = 0;
+    std::string error;
+    uint64_t slices = 0;
+    uint64_t instructions = 0;
+};
+
+// Round-robins many started VMContexts over a fixed set of threads, giving
+// each `sliceFuel` instructions per turn until every call has finished.
+class TimeSlicer {
+public:
+    TimeSlicer(int numThreads, uint64_t sliceFuel);
+    ~TimeSlicer();
+
+    // The context must have a call in progress (see VMContext::start) and must
+    // outlive run().
+    void add(VMContext& vm);
+    // Cancels any VM that has executed more than `limit` instructions; 0 = no limit.
+    void setInstructionLimit(uint64_t limit);
+    SliceStats run();
+    // One entry per add(), in order; filled in by run().
+    const std::vector<SliceOutcome>& outcomes() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// Evaluates one function over many independent argument tuples. A function
+// that only computes (no calls, spawn, join or print) runs `lanes` inputs at
+// a time in lock step: each local and stack slot holds one value per lane,
+// and lanes that take different branches are masked off until they meet
+// again. Other functions, or lanes == 1, fall back to one VMContext call per
+// input. Results match calling the function on each input in turn.
+class BatchEvaluator {
+public:
+    // lanes is 1, 8 or 16. The function must take at least one argument.
+    BatchEvaluator(std::shared_ptr<const Program> program, const std::string& name, int lanes = 16);
+    ~BatchEvaluator();
+    BatchEvaluator(const BatchEvaluator&) = delete;
+    BatchEvaluator& operator=(const BatchEvaluator&) = delete;
+
+    // True when the function runs lane-parallel.
+    bool vectorized() const;
+    // Lanes actually used: 1 unless vectorized().
+    int lanes() const;
+    int arity() const;
+
+    // args holds arity() values per input, back to back; results receives one
+    // value per input. Throws on the first failing input, naming its index.
+    void run(const std::vector<int>& args, std::vector<int>& results);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// Statistical profiler: a SIGPROF interval timer snapshots the interrupted
+// thread's S call stack (see VMContext::enableSampling) into a lock-free
+// queue, and a background thread folds the snapshots into per-stack counts.
+// Only one profiler may run at a time. POSIX only; start() throws on Windows.
+class SampleProfiler {
+public:
+    explicit SampleProfiler(int hz);
+    ~SampleProfiler();
+    SampleProfiler(const SampleProfiler&) = delete;
+    SampleProfiler& operator=(const SampleProfiler&) = delete;
+
+    void start();
+    void stop();
+    uint64_t samples() const;
+    // Samples lost because the queue was full.
+    uint64_t dropped() const;
+    // Writes one "main;fib;fib <count>" line per distinct stack, the folded
+    // format read by flamegraph.pl and speedscope.
+    void writeFolded(std::ostream& out, const Program& program) const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// Hardware and kernel event counts from Linux perf_event_open: CPU cycles,
+// instructions, branch misses, L1 instruction and data cache load misses and
+// page faults, in user mode, for the calling thread and the threads it starts
+// while counting. A started thread's counts are added only when it exits, so
+// join it (for a VMContext's workers, destroy the context) before stop().
+// Events the system cannot count (no PMU in a VM, a strict
+// perf_event_paranoid, other platforms) are reported as unavailable.
+class PerfCounters {
+public:
+    struct Counter {
+        const char* name = "";
+        bool available = false;
+        // Scaled up when the kernel had to share the hardware between events.
+        uint64_t value = 0;
+    };
+
+    PerfCounters();
+    ~PerfCounters();
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    void start();
+    void stop();
+    // One entry per event, in the order above, for the last start()/stop().
+    std::vector<Counter> read() const;
+    // Why no event could be opened; empty if any could.
+    const std::string& error() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+} // namespace scc
@@ -0,0 +1,1588 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Bytecode interpreter shared by the compiler library (scc --run, VMContext)
+// and the standalone runtime. It is templated on the program type, which only
+// needs `functions` (each with name, numParams, numLocals and code), `strings`
+// and `natives` (each with name, numParams and fn), and on a Policy that picks
+// features at compile time. A disabled feature compiles to nothing, so each
+// binary instantiates just the variants it runs. Programs run from an Image,
+// their code laid out in one segment.
+namespace svm {
+
+enum Op {
+    OP_PUSH_INT,
+    OP_LOAD,
+    OP_STORE,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_JMP,
+    OP_JMP_IF_FALSE,
+    OP_CALL,
+    OP_RET,
+    OP_PRINT,
+    OP_PRINT_STR,
+    OP_POP,
+    OP_SPAWN,
+    OP_JOIN,
+    OP_CALL_NATIVE, // [op, native, argc]: calls program.natives[native] on the top argc values
+    OP_READ,        // [op, mode]: pushes the next input integer (kReadInt) or whether input is done (kReadEof)
+    // Switches pop a value and jump through the table that follows them:
+    // count OP_CASE entries, then an OP_JMP to the default.
+    OP_TABLESWITCH,  // [op, lo, count]: entry i holds key lo + i
+    OP_LOOKUPSWITCH, // [op, count]: entry keys ascend and are binary searched
+    OP_CASE,         // [op, key, target]: a switch table entry, never executed
+    OP_CMP_BR,       // [op, cmp, target]: pops b and a, jumps unless a <cmp> b
+    OP_JMP_IF_TRUE,  // [op, target]: pops a value, jumps if it is not 0
+    // Quickened forms. Only the quickening interpreter writes these, and only
+    // into a VMContext's private copy of the code; they never reach a payload.
+    // Each keeps the operand slots of the sequence it replaces in place.
+    OP_CALL_FAST,         // OP_CALL whose arity has been checked
+    OP_DIV_CONST,         // PUSH_INT k (k != 0, -1); DIV
+    OP_LOAD_CONST_CMP_BR, // LOAD x; PUSH_INT k; CMP_BR cmp t -> [op, x, cmp, k, -, -, t]
+    OP_LOAD_LOAD_CMP_BR,  // LOAD x; LOAD y; CMP_BR cmp t     -> [op, x, cmp, y, -, -, t]
+    OP_COUNT
+};
+
+inline const char* opName(int op) {
+    static const char* const names[] = {
+        "PUSH_INT", "LOAD", "STORE", "ADD", "SUB", "MUL", "DIV", "EQ", "NE", "LT", "LE", "GT", "GE",
+        "JMP", "JMP_IF_FALSE", "CALL", "RET", "PRINT", "PRINT_STR", "POP", "SPAWN", "JOIN",
+        "CALL_NATIVE", "READ", "TABLESWITCH", "LOOKUPSWITCH", "CASE", "CMP_BR", "JMP_IF_TRUE", "CALL_FAST",
+        "DIV_CONST", "LOAD_CONST_CMP_BR", "LOAD_LOAD_CMP_BR"};
+    return op >= 0 && op < OP_COUNT ? names[op] : "?";
+}
+
+// Slots taken by an instruction, opcode included.
+inline int opLength(int op) {
+    switch (op) {
+        case OP_PUSH_INT:
+        case OP_LOAD:
+        case OP_STORE:
+        case OP_JMP:
+        case OP_JMP_IF_FALSE:
+        case OP_JMP_IF_TRUE:
+        case OP_PRINT_STR:
+        case OP_READ:
+        case OP_LOOKUPSWITCH:
+            return 2;
+        case OP_CALL:
+        case OP_SPAWN:
+        case OP_CALL_NATIVE:
+        case OP_TABLESWITCH:
+        case OP_CASE:
+        case OP_CALL_FAST:
+        case OP_DIV_CONST:
+        case OP_CMP_BR:
+            return 3;
+        case OP_LOAD_CONST_CMP_BR:
+        case OP_LOAD_LOAD_CMP_BR:
+            return 7;
+        default:
+            return 1;
+    }
+}
+
+// Slot of an instruction's jump target relative to its opcode, or 0 if it has
+// none. Quickened branches are left out: they never reach the passes that ask.
+inline int targetOperand(int op) {
+    switch (op) {
+        case OP_JMP:
+        case OP_JMP_IF_FALSE:
+        case OP_JMP_IF_TRUE:
+            return 1;
+        case OP_CASE:
+        case OP_CMP_BR:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+// Where a verified OP_TABLESWITCH or OP_LOOKUPSWITCH sends v; operands
+// points just past the opcode.
+inline int switchTarget(int op, const int* operands, int v) {
+    if (op == OP_TABLESWITCH) {
+        const int count = operands[1];
+        const int* table = operands + 2;
+        unsigned i = static_cast<unsigned>(v) - static_cast<unsigned>(operands[0]);
+        return i < static_cast<unsigned>(count) ? table[3 * i + 2] : table[3 * count + 1];
+    }
+    const int count = operands[0];
+    const int* table = operands + 1;
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (table[3 * mid + 1] < v) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < count && table[3 * lo + 1] == v ? table[3 * lo + 2] : table[3 * count + 1];
+}
+
+inline bool isCompare(int op) {
+    return op >= OP_EQ && op <= OP_GE;
+}
+
+// Conditional branches, whose opcode and next slot count the jumps taken
+// and not taken under a Count policy.
+inline bool isBranch(int op) {
+    return op == OP_JMP_IF_FALSE || op == OP_JMP_IF_TRUE || op == OP_CMP_BR;
+}
+
+inline bool compare(int cmp, int a, int b) {
+    switch (cmp) {
+        case OP_EQ: return a == b;
+        case OP_NE: return a != b;
+        case OP_LT: return a < b;
+        case OP_LE: return a <= b;
+        case OP_GT: return a > b;
+        default: return a >= b;
+    }
+}
+
+// Arithmetic wraps on overflow. It is done in unsigned so that it is defined
+// in the host too, which matters once the compiler folds calls by running
+// them.
+inline int add(int a, int b) {
+    return static_cast<int>(static_cast<unsigned>(a) + static_cast<unsigned>(b));
+}
+
+inline int subtract(int a, int b) {
+    return static_cast<int>(static_cast<unsigned>(a) - static_cast<unsigned>(b));
+}
+
+inline int multiply(int a, int b) {
+    return static_cast<int>(static_cast<unsigned>(a) * static_cast<unsigned>(b));
+}
+
+// a / b, truncating as in C. INT_MIN / -1 wraps to INT_MIN instead of
+// trapping the host.
+inline int divide(int a, int b) {
+    if (b == 0) throw std::runtime_error("Division by zero");
+    return b == -1 ? static_cast<int>(0u - static_cast<unsigned>(a)) : a / b;
+}
+
+// Host functions every program may call by name unless it defines a function
+// of the same name. The standalone runtime binds a payload's natives against
+// this table, so only these can appear in a compiled executable.
+struct BuiltinNative {
+    const char* name;
+    int numParams;
+    int (*fn)(const int* args);
+};
+
+namespace builtins {
+
+inline int abs(const int* a) {
+    return a[0] < 0 ? static_cast<int>(0u - static_cast<unsigned>(a[0])) : a[0];
+}
+
+inline int min(const int* a) {
+    return std::min(a[0], a[1]);
+}
+
+inline int max(const int* a) {
+    return std::max(a[0], a[1]);
+}
+
+// clamp(x, lo, hi)
+inline int clamp(const int* a) {
+    return std::max(a[1], std::min(a[0], a[2]));
+}
+
+// Remainder with the sign of the dividend, as in C.
+inline int mod(const int* a) {
+    if (a[1] == 0) throw std::runtime_error("Division by zero");
+    return a[1] == -1 ? 0 : a[0] % a[1];
+}
+
+// Wraps on overflow; a negative exponent gives the truncated quotient 1 / b^-e.
+inline int pow(const int* a) {
+    int base = a[0], e = a[1];
+    if (e < 0) return base == 1 ? 1 : base == -1 ? (e % 2 ? -1 : 1) : 0;
+    unsigned r = 1, b = static_cast<unsigned>(base);
+    for (unsigned n = static_cast<unsigned>(e); n; n >>= 1) {
+        if (n & 1) r *= b;
+        b *= b;
+    }
+    return static_cast<int>(r);
+}
+
+inline int gcd(const int* a) {
+    unsigned x = static_cast<unsigned>(abs(a)), y = static_cast<unsigned>(abs(a + 1));
+    while (y) {
+        unsigned t = x % y;
+        x = y;
+        y = t;
+    }
+    return static_cast<int>(x);
+}
+
+// Largest r with r * r <= x.
+inline int isqrt(const int* a) {
+    if (a[0] < 0) throw std::runtime_error("isqrt of a negative number");
+    unsigned x = static_cast<unsigned>(a[0]);
+    unsigned r = static_cast<unsigned>(std::sqrt(static_cast<double>(x)));
+    while (r * r > x) --r;
+    while ((r + 1) * (r + 1) <= x) ++r;
+    return static_cast<int>(r);
+}
+
+} // namespace builtins
+
+inline const std::vector<BuiltinNative>& builtinNatives() {
+    static const std::vector<BuiltinNative> table = {
+        {"abs", 1, builtins::abs},     {"min", 2, builtins::min}, {"max", 2, builtins::max},
+        {"clamp", 3, builtins::clamp}, {"mod", 2, builtins::mod}, {"pow", 2, builtins::pow},
+        {"gcd", 2, builtins::gcd},     {"isqrt", 1, builtins::isqrt},
+    };
+    return table;
+}
+
+// OP_READ modes.
+enum ReadMode { kReadInt = 0, kReadEof = 1 };
+
+// Integers for read(), parsed from a byte source in 1 MB blocks. An integer
+// is a run of decimal digits with an optional leading '-'; every other byte
+// separates integers. Digits are found and converted eight at a time inside
+// a 64-bit word, which assumes a little-endian host (x86, x64, ARM).
+class IntReader {
+public:
+    // Fills buf with up to size bytes and returns how many; 0 at the end.
+    using Source = std::function<size_t(char* buf, size_t size)>;
+
+    explicit IntReader(Source source) : source_(std::move(source)), buf_(kBlock + kPad, 0) {}
+
+    // Stores the next integer in value, or returns false at the end of the
+    // input. Throws on a '-' without digits or a value outside int's range.
+    bool next(int& value) {
+        if (!skipSeparators()) return false;
+        while (end_ - pos_ < kMaxToken && !eof_) fill();
+        size_t p = pos_;
+        const bool negative = buf_[p] == '-';
+        if (negative) p++;
+        uint64_t chunk;
+        std::memcpy(&chunk, buf_.data() + p, 8);
+        int n = digitRun(chunk);
+        if (n == 0) throw std::runtime_error("Malformed input: '-' without digits");
+        uint64_t v = parseDigits(chunk, n);
+        p += n;
+        // Nine or more digits, or leading zeros, continue one at a time.
+        if (n == 8) {
+            while (true) {
+                if (p == end_) {
+                    pos_ = p;
+                    if (eof_ || !fill()) break;
+                    p = pos_;
+                }
+                unsigned d = static_cast<unsigned char>(buf_[p]) - '0';
+                if (d > 9) break;
+                v = v * 10 + d;
+                if (v > kLimit) throw std::runtime_error("Input integer out of range");
+                p++;
+            }
+        }
+        pos_ = p;
+        if (v > kLimit - (negative ? 0 : 1)) throw std::runtime_error("Input integer out of range");
+        value = static_cast<int>(negative ? 0u - static_cast<uint32_t>(v) : static_cast<uint32_t>(v));
+        return true;
+    }
+
+    // True when nothing but separators is left.
+    bool atEnd() { return !skipSeparators(); }
+
+private:
+    static const size_t kBlock = 1 << 20;
+    // Zeroed bytes after the data, so eight-byte loads stay in bounds and
+    // stop at the end.
+    static const size_t kPad = 16;
+    // Tokens up to this long are read from one block.
+    static const size_t kMaxToken = 32;
+    static constexpr uint64_t kLimit = 2147483648u;
+
+    static int countTrailingZeros(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(x);
+#else
+        int n = 0;
+        for (; !(x & 1); x >>= 1) n++;
+        return n;
+#endif
+    }
+
+    // Leading bytes of chunk that are ASCII digits, 0 to 8. A byte is a digit
+    // when its high nibble is 3 and adding 6 to its low nibble does not carry.
+    static int digitRun(uint64_t chunk) {
+        const uint64_t bad = ((chunk & 0xF0F0F0F0F0F0F0F0u) ^ 0x3030303030303030u) |
+                             (((chunk & 0x0F0F0F0F0F0F0F0Fu) + 0x0606060606060606u) & 0xF0F0F0F0F0F0F0F0u);
+        // The top bit of every non-zero byte of bad.
+        const uint64_t mask = (((bad & 0x7F7F7F7F7F7F7F7Fu) + 0x7F7F7F7F7F7F7F7Fu) | bad) & 0x8080808080808080u;
+        return mask ? countTrailingZeros(mask) / 8 : 8;
+    }
+
+    // Value of the first n (1 to 8) digits of chunk. Shifting them to the top
+    // of the word pads them with leading zeros; pairs, then quads, then the
+    // two halves are combined with one multiply each.
+    static uint64_t parseDigits(uint64_t chunk, int n) {
+        uint64_t v = (chunk & 0x0F0F0F0F0F0F0F0Fu) << (8 * (8 - n));
+        v = (v * 10 + (v >> 8)) & 0x00FF00FF00FF00FFu;
+        v = (v * 100 + (v >> 16)) & 0x0000FFFF0000FFFFu;
+        return (v * 10000 + (v >> 32)) & 0xFFFFFFFFu;
+    }
+
+    // Skips to the next '-' or digit; false if the input ends first.
+    bool skipSeparators() {
+        while (true) {
+            for (; pos_ < end_; ++pos_) {
+                char c = buf_[pos_];
+                if (c == '-' || static_cast<unsigned>(c - '0') < 10) return true;
+            }
+            if (eof_) return false;
+            fill();
+        }
+    }
+
+    // Moves the unread bytes to the front and reads once after them. Returns
+    // whether anything was read.
+    bool fill() {
+        std::memmove(buf_.data(), buf_.data() + pos_, end_ - pos_);
+        end_ -= pos_;
+        pos_ = 0;
+        size_t got = source_(buf_.data() + end_, kBlock - end_);
+        if (got == 0) eof_ = true;
+        end_ += got;
+        std::memset(buf_.data() + end_, 0, kPad);
+        return got > 0;
+    }
+
+    Source source_;
+    std::vector<char> buf_;
+    size_t pos_ = 0;
+    size_t end_ = 0;
+    bool eof_ = false;
+};
+
+// Checks once what the unchecked interpreter takes on trust: every opcode is
+// a payload opcode, operands index existing locals, strings and functions,
+// calls match their callee's arity, jumps land on instruction boundaries and
+// no function can run off the end of its code. Calls are checked against
+// their callee's numParams only, so fn may be verified on its own.
+template <class Program, class Function>
+void verifyFunction(const Program& program, const Function& fn) {
+    const auto& functions = program.functions;
+    const int numFunctions = static_cast<int>(functions.size());
+    auto fail = [&fn](const std::string& what) {
+        throw std::runtime_error("Invalid bytecode in function " + fn.name + ": " + what);
+    };
+    const std::vector<int>& code = fn.code;
+    const int size = static_cast<int>(code.size());
+    if (fn.numParams < 0 || fn.numLocals < fn.numParams) fail("bad frame size");
+    std::vector<bool> starts(size + 1, false);
+    int last = -1;
+    for (int ip = 0; ip < size; ip += opLength(code[ip])) {
+        int op = code[ip];
+        if (op < 0 || op > OP_JMP_IF_TRUE) fail("unknown opcode " + std::to_string(op));
+        if (ip + opLength(op) > size) fail("truncated instruction");
+        starts[ip] = true;
+        last = op;
+        switch (op) {
+            case OP_LOAD:
+            case OP_STORE:
+                if (code[ip + 1] < 0 || code[ip + 1] >= fn.numLocals) fail("local out of range");
+                break;
+            case OP_PRINT_STR:
+                if (code[ip + 1] < 0 || code[ip + 1] >= static_cast<int>(program.strings.size())) {
+                    fail("string out of range");
+                }
+                break;
+            case OP_CALL:
+            case OP_SPAWN: {
+                int callee = code[ip + 1];
+                if (callee < 0 || callee >= numFunctions) fail("call target out of range");
+                if (code[ip + 2] != functions[callee].numParams) fail("call arity mismatch");
+                break;
+            }
+            case OP_CALL_NATIVE: {
+                int native = code[ip + 1];
+                if (native < 0 || native >= static_cast<int>(program.natives.size())) {
+                    fail("native out of range");
+                }
+                if (code[ip + 2] != program.natives[native].numParams) fail("native arity mismatch");
+                if (!program.natives[native].fn) fail("native " + program.natives[native].name + " is unbound");
+                break;
+            }
+            case OP_READ:
+                if (code[ip + 1] != kReadInt && code[ip + 1] != kReadEof) fail("bad read mode");
+                break;
+            case OP_TABLESWITCH:
+            case OP_LOOKUPSWITCH: {
+                const bool dense = op == OP_TABLESWITCH;
+                const int count = code[ip + opLength(op) - 1];
+                const int table = ip + opLength(op);
+                if (count < 1 || count > (size - table - 2) / 3) fail("bad switch table");
+                for (int i = 0; i < count; ++i) {
+                    const int entry = table + 3 * i;
+                    if (code[entry] != OP_CASE) fail("bad switch table");
+                    // Widened, so keys that would run past INT_MAX fail.
+                    if (dense && static_cast<long long>(code[ip + 1]) + i != code[entry + 1]) fail("bad switch table");
+                    if (!dense && i > 0 && code[entry + 1] <= code[entry - 2]) fail("switch keys out of order");
+                }
+                // Nothing may jump into the table, so its entries are not starts.
+                if (code[table + 3 * count] != OP_JMP) fail("switch table has no default");
+                ip = table + 3 * count;
+                last = OP_JMP;
+                break;
+            }
+            case OP_CASE:
+                fail("case outside a switch table");
+                break;
+            case OP_CMP_BR:
+                if (!isCompare(code[ip + 1])) fail("bad compare");
+                break;
+            default:
+                break;
+        }
+    }
+    if (last != OP_RET && last != OP_JMP) fail("code does not end in a return");
+    for (int ip = 0; ip < size; ip += opLength(code[ip])) {
+        if (int t = targetOperand(code[ip])) {
+            int target = code[ip + t];
+            if (target < 0 || target >= size || !starts[target]) fail("jump target out of range");
+        }
+    }
+}
+
+template <class Program>
+void verify(const Program& program) {
+    for (const auto& fn : program.functions) verifyFunction(program, fn);
+}
+
+// Value stack depth before each instruction of fn relative to its entry, or
+// -1 where the instruction is unreachable; maxDepth receives the deepest
+// point. Verified code has one depth per instruction however it is reached,
+// which is what lets stack slots be given fixed homes.
+template <class Function>
+std::vector<int> stackDepths(const Function& fn, int& maxDepth) {
+    const std::vector<int>& code = fn.code;
+    std::vector<int> depth(code.size(), -1);
+    std::vector<int> work = {0};
+    depth[0] = 0;
+    maxDepth = 0;
+    auto reach = [&](int ip, int d) {
+        if (depth[ip] < 0) {
+            depth[ip] = d;
+            work.push_back(ip);
+        } else if (depth[ip] != d) {
+            throw std::runtime_error("Inconsistent stack depth in function " + fn.name);
+        }
+    };
+    while (!work.empty()) {
+        int ip = work.back();
+        work.pop_back();
+        int d = depth[ip];
+        int op = code[ip];
+        int next = ip + opLength(op);
+        int after = d;
+        switch (op) {
+            case OP_PUSH_INT:
+            case OP_LOAD:
+            case OP_READ:
+                after = d + 1;
+                break;
+            case OP_CALL:
+            case OP_SPAWN:
+            case OP_CALL_NATIVE:
+                after = d - code[ip + 2] + 1;
+                break;
+            case OP_CMP_BR:
+                after = d - 2;
+                break;
+            case OP_PRINT_STR:
+            case OP_JOIN:
+            case OP_JMP:
+            case OP_CASE:
+            case OP_RET:
+                break;
+            default:
+                after = d - 1;
+                break;
+        }
+        if (after < 0) throw std::runtime_error("Stack underflow in function " + fn.name);
+        maxDepth = std::max(maxDepth, std::max(d, after));
+        if (op == OP_JMP) {
+            reach(code[ip + 1], after);
+        } else if (op != OP_RET) {
+            // Table entries are treated as branches that may fall through,
+            // which reaches every target of the switch at its depth.
+            if (int t = targetOperand(op)) reach(code[ip + t], after);
+            if (next < static_cast<int>(code.size())) reach(next, after);
+        }
+    }
+    return depth;
+}
+
+// A verified program's code laid out for execution: every function in one
+// segment, each directly followed by the functions it calls first, with
+// absolute jump targets and CALL operands pointing at the callee's first
+// instruction. A function is preceded by a two-slot header, [function index,
+// numLocals], which is all a call needs to read. SPAWN operands stay function
+// indices. Per-function metadata lives in parallel arrays; names, strings and
+// natives stay in the program, which must outlive the image.
+//
+// A lazy image starts empty and decodes each function on its first call, so
+// loading costs what a run uses rather than what the program holds. Functions
+// are appended in the order they are first called, and a CALL whose callee was
+// not loaded yet when its caller was keeps the callee as ~index, resolved on
+// every execution through resolve(). Published code is never rewritten, so
+// workers can run it while others load more.
+template <class Program>
+struct Image {
+    static const int kHeader = 2;
+
+    // Fills in program.functions[f]'s name and code. Called at most once per
+    // function, under the image's lock.
+    using Decoder = std::function<void(int)>;
+
+    // Throws std::runtime_error if the program fails verify().
+    explicit Image(const Program& p) : program(p) {
+        verify(p);
+        const auto& functions = p.functions;
+        const int n = static_cast<int>(functions.size());
+        init();
+        order.reserve(n);
+
+        // Depth-first from main over call sites in code order, then anything
+        // main cannot reach.
+        std::vector<char> placed(n, 0);
+        std::vector<int> pending;
+        auto place = [&](int root) {
+            pending.push_back(root);
+            while (!pending.empty()) {
+                int f = pending.back();
+                pending.pop_back();
+                if (placed[f]) continue;
+                placed[f] = 1;
+                order.push_back(f);
+                const std::vector<int>& fc = functions[f].code;
+                size_t mark = pending.size();
+                for (size_t ip = 0; ip < fc.size(); ip += opLength(fc[ip])) {
+                    if ((fc[ip] == OP_CALL || fc[ip] == OP_SPAWN) && !placed[fc[ip + 1]]) pending.push_back(fc[ip + 1]);
+                }
+                std::reverse(pending.begin() + mark, pending.end());
+            }
+        };
+        for (int f = 0; f < n; ++f) {
+            if (functions[f].name == "main") place(f);
+        }
+        for (int f = 0; f < n; ++f) place(f);
+
+        for (int f : order) {
+            code.push_back(f);
+            code.push_back(functions[f].numLocals);
+            entry[f] = static_cast<int>(code.size());
+            code.insert(code.end(), functions[f].code.begin(), functions[f].code.end());
+        }
+        for (int f = 0; f < n; ++f) relocate(f);
+        end = static_cast<int>(code.size());
+    }
+
+    // A lazy image of p, whose functions need only numParams and numLocals
+    // until decode fills them in. codeSize is the total length of their code.
+    Image(const Program& p, size_t codeSize, Decoder decode) : program(p), decode_(std::move(decode)) {
+        init();
+        const size_t size = codeSize + kHeader * p.functions.size();
+        if (size > static_cast<size_t>(INT32_MAX)) throw std::runtime_error("Program too large");
+        code.reserve(size);
+        end = static_cast<int>(size);
+        loaded_ = std::make_unique<std::atomic<int>[]>(p.functions.size());
+    }
+
+    // Entry of function f, decoding it first in a lazy image that has not run
+    // it yet. Safe to call from any worker.
+    int resolve(int f) const {
+        if (!decode_) return entry[f];
+        int e = loaded_[f].load(std::memory_order_acquire);
+        return e != 0 ? e : load(f);
+    }
+
+    const Program& program;
+    std::vector<int> code;
+    // Positions below end may be addressed by ip; in a lazy image they
+    // include space reserved for functions not loaded yet.
+    int end = 0;
+    // Entry points are 0 for functions a lazy image has not loaded.
+    std::vector<int> entry;
+    std::vector<int> numParams;
+    std::vector<int> numLocals;
+    // Function indices in layout order.
+    std::vector<int> order;
+
+private:
+    void init() {
+        const size_t n = program.functions.size();
+        entry.assign(n, 0);
+        numParams.resize(n);
+        numLocals.resize(n);
+        for (size_t f = 0; f < n; ++f) {
+            numParams[f] = program.functions[f].numParams;
+            numLocals[f] = program.functions[f].numLocals;
+        }
+    }
+
+    // Makes f's jump targets absolute and points its calls at their callees.
+    void relocate(int f) {
+        const int base = entry[f];
+        const int size = static_cast<int>(program.functions[f].code.size());
+        for (int ip = base; ip < base + size; ip += opLength(code[ip])) {
+            if (int t = targetOperand(code[ip])) code[ip + t] += base;
+            if (code[ip] == OP_CALL) code[ip + 1] = entry[code[ip + 1]] != 0 ? entry[code[ip + 1]] : ~code[ip + 1];
+        }
+    }
+
+    // Appends f to a lazy image. The reserved capacity is never exceeded, so
+    // code.data() stays put while other workers run.
+    int load(int f) const {
+        std::lock_guard<std::mutex> lock(loadMutex_);
+        int e = loaded_[f].load(std::memory_order_relaxed);
+        if (e != 0) return e;
+        // Images are never created const; resolve() is const so that running
+        // code can load through the const references the interpreters hold.
+        Image& self = const_cast<Image&>(*this);
+        decode_(f);
+        const auto& fn = program.functions[f];
+        if (fn.numParams != numParams[f] || fn.numLocals != numLocals[f]) {
+            throw std::runtime_error("Decoded function " + fn.name + " does not match its index entry");
+        }
+        verifyFunction(program, fn);
+        if (code.size() + kHeader + fn.code.size() > code.capacity()) {
+            throw std::runtime_error("Function " + fn.name + " is larger than its index entry");
+        }
+        self.code.push_back(f);
+        self.code.push_back(fn.numLocals);
+        e = static_cast<int>(code.size());
+        self.entry[f] = e;
+        self.order.push_back(f);
+        self.code.insert(code.end(), fn.code.begin(), fn.code.end());
+        self.relocate(f);
+        loaded_[f].store(e, std::memory_order_release);
+        return e;
+    }
+
+    Decoder decode_;
+    std::unique_ptr<std::atomic<int>[]> loaded_;
+    mutable std::mutex loadMutex_;
+};
+
+// ip is a position in the image's code segment.
+struct Frame {
+    int funcIndex;
+    int ip;
+    std::vector<int> locals;
+};
+
+// A call started by spawn(). S code refers to it by its index in Scheduler::tasks_.
+struct Task {
+    int funcIndex = 0;
+    std::vector<int> args;
+    std::atomic<bool> done{false};
+    int result = 0;
+    std::exception_ptr error;
+};
+
+// Function indices of the active frames, outermost first, for the sampling
+// profiler. Only the owning thread writes it; the release store of depth
+// publishes each frame, so a signal handler interrupting that thread always
+// sees a consistent stack.
+struct ShadowStack {
+    static constexpr int kMaxFrames = 128;
+    std::atomic<int> depth{0};
+    int frames[kMaxFrames];
+
+    void push(int funcIndex) {
+        int d = depth.load(std::memory_order_relaxed);
+        if (d < kMaxFrames) frames[d] = funcIndex;
+        depth.store(d + 1, std::memory_order_release);
+    }
+
+    void pop() {
+        depth.store(depth.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+    }
+};
+
+// The shadow stack of the call this thread is interpreting, if sampled.
+inline thread_local ShadowStack* currentShadow = nullptr;
+
+struct ShadowScope {
+    explicit ShadowScope(ShadowStack* s) : saved(currentShadow) { currentShadow = s; }
+    ~ShadowScope() { currentShadow = saved; }
+    ShadowStack* saved;
+};
+
+// Each worker owns its value and frame stacks. Tasks run while joining reuse
+// them above the current depth, so nested runs never allocate new stacks.
+struct Worker {
+    int id = 0;
+    std::vector<int> stack;
+    std::vector<Frame> callStack;
+    ShadowStack shadow;
+    // Filled by Count policies, parallel to the image's code segment: a
+    // conditional branch's opcode slot counts jumps taken and the slot after
+    // it falls through; a CALL's or CALL_NATIVE's opcode slot counts calls.
+    std::vector<uint64_t> counts;
+    // Instructions run on this worker under Tally policies.
+    uint64_t executed = 0;
+    std::deque<Task*> queue;
+    std::mutex queueMutex;
+};
+
+// The innermost running call. Frames of its callers live in Worker::callStack
+// above baseDepth; everything needed to resume a suspended run is here. ip is
+// a position in the image's code segment.
+struct Registers {
+    int funcIndex = 0;
+    int ip = 0;
+    std::vector<int> locals;
+    size_t baseDepth = 0;
+    int shadowDepth = 0;
+};
+
+// A context's private, rewritable copy of the image's code segment. Only the
+// context's own calls use it; spawned tasks run the shared image.
+struct QuickenState {
+    template <class Program>
+    explicit QuickenState(const Image<Program>& image) : code(image.code), targets(image.code.size(), 0) {
+        for (int f : image.order) {
+            const int base = image.entry[f];
+            const int size = static_cast<int>(image.program.functions[f].code.size());
+            for (int ip = base; ip < base + size; ip += opLength(code[ip])) {
+                if (int t = targetOperand(code[ip])) targets[code[ip + t]] = 1;
+            }
+        }
+    }
+
+    std::vector<int> code;
+    // Slots some jump lands on. Fusing never overwrites one, so a hand-built
+    // program that branches into the middle of a sequence still decodes.
+    std::vector<char> targets;
+    uint64_t sites = 0;
+};
+
+// Work-stealing pool: owners push and pop at the back of their own queue,
+// idle workers steal from the front of someone else's. Threads are only
+// started by the first spawn, so sequential programs never pay for them.
+// A scheduler is one VM instance: programs running side by side each get
+// their own, along with their own output callback. Tasks run through
+// `runner`, which picks the interpreter variant they use.
+template <class Program>
+class Scheduler {
+public:
+    using Runner = int (*)(const Image<Program>&, int, const std::vector<int>&, Worker&, Scheduler&);
+
+    Scheduler(const Image<Program>& image, int numThreads, Runner runner) : image_(image), runner_(runner) {
+        numThreads = std::max(1, numThreads);
+        for (int i = 0; i < numThreads; ++i) {
+            workers_.push_back(std::make_unique<Worker>());
+            workers_.back()->id = i;
+        }
+    }
+
+    ~Scheduler() {
+        {
+            std::lock_guard<std::mutex> lock(idleMutex_);
+            stop_ = true;
+        }
+        idleCv_.notify_all();
+        for (auto& t : threads_) t.join();
+    }
+
+    Worker& mainWorker() { return *workers_[0]; }
+    size_t numWorkers() const { return workers_.size(); }
+    Worker& worker(size_t i) { return *workers_[i]; }
+
+    void setOutput(std::function<void(const std::string&)> out) { out_ = std::move(out); }
+
+    // Only call while no tasks are running.
+    void setRunner(Runner runner) { runner_ = runner; }
+
+    void print(const std::string& line) {
+        std::lock_guard<std::mutex> lock(outputMutex_);
+        if (out_) out_(line);
+        else std::cout << line << "\n";
+    }
+
+    // Where read() takes integers from; stdin until set. Only call while no
+    // tasks are running.
+    void setInput(IntReader::Source source) { in_ = std::make_unique<IntReader>(std::move(source)); }
+
+    // OP_READ. The lock is only taken once worker threads exist.
+    int read(int mode) {
+        std::unique_lock<std::mutex> lock(inputMutex_, std::defer_lock);
+        if (threaded_.load(std::memory_order_relaxed)) lock.lock();
+        if (!in_) in_ = std::make_unique<IntReader>([](char* buf, size_t size) { return fread(buf, 1, size, stdin); });
+        if (mode == kReadEof) return in_->atEnd() ? 1 : 0;
+        int value = 0;
+        if (!in_->next(value)) throw std::runtime_error("read() past the end of the input");
+        return value;
+    }
+
+    int spawn(Worker& self, int funcIndex, std::vector<int> args) {
+        std::call_once(started_, [this] {
+            threaded_.store(workers_.size() > 1, std::memory_order_relaxed);
+            for (size_t i = 1; i < workers_.size(); ++i) {
+                Worker* w = workers_[i].get();
+                threads_.emplace_back([this, w] { workerLoop(*w); });
+            }
+        });
+
+        Task* task;
+        int handle;
+        {
+            std::lock_guard<std::mutex> lock(tasksMutex_);
+            handle = static_cast<int>(tasks_.size());
+            tasks_.emplace_back();
+            task = &tasks_.back();
+        }
+        task->funcIndex = funcIndex;
+        task->args = std::move(args);
+        {
+            std::lock_guard<std::mutex> lock(self.queueMutex);
+            self.queue.push_back(task);
+        }
+        {
+            std::lock_guard<std::mutex> lock(idleMutex_);
+            pending_++;
+        }
+        idleCv_.notify_one();
+        return handle;
+    }
+
+    // Runs whatever is still queued, waits for running tasks and forgets all
+    // handles, so a reused VM starts every call with an empty task table.
+    void finish(Worker& self) {
+        while (true) {
+            if (Task* task = findTask(self)) {
+                runTask(self, *task);
+                continue;
+            }
+            bool allDone = true;
+            {
+                std::lock_guard<std::mutex> lock(tasksMutex_);
+                for (const auto& task : tasks_) {
+                    if (!task.done.load(std::memory_order_acquire)) allDone = false;
+                }
+                if (allDone) tasks_.clear();
+            }
+            if (allDone) return;
+            std::this_thread::yield();
+        }
+    }
+
+    int join(Worker& self, int handle) {
+        Task* task;
+        {
+            std::lock_guard<std::mutex> lock(tasksMutex_);
+            if (handle < 0 || handle >= static_cast<int>(tasks_.size())) {
+                throw std::runtime_error("Invalid task handle");
+            }
+            task = &tasks_[handle];
+        }
+        // Help instead of blocking: run queued work until the task finishes.
+        while (!task->done.load(std::memory_order_acquire)) {
+            if (Task* other = findTask(self)) {
+                runTask(self, *other);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        if (task->error) std::rethrow_exception(task->error);
+        return task->result;
+    }
+
+private:
+    void workerLoop(Worker& self) {
+        while (true) {
+            if (Task* task = findTask(self)) {
+                runTask(self, *task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idleMutex_);
+            idleCv_.wait(lock, [this] { return stop_ || pending_ > 0; });
+            if (stop_) return;
+        }
+    }
+
+    Task* findTask(Worker& self) {
+        {
+            std::lock_guard<std::mutex> lock(self.queueMutex);
+            if (!self.queue.empty()) {
+                Task* task = self.queue.back();
+                self.queue.pop_back();
+                pending_--;
+                return task;
+            }
+        }
+        for (size_t i = 1; i < workers_.size(); ++i) {
+            Worker& victim = *workers_[(self.id + i) % workers_.size()];
+            std::lock_guard<std::mutex> lock(victim.queueMutex);
+            if (!victim.queue.empty()) {
+                Task* task = victim.queue.front();
+                victim.queue.pop_front();
+                pending_--;
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    void runTask(Worker& self, Task& task) {
+        size_t stackDepth = self.stack.size();
+        size_t callDepth = self.callStack.size();
+        int shadowDepth = self.shadow.depth.load(std::memory_order_relaxed);
+        try {
+            task.result = runner_(image_, task.funcIndex, task.args, self, *this);
+        } catch (...) {
+            self.stack.resize(stackDepth);
+            self.callStack.erase(self.callStack.begin() + callDepth, self.callStack.end());
+            self.shadow.depth.store(shadowDepth, std::memory_order_release);
+            task.error = std::current_exception();
+        }
+        task.done.store(true, std::memory_order_release);
+    }
+
+    const Image<Program>& image_;
+    Runner runner_;
+    std::function<void(const std::string&)> out_;
+    std::mutex outputMutex_;
+    std::unique_ptr<IntReader> in_;
+    std::mutex inputMutex_;
+    std::atomic<bool> threaded_{false};
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::once_flag started_;
+    std::deque<Task> tasks_;
+    std::mutex tasksMutex_;
+    std::mutex idleMutex_;
+    std::condition_variable idleCv_;
+    std::atomic<int> pending_{0};
+    bool stop_ = false;
+};
+
+// Output sinks decide where print() goes.
+// SchedulerSink: the scheduler's output callback, or stdout.
+struct SchedulerSink {
+    template <class Sched>
+    static void write(Sched& sched, const std::string& line) { sched.print(line); }
+};
+
+// StdoutSink: straight to std::cout, one line at a time.
+struct StdoutSink {
+    template <class Sched>
+    static void write(Sched&, const std::string& line) {
+        static std::mutex mutex;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::cout << line << "\n";
+    }
+};
+
+// NullSink: discards output (benchmarks).
+struct NullSink {
+    template <class Sched>
+    static void write(Sched&, const std::string&) {}
+};
+
+// Compile-time interpreter configuration.
+//   Checked  bounds-check the instruction pointer, locals and string indices and
+//            re-check call arity on every call; without it the code must have
+//            passed verify(). Division by zero is always an error.
+//   Metered  each instruction costs one unit of fuel; at zero the run suspends.
+//   Quicken  run from QuickenState::code and rewrite instructions into
+//            specialized forms right after their first generic execution.
+//   Profile  keep the worker's shadow stack current for SIGPROF samples.
+//   Trace    write every instruction and the top of stack to std::cerr.
+//   Count    add branch outcomes and calls to Worker::counts, which must be
+//            sized for the program.
+//   Tally    add every instruction run to Worker::executed.
+template <bool Checked, bool Metered = false, bool Quicken = false, bool Profile = false, bool Trace = false,
+          class Sink = SchedulerSink, bool Count = false, bool Tally = false>
+struct Policy {
+    static constexpr bool kChecked = Checked;
+    static constexpr bool kMetered = Metered;
+    static constexpr bool kQuicken = Quicken;
+    static constexpr bool kProfile = Profile;
+    static constexpr bool kTrace = Trace;
+    static constexpr bool kCount = Count;
+    static constexpr bool kTally = Tally;
+    using OutputSink = Sink;
+};
+
+// Sets up registers for a call to entryFunc on top of the worker's stacks.
+template <class Program>
+Registers enter(const Image<Program>& image, int entryFunc, const std::vector<int>& args, Worker& worker) {
+    Registers regs;
+    regs.funcIndex = entryFunc;
+    regs.ip = image.resolve(entryFunc);
+    regs.locals.assign(image.numLocals[entryFunc], 0);
+    std::copy(args.begin(), args.end(), regs.locals.begin());
+    regs.baseDepth = worker.callStack.size();
+    regs.shadowDepth = worker.shadow.depth.load(std::memory_order_relaxed);
+    worker.shadow.push(entryFunc);
+    return regs;
+}
+
+// Prints positions, jump targets and callees as in the Program code rather
+// than as laid out in the image.
+template <class Program>
+void traceStep(const Image<Program>& image, int funcIndex, int ip, const int* code, const std::vector<int>& stack) {
+    int op = code[ip];
+    const int base = image.entry[funcIndex];
+    std::cerr << image.program.functions[funcIndex].name << "@" << ip - base << " " << opName(op);
+    for (int i = 1; i < opLength(op); ++i) {
+        int operand = code[ip + i];
+        bool target = op == OP_JMP || isBranch(op) || op == OP_LOAD_CONST_CMP_BR || op == OP_LOAD_LOAD_CMP_BR;
+        if (target && i == opLength(op) - 1) operand -= base;
+        if (i == 1 && (op == OP_CALL || op == OP_CALL_FAST)) {
+            operand = operand < 0 ? ~operand : code[operand - Image<Program>::kHeader];
+        }
+        std::cerr << " " << operand;
+    }
+    if (!stack.empty()) std::cerr << "  [top " << stack.back() << "]";
+    std::cerr << "\n";
+}
+
+// Runs until the entry call returns, storing its value in result and
+// returning true. A Metered run that exhausts its fuel saves the current
+// position in regs and returns false; calling again continues from there.
+// quick is only used when P::kQuicken.
+template <class P, class Program>
+bool interpret(const Image<Program>& image, Registers& regs, Worker& worker, Scheduler<Program>& sched,
+               uint64_t& fuel, int& result, QuickenState* quick) {
+    const Program& program = image.program;
+    const auto& strings = program.strings;
+    const int* const code = P::kQuicken ? quick->code.data() : image.code.data();
+    const int codeSize = image.end;
+    std::vector<int>& stack = worker.stack;
+    std::vector<Frame>& callStack = worker.callStack;
+    const size_t baseDepth = regs.baseDepth;
+
+    int funcIndex = regs.funcIndex;
+    int ip = regs.ip;
+    std::vector<int>& locals = regs.locals;
+    ShadowScope shadowScope(P::kProfile ? &worker.shadow : currentShadow);
+
+    auto pop = [&]() {
+        int v = stack.back();
+        stack.pop_back();
+        return v;
+    };
+
+    auto local = [&](int idx) -> int& {
+        if constexpr (P::kChecked) return locals.at(idx);
+        else return locals[idx];
+    };
+
+    // pos is the slot of a compare that just ran. The compiler fuses the
+    // compares that end a condition itself; if a hand-built program has a
+    // branch follow one, fuse the pair the same way and, since the branch slot
+    // now holds the compare kind, take the branch here.
+    auto quickenCompare = [&](int pos) {
+        std::vector<int>& code = quick->code;
+        if (code[pos + 1] != OP_JMP_IF_FALSE || quick->targets[pos + 1]) return;
+        code[pos + 1] = code[pos];
+        code[pos] = OP_CMP_BR;
+        quick->sites++;
+        int cond = pop();
+        ip = cond != 0 ? pos + 3 : code[pos + 2];
+    };
+
+    // pos is the slot of a LOAD that just ran. If a compare-and-branch
+    // follows, fuse the sequence and finish it here in fused form, because the
+    // rewrite overwrites the next opcode slot.
+    auto quickenLoad = [&](int pos) {
+        std::vector<int>& code = quick->code;
+        int second = code[pos + 2];
+        if ((second != OP_PUSH_INT && second != OP_LOAD) || code[pos + 4] != OP_CMP_BR) return;
+        if (quick->targets[pos + 2] || quick->targets[pos + 4]) return;
+        if (second == OP_LOAD) {
+            int y = code[pos + 3];
+            if (y < 0 || y >= static_cast<int>(locals.size())) return;
+        }
+        code[pos + 2] = code[pos + 5];
+        code[pos] = second == OP_PUSH_INT ? OP_LOAD_CONST_CMP_BR : OP_LOAD_LOAD_CMP_BR;
+        quick->sites++;
+        int a = pop();
+        int b = second == OP_PUSH_INT ? code[pos + 3] : locals[code[pos + 3]];
+        ip = compare(code[pos + 2], a, b) ? pos + 7 : code[pos + 6];
+    };
+
+    // target is the callee's entry; its header sits just before it.
+    auto pushFrame = [&](int target, int argCount) {
+        int callee = code[target - 2];
+        std::vector<int> newLocals(code[target - 1], 0);
+        for (int i = argCount - 1; i >= 0; --i) {
+            newLocals[i] = pop();
+        }
+        if constexpr (P::kProfile) worker.shadow.push(callee);
+        callStack.push_back({funcIndex, ip, locals});
+        funcIndex = callee;
+        ip = target;
+        locals.swap(newLocals);
+    };
+
+    while (true) {
+        if constexpr (P::kMetered) {
+            if (fuel == 0) {
+                regs.funcIndex = funcIndex;
+                regs.ip = ip;
+                return false;
+            }
+            fuel--;
+        }
+        if constexpr (P::kChecked) {
+            if (ip >= codeSize) {
+                throw std::runtime_error("Instruction pointer out of range in function " +
+                                         program.functions[funcIndex].name);
+            }
+        }
+        if constexpr (P::kTrace) traceStep(image, funcIndex, ip, code, stack);
+        if constexpr (P::kTally) worker.executed++;
+        int op = code[ip++];
+        switch (op) {
+            case OP_PUSH_INT:
+                stack.push_back(code[ip++]);
+                if constexpr (P::kQuicken) {
+                    if (code[ip - 1] != 0 && code[ip - 1] != -1 && code[ip] == OP_DIV) {
+                        quick->code[ip - 2] = OP_DIV_CONST;
+                        quick->sites++;
+                    }
+                }
+                break;
+            case OP_LOAD:
+                stack.push_back(local(code[ip++]));
+                if constexpr (P::kQuicken) quickenLoad(ip - 2);
+                break;
+            case OP_STORE: {
+                int idx = code[ip++];
+                local(idx) = pop();
+                break;
+            }
+            case OP_ADD: { int b = pop(), a = pop(); stack.push_back(add(a, b)); break; }
+            case OP_SUB: { int b = pop(), a = pop(); stack.push_back(subtract(a, b)); break; }
+            case OP_MUL: { int b = pop(), a = pop(); stack.push_back(multiply(a, b)); break; }
+            case OP_DIV: {
+                int b = pop(), a = pop();
+                stack.push_back(divide(a, b));
+                break;
+            }
+            case OP_EQ: {
+                int b = pop(), a = pop();
+                stack.push_back(a == b ? 1 : 0);
+                if constexpr (P::kQuicken) quickenCompare(ip - 1);
+                break;
+            }
+            case OP_NE: {
+                int b = pop(), a = pop();
+                stack.push_back(a != b ? 1 : 0);
+                if constexpr (P::kQuicken) quickenCompare(ip - 1);
+                break;
+            }
+            case OP_LT: {
+                int b = pop(), a = pop();
+                stack.push_back(a < b ? 1 : 0);
+                if constexpr (P::kQuicken) quickenCompare(ip - 1);
+                break;
+            }
+            case OP_LE: {
+                int b = pop(), a = pop();
+                stack.push_back(a <= b ? 1 : 0);
+                if constexpr (P::kQuicken) quickenCompare(ip - 1);
+                break;
+            }
+            case OP_GT: {
+                int b = pop(), a = pop();
+                stack.push_back(a > b ? 1 : 0);
+                if constexpr (P::kQuicken) quickenCompare(ip - 1);
+                break;
+            }
+            case OP_GE: {
+                int b = pop(), a = pop();
+                stack.push_back(a >= b ? 1 : 0);
+                if constexpr (P::kQuicken) quickenCompare(ip - 1);
+                break;
+            }
+            case OP_JMP: ip = code[ip]; break;
+            case OP_JMP_IF_FALSE: {
+                int target = code[ip++];
+                int cond = pop();
+                if constexpr (P::kCount) worker.counts[ip - (cond == 0 ? 2 : 1)]++;
+                if (cond == 0) ip = target;
+                break;
+            }
+            case OP_JMP_IF_TRUE: {
+                int target = code[ip++];
+                int cond = pop();
+                if constexpr (P::kCount) worker.counts[ip - (cond != 0 ? 2 : 1)]++;
+                if (cond != 0) ip = target;
+                break;
+            }
+            case OP_CMP_BR: {
+                int b = pop(), a = pop();
+                bool holds = compare(code[ip], a, b);
+                if constexpr (P::kCount) worker.counts[ip - (holds ? 0 : 1)]++;
+                ip = holds ? ip + 2 : code[ip + 1];
+                break;
+            }
+            case OP_TABLESWITCH:
+            case OP_LOOKUPSWITCH: ip = switchTarget(op, code + ip, pop()); break;
+            case OP_CALL: {
+                int target = code[ip++];
+                int argCount = code[ip++];
+                if (target < 0) target = image.resolve(~target);
+                if constexpr (P::kChecked) {
+                    if (argCount != image.numParams[code[target - 2]]) throw std::runtime_error("Call arity mismatch");
+                }
+                if constexpr (P::kCount) worker.counts[ip - 3]++;
+                if constexpr (P::kQuicken) {
+                    quick->code[ip - 3] = OP_CALL_FAST;
+                    quick->code[ip - 2] = target;
+                    quick->sites++;
+                }
+                pushFrame(target, argCount);
+                break;
+            }
+            case OP_RET: {
+                int ret = pop();
+                if (callStack.size() == baseDepth) {
+                    worker.shadow.depth.store(regs.shadowDepth, std::memory_order_release);
+                    result = ret;
+                    return true;
+                }
+                if constexpr (P::kProfile) worker.shadow.pop();
+                Frame fr = std::move(callStack.back());
+                callStack.pop_back();
+                funcIndex = fr.funcIndex;
+                ip = fr.ip;
+                locals.swap(fr.locals);
+                stack.push_back(ret);
+                break;
+            }
+            case OP_PRINT: {
+                int v = pop();
+                P::OutputSink::write(sched, std::to_string(v));
+                break;
+            }
+            case OP_PRINT_STR: {
+                int idx = code[ip++];
+                if constexpr (P::kChecked) {
+                    if (idx < 0 || idx >= static_cast<int>(strings.size())) {
+                        throw std::runtime_error("String index out of range");
+                    }
+                }
+                P::OutputSink::write(sched, strings[idx]);
+                break;
+            }
+            case OP_POP: {
+                pop();
+                break;
+            }
+            case OP_SPAWN: {
+                int callee = code[ip++];
+                int argCount = code[ip++];
+                if constexpr (P::kChecked) {
+                    if (argCount != image.numParams[callee]) throw std::runtime_error("Spawn arity mismatch");
+                }
+                std::vector<int> taskArgs(argCount);
+                for (int i = argCount - 1; i >= 0; --i) {
+                    taskArgs[i] = pop();
+                }
+                stack.push_back(sched.spawn(worker, callee, std::move(taskArgs)));
+                break;
+            }
+            case OP_JOIN: {
+                int handle = pop();
+                stack.push_back(sched.join(worker, handle));
+                break;
+            }
+            case OP_READ:
+                stack.push_back(sched.read(code[ip++]));
+                break;
+            case OP_CALL_NATIVE: {
+                const auto& native = program.natives[code[ip]];
+                int argCount = code[ip + 1];
+                ip += 2;
+                if constexpr (P::kChecked) {
+                    if (argCount != native.numParams) throw std::runtime_error("Native arity mismatch");
+                }
+                if constexpr (P::kCount) worker.counts[ip - 3]++;
+                size_t base = stack.size() - argCount;
+                int r = native.fn(stack.data() + base);
+                stack.resize(base);
+                stack.push_back(r);
+                break;
+            }
+            case OP_CALL_FAST: {
+                int target = code[ip++];
+                int argCount = code[ip++];
+                pushFrame(target, argCount);
+                break;
+            }
+            case OP_DIV_CONST: {
+                int a = pop();
+                stack.push_back(a / code[ip]);
+                ip += 2;
+                break;
+            }
+            case OP_LOAD_CONST_CMP_BR: {
+                int a = locals[code[ip]];
+                ip = compare(code[ip + 1], a, code[ip + 2]) ? ip + 6 : code[ip + 5];
+                break;
+            }
+            case OP_LOAD_LOAD_CMP_BR: {
+                int a = locals[code[ip]];
+                int b = locals[code[ip + 2]];
+                ip = compare(code[ip + 1], a, b) ? ip + 6 : code[ip + 5];
+                break;
+            }
+            default:
+                throw std::runtime_error("Unknown opcode");
+        }
+    }
+}
+
+// interpret() with the top of the value stack held in a local, so binary
+// operators read one operand from memory and never push. Worker::stack holds
+// everything below the top; a push spills the old top first, even when the
+// run's own stack is still empty (that garbage slot is what the entry
+// function's first pop reloads), so every spill has a matching reload and no
+// path needs to know the depth. Runs to completion: Metered, Quicken, Trace and
+// Count are not supported.
+template <class P, class Program>
+int interpretCached(const Image<Program>& image, Registers& regs, Worker& worker, Scheduler<Program>& sched) {
+    static_assert(!P::kMetered && !P::kQuicken && !P::kTrace && !P::kCount,
+                  "interpretCached runs plain policies only");
+    const Program& program = image.program;
+    const auto& strings = program.strings;
+    const int* const code = image.code.data();
+    const int codeSize = image.end;
+    std::vector<int>& stack = worker.stack;
+    std::vector<Frame>& callStack = worker.callStack;
+    const size_t baseDepth = regs.baseDepth;
+    const size_t stackBase = stack.size();
+
+    int funcIndex = regs.funcIndex;
+    int ip = regs.ip;
+    std::vector<int>& locals = regs.locals;
+    ShadowScope shadowScope(P::kProfile ? &worker.shadow : currentShadow);
+    int tos = 0;
+
+    auto push = [&](int v) {
+        stack.push_back(tos);
+        tos = v;
+    };
+
+    // Drops the top, reloading the next value into tos.
+    auto drop = [&]() {
+        tos = stack.back();
+        stack.pop_back();
+    };
+
+    auto local = [&](int idx) -> int& {
+        if constexpr (P::kChecked) return locals.at(idx);
+        else return locals[idx];
+    };
+
+    // Moves the top argCount values into a vector of size n and drops them.
+    auto takeArgs = [&](int argCount, size_t n) {
+        std::vector<int> args(n, 0);
+        if (argCount > 0) {
+            args[argCount - 1] = tos;
+            for (int i = argCount - 2; i >= 0; --i) {
+                args[i] = stack.back();
+                stack.pop_back();
+            }
+            drop();
+        }
+        return args;
+    };
+
+    while (true) {
+        if constexpr (P::kChecked) {
+            if (ip >= codeSize) {
+                throw std::runtime_error("Instruction pointer out of range in function " +
+                                         program.functions[funcIndex].name);
+            }
+        }
+        if constexpr (P::kTally) worker.executed++;
+        int op = code[ip++];
+        switch (op) {
+            case OP_PUSH_INT: push(code[ip++]); break;
+            case OP_LOAD: push(local(code[ip++])); break;
+            case OP_STORE:
+                local(code[ip++]) = tos;
+                drop();
+                break;
+            case OP_ADD: tos = add(stack.back(), tos); stack.pop_back(); break;
+            case OP_SUB: tos = subtract(stack.back(), tos); stack.pop_back(); break;
+            case OP_MUL: tos = multiply(stack.back(), tos); stack.pop_back(); break;
+            case OP_DIV:
+                tos = divide(stack.back(), tos);
+                stack.pop_back();
+                break;
+            case OP_EQ: tos = stack.back() == tos; stack.pop_back(); break;
+            case OP_NE: tos = stack.back() != tos; stack.pop_back(); break;
+            case OP_LT: tos = stack.back() < tos; stack.pop_back(); break;
+            case OP_LE: tos = stack.back() <= tos; stack.pop_back(); break;
+            case OP_GT: tos = stack.back() > tos; stack.pop_back(); break;
+            case OP_GE: tos = stack.back() >= tos; stack.pop_back(); break;
+            case OP_JMP: ip = code[ip]; break;
+            case OP_JMP_IF_FALSE: {
+                int cond = tos;
+                drop();
+                ip = cond == 0 ? code[ip] : ip + 1;
+                break;
+            }
+            case OP_JMP_IF_TRUE: {
+                int cond = tos;
+                drop();
+                ip = cond != 0 ? code[ip] : ip + 1;
+                break;
+            }
+            case OP_CMP_BR: {
+                int b = tos, a = stack.back();
+                stack.pop_back();
+                drop();
+                ip = compare(code[ip], a, b) ? ip + 2 : code[ip + 1];
+                break;
+            }
+            case OP_TABLESWITCH:
+            case OP_LOOKUPSWITCH: {
+                int v = tos;
+                drop();
+                ip = switchTarget(op, code + ip, v);
+                break;
+            }
+            case OP_CALL: {
+                int target = code[ip++];
+                int argCount = code[ip++];
+                if (target < 0) target = image.resolve(~target);
+                int callee = code[target - 2];
+                if constexpr (P::kChecked) {
+                    if (argCount != image.numParams[callee]) throw std::runtime_error("Call arity mismatch");
+                }
+                std::vector<int> newLocals = takeArgs(argCount, code[target - 1]);
+                if constexpr (P::kProfile) worker.shadow.push(callee);
+                callStack.push_back({funcIndex, ip, locals});
+                funcIndex = callee;
+                ip = target;
+                locals.swap(newLocals);
+                break;
+            }
+            case OP_RET: {
+                // The caller's stack below the callee's values already holds
+                // the caller's spilled top, so the return value simply stays
+                // in tos.
+                if (callStack.size() == baseDepth) {
+                    worker.shadow.depth.store(regs.shadowDepth, std::memory_order_release);
+                    stack.resize(stackBase);
+                    return tos;
+                }
+                if constexpr (P::kProfile) worker.shadow.pop();
+                Frame fr = std::move(callStack.back());
+                callStack.pop_back();
+                funcIndex = fr.funcIndex;
+                ip = fr.ip;
+                locals.swap(fr.locals);
+                break;
+            }
+            case OP_PRINT:
+                P::OutputSink::write(sched, std::to_string(tos));
+                drop();
+                break;
+            case OP_PRINT_STR: {
+                int idx = code[ip++];
+                if constexpr (P::kChecked) {
+                    if (idx < 0 || idx >= static_cast<int>(strings.size())) {
+                        throw std::runtime_error("String index out of range");
+                    }
+                }
+                P::OutputSink::write(sched, strings[idx]);
+                break;
+            }
+            case OP_POP: drop(); break;
+            case OP_SPAWN: {
+                int callee = code[ip++];
+                int argCount = code[ip++];
+                if constexpr (P::kChecked) {
+                    if (argCount != image.numParams[callee]) throw std::runtime_error("Spawn arity mismatch");
+                }
+                std::vector<int> taskArgs = takeArgs(argCount, argCount);
+                push(sched.spawn(worker, callee, std::move(taskArgs)));
+                break;
+            }
+            case OP_JOIN: tos = sched.join(worker, tos); break;
+            case OP_READ: push(sched.read(code[ip++])); break;
+            case OP_CALL_NATIVE: {
+                const auto& native = program.natives[code[ip]];
+                int argCount = code[ip + 1];
+                ip += 2;
+                if constexpr (P::kChecked) {
+                    if (argCount != native.numParams) throw std::runtime_error("Native arity mismatch");
+                }
+                // Spill the top so the arguments are contiguous in memory.
+                stack.push_back(tos);
+                size_t base = stack.size() - argCount;
+                int r = native.fn(stack.data() + base);
+                stack.resize(base);
+                tos = r;
+                break;
+            }
+            default:
+                throw std::runtime_error("Unknown opcode");
+        }
+    }
+}
+
+// Runs entryFunc to completion on the worker's stacks.
+template <class P, class Program>
+int execute(const Image<Program>& image, int entryFunc, const std::vector<int>& args, Worker& worker,
+            Scheduler<Program>& sched) {
+    Registers regs = enter(image, entryFunc, args, worker);
+    uint64_t fuel = 0;
+    int result = 0;
+    interpret<P>(image, regs, worker, sched, fuel, result, nullptr);
+    return result;
+}
+
+// Runs entryFunc to completion with the top of stack cached (see interpretCached).
+template <class P, class Program>
+int executeCached(const Image<Program>& image, int entryFunc, const std::vector<int>& args, Worker& worker,
+                  Scheduler<Program>& sched) {
+    Registers regs = enter(image, entryFunc, args, worker);
+    return interpretCached<P>(image, regs, worker, sched);
+}
+
+} // namespace svm
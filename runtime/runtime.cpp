@@ -1,37 +1,17 @@
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <string>
-#include <utility>
+#include <thread>
 #include <vector>
 #include <windows.h>
+#include "../compiler/src/vm_core.h"
 
 using namespace std;
 
-enum Op {
-    OP_PUSH_INT,
-    OP_LOAD,
-    OP_STORE,
-    OP_ADD,
-    OP_SUB,
-    OP_MUL,
-    OP_DIV,
-    OP_EQ,
-    OP_NE,
-    OP_LT,
-    OP_LE,
-    OP_GT,
-    OP_GE,
-    OP_JMP,
-    OP_JMP_IF_FALSE,
-    OP_CALL,
-    OP_RET,
-    OP_PRINT,
-    OP_PRINT_STR,
-    OP_POP
-};
-
 struct Function {
     string name;
     int numParams = 0;
@@ -39,132 +19,214 @@ struct Function {
     vector<int> code;
 };
 
-struct Frame {
-    int funcIndex;
-    int ip;
-    vector<int> locals;
+struct Native {
+    string name;
+    int numParams = 0;
+    int (*fn)(const int* args) = nullptr;
+};
+
+struct Program {
+    vector<Function> functions;
+    vector<string> strings;
+    vector<Native> natives;
 };
 
-static const uint32_t kVersion = 1;
+// The payload is verified once at load, so the interpreter skips per-instruction
+// checks; it also keeps the top of the value stack in a register.
+using RuntimePolicy = svm::Policy<false, false, false, false, false, svm::StdoutSink>;
+using Scheduler = svm::Scheduler<Program>;
+
+static const uint32_t kVersion = 4;
+
+// Payload header flags.
+static const uint32_t kCompressed = 1;
+
+// Must match compressPayload in the compiler.
+static const size_t kHeaderSize = 12;
+static const size_t kBlockSize = 64 * 1024;
+static const uint32_t kStoredBlock = 0x80000000u;
+
+uint32_t loadU32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 | static_cast<uint32_t>(p[2]) << 16 |
+           static_cast<uint32_t>(p[3]) << 24;
+}
+
+// Decodes one LZ4 block of src[0, n) into exactly dstSize bytes at dst,
+// checking every length and offset against both buffers.
+void decompressBlock(const uint8_t* src, size_t n, uint8_t* dst, size_t dstSize) {
+    const uint8_t* const end = src + n;
+    uint8_t* op = dst;
+    uint8_t* const opEnd = dst + dstSize;
+    auto corrupt = []() { throw runtime_error("Corrupt payload"); };
+    auto length = [&](size_t len) {
+        if (len == 15) {
+            uint8_t b;
+            do {
+                if (src == end) corrupt();
+                b = *src++;
+                len += b;
+            } while (b == 255);
+        }
+        return len;
+    };
+    while (true) {
+        if (src == end) corrupt();
+        const uint8_t token = *src++;
+        size_t literals = length(token >> 4);
+        if (literals > static_cast<size_t>(end - src) || literals > static_cast<size_t>(opEnd - op)) corrupt();
+        memcpy(op, src, literals);
+        op += literals;
+        src += literals;
+        if (src == end) break;
+        if (end - src < 2) corrupt();
+        size_t offset = src[0] | static_cast<size_t>(src[1]) << 8;
+        src += 2;
+        size_t match = length(token & 15) + 4;
+        if (offset == 0 || offset > static_cast<size_t>(op - dst) || match > static_cast<size_t>(opEnd - op)) {
+            corrupt();
+        }
+        const uint8_t* from = op - offset;
+        if (offset >= match) {
+            memcpy(op, from, match);
+            op += match;
+        } else {
+            // Overlapping: the match repeats the last `offset` bytes.
+            for (size_t i = 0; i < match; ++i) *op++ = *from++;
+        }
+    }
+    if (op != opEnd) corrupt();
+}
+
+// The payload as laid out before compression. An uncompressed one is read in
+// place from the loaded resource and never copied. A compressed one is
+// inflated block by block as reads reach each block, so the bodies of
+// functions that never run stay compressed. Reads come from startup and from
+// decoding under the image's load lock, never from two threads at once.
+class Payload {
+public:
+    Payload(const uint8_t* data, size_t size) : data_(data), size_(size) {
+        if (size < kHeaderSize) throw runtime_error("Payload too small");
+        if (loadU32(data) != kVersion) throw runtime_error("Unsupported payload version");
+        const uint32_t flags = loadU32(data + 4);
+        if (flags & ~kCompressed) throw runtime_error("Unsupported payload flags");
+        if (!(flags & kCompressed)) return;
+
+        size_t pos = kHeaderSize;
+        auto next = [&]() {
+            if (size_ - pos < 4) throw runtime_error("Unexpected end of payload");
+            pos += 4;
+            return loadU32(data_ + pos - 4);
+        };
+        const uint32_t rawSize = next();
+        const uint32_t numBlocks = next();
+        if (rawSize > SIZE_MAX - kHeaderSize || numBlocks != (size_t(rawSize) + kBlockSize - 1) / kBlockSize) {
+            throw runtime_error("Corrupt payload");
+        }
+        blocks_.resize(numBlocks);
+        size_t offset = pos + size_t(numBlocks) * 4;
+        for (auto& block : blocks_) {
+            const uint32_t stored = next();
+            block.offset = offset;
+            block.size = stored & ~kStoredBlock;
+            block.stored = (stored & kStoredBlock) != 0;
+            offset += block.size;
+            if (offset > size_) throw runtime_error("Unexpected end of payload");
+        }
+        raw_.reset(new uint8_t[kHeaderSize + rawSize]);
+        memcpy(raw_.get(), data_, kHeaderSize);
+        size_ = kHeaderSize + rawSize;
+    }
+
+    size_t size() const { return size_; }
+
+    // n bytes at pos, inflating the blocks they span first.
+    const uint8_t* at(size_t pos, size_t n) {
+        if (pos > size_ || n > size_ - pos) throw runtime_error("Unexpected end of payload");
+        if (!raw_) return data_ + pos;
+        if (n > 0 && pos + n > kHeaderSize) {
+            size_t first = pos < kHeaderSize ? 0 : (pos - kHeaderSize) / kBlockSize;
+            size_t last = (pos + n - 1 - kHeaderSize) / kBlockSize;
+            for (size_t b = first; b <= last; ++b) {
+                if (!blocks_[b].inflated) inflate(b);
+            }
+        }
+        return raw_.get() + pos;
+    }
 
-uint32_t readU32(const vector<uint8_t>& data, size_t& pos) {
-    if (pos + 4 > data.size()) throw runtime_error("Unexpected end of payload");
-    uint32_t v = 0;
-    v |= static_cast<uint32_t>(data[pos]);
-    v |= static_cast<uint32_t>(data[pos + 1]) << 8;
-    v |= static_cast<uint32_t>(data[pos + 2]) << 16;
-    v |= static_cast<uint32_t>(data[pos + 3]) << 24;
+private:
+    struct Block {
+        size_t offset = 0;
+        uint32_t size = 0;
+        bool stored = false;
+        bool inflated = false;
+    };
+
+    void inflate(size_t b) {
+        Block& block = blocks_[b];
+        uint8_t* dst = raw_.get() + kHeaderSize + b * kBlockSize;
+        const size_t n = min(kBlockSize, size_ - kHeaderSize - b * kBlockSize);
+        if (block.stored) {
+            if (block.size != n) throw runtime_error("Corrupt payload");
+            memcpy(dst, data_ + block.offset, n);
+        } else {
+            decompressBlock(data_ + block.offset, block.size, dst, n);
+        }
+        block.inflated = true;
+    }
+
+    const uint8_t* data_;
+    size_t size_;
+    vector<Block> blocks_;
+    unique_ptr<uint8_t[]> raw_;
+};
+
+uint32_t readU32(Payload& payload, size_t& pos) {
+    uint32_t v = loadU32(payload.at(pos, 4));
     pos += 4;
     return v;
 }
 
-string readString(const vector<uint8_t>& data, size_t& pos) {
-    uint32_t len = readU32(data, pos);
-    if (pos + len > data.size()) throw runtime_error("Unexpected end of payload");
-    string s(reinterpret_cast<const char*>(&data[pos]), reinterpret_cast<const char*>(&data[pos]) + len);
+string readString(Payload& payload, size_t& pos) {
+    uint32_t len = readU32(payload, pos);
+    string s(reinterpret_cast<const char*>(payload.at(pos, len)), len);
     pos += len;
     return s;
 }
 
-int runVM(const vector<Function>& functions, const vector<string>& strings, int entryFunc) {
-    vector<int> stack;
-    vector<Frame> callStack;
+// Where each function's body is; numParams and numLocals go straight into
+// the Program.
+struct IndexEntry {
+    uint32_t codeLen = 0;
+    uint32_t offset = 0;
+};
 
-    int funcIndex = entryFunc;
-    int ip = 0;
-    vector<int> locals(functions[funcIndex].numLocals, 0);
+// Worker count defaults to the core count; S_THREADS overrides it.
+int threadCount() {
+    if (const char* env = getenv("S_THREADS")) {
+        int n = atoi(env);
+        if (n > 0) return n;
+    }
+    return static_cast<int>(thread::hardware_concurrency());
+}
 
-    auto pop = [&]() {
-        int v = stack.back();
-        stack.pop_back();
-        return v;
+// Only the function index is read up front. A function's name and code are
+// decoded, and verified, on its first call.
+int runVM(Program& program, Payload& payload, const vector<IndexEntry>& index, int entryFunc) {
+    size_t codeSize = 0;
+    for (const auto& e : index) codeSize += e.codeLen;
+    auto decode = [&](int f) {
+        Function& fn = program.functions[f];
+        size_t pos = index[f].offset;
+        fn.name = readString(payload, pos);
+        const uint32_t codeLen = index[f].codeLen;
+        if (codeLen > (payload.size() - pos) / 4) throw runtime_error("Unexpected end of payload");
+        const uint8_t* p = payload.at(pos, size_t(codeLen) * 4);
+        fn.code.resize(codeLen);
+        for (uint32_t j = 0; j < codeLen; ++j) fn.code[j] = static_cast<int>(loadU32(p + size_t(j) * 4));
     };
-
-    while (true) {
-        const vector<int>& code = functions[funcIndex].code;
-        if (ip >= static_cast<int>(code.size())) {
-            throw runtime_error("Instruction pointer out of range");
-        }
-        int op = code[ip++];
-        switch (op) {
-            case OP_PUSH_INT: stack.push_back(code[ip++]); break;
-            case OP_LOAD: stack.push_back(locals.at(code[ip++])); break;
-            case OP_STORE: {
-                int idx = code[ip++];
-                locals.at(idx) = pop();
-                break;
-            }
-            case OP_ADD: { int b = pop(), a = pop(); stack.push_back(a + b); break; }
-            case OP_SUB: { int b = pop(), a = pop(); stack.push_back(a - b); break; }
-            case OP_MUL: { int b = pop(), a = pop(); stack.push_back(a * b); break; }
-            case OP_DIV: {
-                int b = pop(), a = pop();
-                if (b == 0) throw runtime_error("Division by zero");
-                stack.push_back(a / b);
-                break;
-            }
-            case OP_EQ: { int b = pop(), a = pop(); stack.push_back(a == b ? 1 : 0); break; }
-            case OP_NE: { int b = pop(), a = pop(); stack.push_back(a != b ? 1 : 0); break; }
-            case OP_LT: { int b = pop(), a = pop(); stack.push_back(a < b ? 1 : 0); break; }
-            case OP_LE: { int b = pop(), a = pop(); stack.push_back(a <= b ? 1 : 0); break; }
-            case OP_GT: { int b = pop(), a = pop(); stack.push_back(a > b ? 1 : 0); break; }
-            case OP_GE: { int b = pop(), a = pop(); stack.push_back(a >= b ? 1 : 0); break; }
-            case OP_JMP: ip = code[ip]; break;
-            case OP_JMP_IF_FALSE: {
-                int target = code[ip++];
-                int cond = pop();
-                if (cond == 0) ip = target;
-                break;
-            }
-            case OP_CALL: {
-                int callee = code[ip++];
-                int argCount = code[ip++];
-                const Function& fn = functions[callee];
-                if (argCount != fn.numParams) throw runtime_error("Call arity mismatch");
-
-                vector<int> newLocals(fn.numLocals, 0);
-                for (int i = argCount - 1; i >= 0; --i) {
-                    newLocals[i] = pop();
-                }
-
-                callStack.push_back({funcIndex, ip, locals});
-                funcIndex = callee;
-                ip = 0;
-                locals.swap(newLocals);
-                break;
-            }
-            case OP_RET: {
-                int ret = pop();
-                if (callStack.empty()) return ret;
-                Frame fr = callStack.back();
-                callStack.pop_back();
-                funcIndex = fr.funcIndex;
-                ip = fr.ip;
-                locals.swap(fr.locals);
-                stack.push_back(ret);
-                break;
-            }
-            case OP_PRINT: {
-                int v = pop();
-                cout << v << "\n";
-                break;
-            }
-            case OP_PRINT_STR: {
-                int idx = code[ip++];
-                if (idx < 0 || idx >= static_cast<int>(strings.size())) {
-                    throw runtime_error("String index out of range");
-                }
-                cout << strings[idx] << "\n";
-                break;
-            }
-            case OP_POP: {
-                pop();
-                break;
-            }
-            default:
-                throw runtime_error("Unknown opcode");
-        }
-    }
+    svm::Image<Program> image(program, codeSize, decode);
+    Scheduler sched(image, threadCount(), svm::executeCached<RuntimePolicy, Program>);
+    return svm::executeCached<RuntimePolicy>(image, entryFunc, {}, sched.mainWorker(), sched);
 }
 
 int main(int argc, char** argv) {
@@ -174,42 +236,48 @@ int main(int argc, char** argv) {
         HGLOBAL hRes = LoadResource(NULL, res);
         if (!hRes) throw runtime_error("LoadResource failed");
         DWORD size = SizeofResource(NULL, res);
-        if (size < 8) throw runtime_error("Payload too small");
         void* data = LockResource(hRes);
         if (!data) throw runtime_error("LockResource failed");
-        vector<uint8_t> payload(reinterpret_cast<uint8_t*>(data), reinterpret_cast<uint8_t*>(data) + size);
-
-        size_t pos = 0;
-        uint32_t version = readU32(payload, pos);
-        if (version != kVersion) throw runtime_error("Unsupported payload version");
+        Payload payload(static_cast<const uint8_t*>(data), size);
 
+        size_t pos = 8; // past the version and flags
         uint32_t entry = readU32(payload, pos);
 
+        Program program;
         uint32_t numStrings = readU32(payload, pos);
-        vector<string> strings;
-        strings.reserve(numStrings);
+        program.strings.reserve(numStrings);
         for (uint32_t i = 0; i < numStrings; ++i) {
-            strings.push_back(readString(payload, pos));
+            program.strings.push_back(readString(payload, pos));
+        }
+
+        // Natives are stored by name and bound to this runtime's builtins.
+        uint32_t numNatives = readU32(payload, pos);
+        for (uint32_t i = 0; i < numNatives; ++i) {
+            Native native;
+            native.name = readString(payload, pos);
+            native.numParams = static_cast<int>(readU32(payload, pos));
+            for (const auto& b : svm::builtinNatives()) {
+                if (native.name == b.name && native.numParams == b.numParams) native.fn = b.fn;
+            }
+            if (!native.fn) throw runtime_error("Unknown native function: " + native.name);
+            program.natives.push_back(std::move(native));
         }
 
         uint32_t numFunctions = readU32(payload, pos);
-        vector<Function> functions;
-        functions.reserve(numFunctions);
+        if (numFunctions > (payload.size() - pos) / 16) throw runtime_error("Unexpected end of payload");
+        program.functions.resize(numFunctions);
+        vector<IndexEntry> index(numFunctions);
         for (uint32_t i = 0; i < numFunctions; ++i) {
-            Function fn;
-            fn.name = readString(payload, pos);
+            Function& fn = program.functions[i];
             fn.numParams = static_cast<int>(readU32(payload, pos));
             fn.numLocals = static_cast<int>(readU32(payload, pos));
-            uint32_t codeLen = readU32(payload, pos);
-            fn.code.reserve(codeLen);
-            for (uint32_t j = 0; j < codeLen; ++j) {
-                fn.code.push_back(static_cast<int>(readU32(payload, pos)));
-            }
-            functions.push_back(std::move(fn));
+            index[i].codeLen = readU32(payload, pos);
+            index[i].offset = readU32(payload, pos);
+            if (fn.numParams < 0 || fn.numLocals < fn.numParams) throw runtime_error("Invalid function index");
         }
 
-        if (entry >= functions.size()) throw runtime_error("Invalid entry function");
-        return runVM(functions, strings, static_cast<int>(entry));
+        if (entry >= program.functions.size()) throw runtime_error("Invalid entry function");
+        return runVM(program, payload, index, static_cast<int>(entry));
     } catch (const exception& ex) {
         cerr << "Error: " << ex.what() << "\n";
         return 1;